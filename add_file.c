@@ -9,6 +9,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <limits.h>
+#include <stddef.h>
 #include "opennap.h"
 #include "debug.h"
 
@@ -20,142 +21,695 @@ const int BitRate[18] =
 /* allowed sample rates for MPEG V2/3 */
 const int SampleRate[6] = { 16000, 24000, 22050, 32000, 44100, 48000 };
 
-static void
-fdb_add (HASH * table, char *key, DATUM * d)
+/* next id to assign to a DATUM.  since files are always appended to the
+   posting lists, this keeps each list sorted by id */
+static unsigned int Datum_Id = 0;
+
+IDMAP *Live_Ids = 0;
+
+/* make room in Live_Ids for `id', which is past the end of the map.  the
+   search threads may be reading the map, so a new one is built and the old
+   one retired.  words at the front for files which are all gone are
+   dropped at the same time */
+static int
+live_grow (unsigned int id)
+{
+    IDMAP *map = Live_Ids, *n;
+    unsigned int skip = 0, words = 0, base, nbits;
+
+    if (map)
+    {
+	words = map->nbits / 32;
+	while (skip < words && !map->bits[skip])
+	    skip++;
+	base = map->base + skip * 32;
+    }
+    else
+	base = id & ~31;
+    nbits = ((id - base) / 32 + 1) * 64;
+    if (nbits < 4096)
+	nbits = 4096;
+    n = MALLOC (sizeof (IDMAP) + nbits / 8);
+    if (!n)
+    {
+	OUTOFMEMORY ("live_grow");
+	return -1;
+    }
+    n->base = base;
+    n->nbits = nbits;
+    memset (n->bits, 0, nbits / 8);
+    if (map)
+	memcpy (n->bits, map->bits + skip, (words - skip) * sizeof (int));
+    PUBLISH (Live_Ids, n);
+    if (map)
+	retire (map);
+    return 0;
+}
+
+IDTABLE *Datums = 0;
+
+/* make room in Datums for `id', in the same way as live_grow() */
+static int
+datums_grow (unsigned int id)
+{
+    IDTABLE *t = Datums, *n;
+    int skip = 0, npages;
+    unsigned int base;
+
+    if (t)
+    {
+	while (skip < t->npages && !t->pages[skip])
+	    skip++;
+	base = t->base + skip * ID_PAGE;
+    }
+    else
+	base = id - id % ID_PAGE;
+    npages = ((id - base) / ID_PAGE + 1) * 2;
+    if (npages < 16)
+	npages = 16;
+    n = MALLOC (sizeof (IDTABLE) + sizeof (IDPAGE *) * (npages - 1));
+    if (!n)
+    {
+	OUTOFMEMORY ("datums_grow");
+	return -1;
+    }
+    n->base = base;
+    n->npages = npages;
+    memset (n->pages, 0, sizeof (IDPAGE *) * npages);
+    if (t)
+	memcpy (n->pages, t->pages + skip,
+		sizeof (IDPAGE *) * (t->npages - skip));
+    PUBLISH (Datums, n);
+    if (t)
+	retire (t);
+    return 0;
+}
+
+/* returns the page of the table `t' holding `id', or 0 if all of its
+   files are gone.  the search threads call this with their snapshot of
+   Datums */
+IDPAGE *
+id_page (IDTABLE * t, unsigned int id)
+{
+    unsigned int off = id - t->base;
+
+    if (ID_LT (id, t->base) || off / ID_PAGE >= (unsigned int) t->npages)
+	return 0;
+    return SNAPSHOT (t->pages[off / ID_PAGE]);
+}
+
+/* returns the DATUM with `id' in the table `t', or 0 if it is gone */
+DATUM *
+id_datum (IDTABLE * t, unsigned int id)
+{
+    IDPAGE *page = id_page (t, id);
+
+    return page ? SNAPSHOT (page->d[(id - t->base) % ID_PAGE]) : 0;
+}
+
+/* enter `d' in Datums under its id */
+static int
+datums_add (DATUM * d)
+{
+    unsigned int off;
+    IDPAGE *page;
+
+    if ((!Datums || d->id - Datums->base >=
+	 (unsigned int) Datums->npages * ID_PAGE) && datums_grow (d->id))
+	return -1;
+    off = d->id - Datums->base;
+    page = Datums->pages[off / ID_PAGE];
+    if (!page)
+    {
+	if (!(page = CALLOC (1, sizeof (IDPAGE))))
+	{
+	    OUTOFMEMORY ("datums_add");
+	    return -1;
+	}
+	PUBLISH (Datums->pages[off / ID_PAGE], page);
+    }
+    PUBLISH (page->d[off % ID_PAGE], d);
+    page->live++;
+    return 0;
+}
+
+/* called when a file is no longer shared */
+void
+unshare_datum (DATUM * d)
+{
+    unsigned int off = d->id - Live_Ids->base;
+    IDPAGE *page;
+
+    ASSERT (ID_LIVE (Live_Ids, d->id));
+    Live_Ids->bits[off / 32] &= ~(1U << (off % 32));
+    Dead_Postings += d->postings;
+
+    off = d->id - Datums->base;
+    page = Datums->pages[off / ID_PAGE];
+    ASSERT (page != 0);
+    PUBLISH (page->d[off % ID_PAGE], 0);
+    if (--page->live == 0)
+    {
+	PUBLISH (Datums->pages[off / ID_PAGE], 0);
+	retire (page);
+    }
+}
+
+/* grow the array of a list which a search thread may be reading by
+   copying it, the old one is freed once the search is finished */
+static int
+flist_copy (FLIST * files, int max)
+{
+    unsigned int *ids;
+    void *ptr;
+
+    if (!(ids = MALLOC (sizeof (int) * max)))
+	return -1;
+    memcpy (ids, files->ids, sizeof (int) * files->count);
+    ptr = files->ids;
+    PUBLISH (files->ids, ids);
+    retire (ptr);
+    return 0;
+}
+
+/* returns the list for `key', whose hash code is `sum', creating it if
+   there isn't one yet */
+static FLIST *
+flist_get (HASH * table, char *key, hash_t sum)
 {
     FLIST *files;
-    LIST *list;
 
     ASSERT (table != 0);
     ASSERT (key != 0);
-    ASSERT (d != 0);
-    files = hash_lookup (table, key);
+    files = hash_lookup_sum (table, key, sum);
     /* if there is no entry for this particular word, create one now */
     if (!files)
     {
-	files = CALLOC (1, sizeof (FLIST));
+	/* the key is stored after the struct.  most lists are very short,
+	   especially in the MD5 table, so this saves a lot of small
+	   allocations */
+	files = CALLOC (1, sizeof (FLIST) + strlen (key) + 1);
 	if (!files)
 	{
-	    OUTOFMEMORY ("fdb_add");
-	    return;
-	}
-	files->key = STRDUP (key);
-	if (!files->key)
-	{
-	    OUTOFMEMORY ("fdb_add");
-	    FREE (files);
-	    return;
+	    OUTOFMEMORY ("flist_get");
+	    return 0;
 	}
+	files->key = (char *) (files + 1);
+	strcpy (files->key, key);
 	if (hash_add (table, files->key, files))
 	{
-	    FREE (files->key);
 	    FREE (files);
-	    return;
+	    return 0;
 	}
     }
-    list = CALLOC (1, sizeof (LIST));
-    if (!list)
+    return files;
+}
+
+/* make room for `n' more entries in `files'.  the array grows
+   geometrically so that appending is amortized O(1) */
+static int
+flist_reserve (HASH * table, FLIST * files, int n)
+{
+    int max = files->max ? files->max : 1;
+
+    if (files->count + n <= files->max)
+	return 0;
+    while (max < files->count + n)
+	max *= 2;
+    if (files->pins ? flist_copy (files, max) :
+	safe_realloc ((void **) &files->ids, sizeof (int) * max))
     {
-	OUTOFMEMORY ("list");
-	if (!files->list)
+	OUTOFMEMORY ("flist_reserve");
+	if (!files->count)
 	    hash_remove (table, files->key);
+	return -1;
+    }
+    files->max = max;
+    return 0;
+}
+
+#if RESUME
+static void
+fdb_add (HASH * table, char *key, DATUM * d)
+{
+    FLIST *files;
+
+    ASSERT (d != 0);
+    if (!(files = flist_get (table, key, hash_string (key))) ||
+	flist_reserve (table, files, 1))
 	return;
+    /* fill in the new entry before making it visible to the search
+       threads */
+    files->ids[files->count] = d->id;
+    PUBLISH (files->count, files->count + 1);
+}
+#endif /* RESUME */
+
+/* files waiting to be added to File_Table.  clients send their whole
+   library as soon as they log in, thousands of files at a time.  so that
+   this doesn't hold up everyone else, arriving files only go into the
+   user's own table, which is all that browsing and downloading need, and
+   are indexed a batch at a time by fdb_index_step() in between handling
+   clients.  within a batch the files are grouped by word so that each
+   distinct word is looked up and appended to once.
+
+   files have to be indexed in the order of their ids.  a user may leave
+   before all of their files have been indexed, so the id is kept with each
+   entry and the DATUM is only looked at while the id is live */
+typedef struct
+{
+    DATUM *d;
+    unsigned int id;
+}
+PENDING;
+
+static PENDING *Pending = 0;
+static int Pending_Head = 0;	/* next entry to index */
+static int Pending_Count = 0;	/* entries used, including those before
+				   Pending_Head */
+static int Pending_Max = 0;
+
+/* the files in a batch with the same word.  the postings for each word
+   are chained in the order the files were queued, which is the order of
+   their ids */
+typedef struct
+{
+    char *word;
+    hash_t sum;
+    int head;			/* first posting */
+    int tail;			/* last posting */
+    int count;			/* different files */
+}
+WORDGROUP;
+
+typedef struct
+{
+    DATUM *d;
+    int next;			/* next posting for the same word, or -1 */
+}
+POSTING;
+
+/* work space for index_batch(), which is kept to avoid fragmenting the heap
+   with large short lived allocations during a storm of shares */
+static char *Text = 0;		/* copies of the filenames */
+static int Text_Max = 0;
+static POSTING *Post = 0;
+static WORDGROUP *Group = 0;
+static int Post_Max = 0;	/* size of both Post and Group */
+static int *Slot = 0;		/* index of Group by hash code */
+static int Slot_Max = 0;
+
+/* add up to `max' of the files in Pending to File_Table */
+static void
+index_batch (int max)
+{
+    char *s, *words[30];
+    hash_t sums[30];
+    WORDGROUP *g;
+    int ngroups = 0, nposts = 0;
+    int i, j, n, len, end;
+    LIST *tokens, *ptr;
+    FLIST *files;
+    DATUM *d;
+
+    /* the words are split out of copies of the names.  files which are no
+       longer shared are skipped, their memory may have been freed */
+    for (end = Pending_Head, n = 0, len = 0; end < Pending_Count && n < max;
+	 end++)
+    {
+	if (ID_LIVE (Live_Ids, Pending[end].id))
+	{
+	    d = Pending[end].d;
+	    len += strlen (d->dir->name) + strlen (d->name) + 1;
+	    n++;
+	}
+    }
+    if (len > Text_Max)
+    {
+	if (safe_realloc ((void **) &Text, len))
+	    goto nomem;
+	Text_Max = len;
+    }
+    if (!Slot_Max)
+    {
+	if (!(Slot = MALLOC (sizeof (int) * 1024)))
+	    goto nomem;
+	Slot_Max = 1024;
+    }
+    memset (Slot, -1, sizeof (int) * Slot_Max);
+
+    for (i = Pending_Head, s = Text; i < end; i++)
+    {
+	if (!ID_LIVE (Live_Ids, Pending[i].id))
+	    continue;
+	d = Pending[i].d;
+	/* make sure there is room for another file's worth of words */
+	if (nposts + 30 > Post_Max)
+	{
+	    n = Post_Max ? Post_Max * 2 : 8 * max + 30;
+	    if (safe_realloc ((void **) &Post, sizeof (POSTING) * n) ||
+		safe_realloc ((void **) &Group, sizeof (WORDGROUP) * n))
+		goto nomem;
+	    Post_Max = n;
+	}
+	if (ngroups + 30 > Slot_Max / 2)
+	{
+	    if (safe_realloc ((void **) &Slot, sizeof (int) * Slot_Max * 2))
+		goto nomem;
+	    Slot_Max *= 2;
+	    memset (Slot, -1, sizeof (int) * Slot_Max);
+	    for (j = 0; j < ngroups; j++)
+	    {
+		for (n = Group[j].sum & (Slot_Max - 1); Slot[n] != -1;
+		     n = (n + 1) & (Slot_Max - 1))
+		    ;
+		Slot[n] = j;
+	    }
+	}
+
+	len = sprintf (s, "%s%s", d->dir->name, d->name);
+	n = tokenize_words (s, words, sums, 30);
+	if (n == -1)
+	{
+	    /* there is little point in indexing very long names under every
+	       word, so if there are more than 30 different words, discard
+	       the first several */
+	    sprintf (s, "%s%s", d->dir->name, d->name);
+	    tokens = tokenize (s);
+	    n = list_count (tokens);
+	    for (ptr = tokens; n > 30; n--)
+		ptr = ptr->next;
+	    for (n = 0; ptr; ptr = ptr->next, n++)
+	    {
+		words[n] = ptr->data;
+		sums[n] = hash_string (words[n]);
+	    }
+	    list_free (tokens, 0);
+	}
+	s += len + 1;
+
+	/* add each word to its group */
+	for (j = 0; j < n; j++)
+	{
+	    unsigned int k = sums[j] & (Slot_Max - 1);
+
+	    for (; Slot[k] != -1; k = (k + 1) & (Slot_Max - 1))
+	    {
+		g = &Group[Slot[k]];
+		if (g->sum == sums[j] && !strcmp (g->word, words[j]))
+		    break;
+	    }
+	    if (Slot[k] == -1)
+	    {
+		Slot[k] = ngroups;
+		g = &Group[ngroups++];
+		g->word = words[j];
+		g->sum = sums[j];
+		g->head = -1;
+		g->count = 0;
+	    }
+	    else if (Post[g->tail].d == d)
+		continue;	/* word appears more than once in the name */
+	    Post[nposts].d = d;
+	    Post[nposts].next = -1;
+	    if (g->head == -1)
+		g->head = nposts;
+	    else
+		Post[g->tail].next = nposts;
+	    g->tail = nposts++;
+	    g->count++;
+	}
     }
-    list->data = d;
-    files->list = list_append (files->list, list);
-    files->count++;
-    d->refcount++;
+
+    /* append each group's files to its list */
+    for (i = 0; i < ngroups; i++)
+    {
+	g = &Group[i];
+	if (!(files = flist_get (File_Table, g->word, g->sum)) ||
+	    flist_reserve (File_Table, files, g->count))
+	    continue;
+	/* fill in the new entries before making them visible to the search
+	   threads */
+	for (j = g->head, n = files->count; j != -1; j = Post[j].next)
+	{
+	    files->ids[n++] = Post[j].d->id;
+	    Post[j].d->postings++;
+	}
+	File_Postings += n - files->count;
+	PUBLISH (files->count, n);
+    }
+    goto done;
+
+  nomem:
+    OUTOFMEMORY ("index_batch");
+  done:
+    Pending_Head = end;
+    if (Pending_Head == Pending_Count)
+	Pending_Head = Pending_Count = 0;
+    else if (Pending_Head > Pending_Max / 2)
+    {
+	/* move the rest to the front so the array doesn't keep growing */
+	Pending_Count -= Pending_Head;
+	memmove (Pending, Pending + Pending_Head,
+		 sizeof (PENDING) * Pending_Count);
+	Pending_Head = 0;
+    }
+}
+
+/* index some of the files waiting in Pending.  `Index_Step' limits the
+   number of files done each time through the main loop.  returns nonzero
+   if there are more waiting */
+int
+fdb_index_step (void)
+{
+    if (Pending_Head < Pending_Count)
+	index_batch (Index_Step > 0 ? Index_Step : Pending_Count);
+    return Pending_Head < Pending_Count;
+}
+
+/* number of files waiting to be indexed, some of which may have been
+   removed since */
+int
+fdb_backlog (void)
+{
+    return Pending_Count - Pending_Head;
+}
+
+#if DEBUG
+void
+fdb_index_free (void)
+{
+    if (Pending)
+	FREE (Pending);
+    if (Text)
+	FREE (Text);
+    if (Post)
+	FREE (Post);
+    if (Group)
+	FREE (Group);
+    if (Slot)
+	FREE (Slot);
+}
+#endif /* DEBUG */
+
+/* queue a file to be added to File_Table, see fdb_index_step() */
+static void
+fdb_queue (DATUM * d)
+{
+    if (Pending_Count == Pending_Max)
+    {
+	if (safe_realloc ((void **) &Pending,
+			  sizeof (PENDING) * (Pending_Max ? Pending_Max * 2 : 64)))
+	{
+	    OUTOFMEMORY ("fdb_queue");
+	    return;
+	}
+	Pending_Max = Pending_Max ? Pending_Max * 2 : 64;
+    }
+    Pending[Pending_Count].d = d;
+    Pending[Pending_Count++].id = d->id;
+}
+
+/* compares the full name of `d' with `key'.  the user's file table only
+   keeps the hash code of the names, see new_datum() */
+static int
+datum_match (const char *key, DATUM * d)
+{
+    int len = strlen (d->dir->name);
+
+    return strncasecmp (key, d->dir->name, len) ||
+	strcasecmp (key + len, d->name);
 }
 
 /* common code for inserting a file into the various hash tables */
 static void
 insert_datum (DATUM * info, char *av)
 {
-    LIST *tokens, *ptr;
-    unsigned int fsize;
+    USER *user;
+    unsigned int fsize, off;
+#if RESUME
+    char hash[33];
+#endif
 
     ASSERT (info != 0);
     ASSERT (av != 0);
+    user = info->dir->user;
 
-    if (!info->user->con->uopt->files)
+    if (!user->con->uopt->files)
     {
 	/* create the hash table */
-	info->user->con->uopt->files =
-	    hash_init (257, (hash_destroy) free_datum);
-	if (!info->user->con->uopt->files)
+	user->con->uopt->files = hash_init (16, (hash_destroy) unshare_datum);
+	if (!user->con->uopt->files)
 	{
 	    OUTOFMEMORY ("insert_datum");
 	    return;
 	}
+	user->con->uopt->files->match = (hash_match) datum_match;
     }
 
-    hash_add (info->user->con->uopt->files, info->filename, info);
-    info->refcount++;
-
-    /* split the filename into words */
-    tokens = tokenize (av);
-
-    /* the filename may not consist of any searchable words, in which
-     * case its not entered into the index.  this file will only be seen
-     * when browsing the user possessing it
-     */
-    if(tokens)
-    {
-	/* add this entry to the global file list.  the data entry currently
-	   can't be referenced more than 32 times so if there are excess tokens,
-	   discard the first several so that the refcount is not overflowed */
-	fsize = list_count (tokens);
-	ptr = tokens;
-	while (fsize > 30)
-	{
-	    ptr = ptr->next;
-	    fsize--;
-	}
-	for (; ptr; ptr = ptr->next)
-	    fdb_add (File_Table, ptr->data, info);
+    info->id = Datum_Id;
+    if ((!Live_Ids ||
+	 info->id - Live_Ids->base >= Live_Ids->nbits) && live_grow (info->id))
+	return;
+    if (datums_add (info))
+	return;
+    Datum_Id++;
+    off = info->id - Live_Ids->base;
+    Live_Ids->bits[off / 32] |= 1U << (off % 32);
+    hash_add (user->con->uopt->files, av, info);
 
-	list_free (tokens, 0);
-    }
+    /* add this entry to the global file list.  the filename may not
+       consist of any searchable words, in which case its not entered into
+       the index.  this file will only be seen when browsing the user
+       possessing it */
+    fdb_queue (info);
 
 #if RESUME
     /* index by md5 hash */
-    fdb_add (MD5, info->hash, info);
+    fdb_add (MD5, datum_hash (info, hash), info);
 #endif
 
     fsize = info->size / 1024;
-    info->user->shared++;
-    info->user->libsize += fsize;
+    if (user->shared++ == 0)
+	eject_remove (user->con);	/* started sharing */
+    user->libsize += fsize;
     Num_Gigs += fsize;		/* this is actually kB, not gB */
     Num_Files++;
     Local_Files++;
-    info->user->sharing = 1;	/* note that we began sharing */
+    user->sharing = 1;	/* note that we began sharing */
 }
 
-static DATUM *
-new_datum (char *filename, char *hash)
+/* returns the entry for the directory `dir' in the user's arena, making
+   one if this is the first file in it */
+static FILEDIR *
+intern_dir (CONNECTION * con, const char *dir)
 {
-    DATUM *info = CALLOC (1, sizeof (DATUM));
+    USEROPT *opt = con->uopt;
+    FILEDIR *s;
 
-    (void) hash;
-    if (!info)
+    if (!opt->dirs && !(opt->dirs = hash_init (16, 0)))
+	return 0;
+    s = hash_lookup (opt->dirs, dir);
+    /* the table is case insensitive, but the name has to be sent back
+       exactly as the client gave it */
+    if (s && !strcmp (s->name, dir))
+	return s;
+    s = arena_alloc (&opt->arena,
+		     offsetof (FILEDIR, name) + strlen (dir) + 1);
+    if (!s)
+	return 0;
+    s->user = con->user;
+    strcpy (s->name, dir);
+    if (!hash_lookup (opt->dirs, dir))
+	hash_add (opt->dirs, s->name, s);
+    return s;
+}
+
+#if RESUME
+static int
+unhex (int c)
+{
+    if (c >= '0' && c <= '9')
+	return c - '0';
+    if (c >= 'a' && c <= 'f')
+	return c - 'a' + 10;
+    return -1;
+}
+
+/* store the md5 hash given by the client.  nearly all are 32 lower case
+   hex digits, which are kept as 16 bytes */
+static int
+set_hash (ARENA * arena, DATUM * d, const char *hash)
+{
+    int i, hi, lo;
+
+    for (i = 0; i < 16; i++)
     {
-	OUTOFMEMORY ("new_datum");
+	if ((hi = unhex (hash[2 * i])) == -1 ||
+	    (lo = unhex (hash[2 * i + 1])) == -1)
+	    break;
+	d->hash.md5[i] = (hi << 4) | lo;
+    }
+    if (i == 16 && !hash[32])
+    {
+	d->binhash = 1;
 	return 0;
     }
-    info->filename = STRDUP (filename);
-    if (!info->filename)
+    d->hash.text = arena_strdup (arena, hash);
+    return d->hash.text ? 0 : -1;
+}
+
+/* returns the hash of `d' as text.  `buf' must have room for 33 chars */
+char *
+datum_hash (DATUM * d, char *buf)
+{
+    static const char hex[] = "0123456789abcdef";
+    int i;
+
+    if (!d->binhash)
+	return d->hash.text;
+    for (i = 0; i < 16; i++)
+    {
+	buf[2 * i] = hex[d->hash.md5[i] >> 4];
+	buf[2 * i + 1] = hex[d->hash.md5[i] & 15];
+    }
+    buf[32] = 0;
+    return buf;
+}
+#endif /* RESUME */
+
+/* the DATUM and its strings are allocated from the user's arena, and are
+   freed all at once when the user leaves */
+static DATUM *
+new_datum (CONNECTION * con, char *filename, char *hash)
+{
+    FILEDIR *dir;
+    DATUM *info;
+    char *name, c;
+
+    (void) hash;
+    /* split off the directory, which is shared with the user's other
+       files in it */
+    name = filename + strlen (filename);
+    while (name > filename && name[-1] != '\\' && name[-1] != '/')
+	name--;
+    c = *name;
+    *name = 0;
+    dir = intern_dir (con, filename);
+    *name = c;
+    info = arena_alloc (&con->uopt->arena,
+			offsetof (DATUM, name) + strlen (name) + 1);
+    if (!dir || !info)
     {
 	OUTOFMEMORY ("new_datum");
-	FREE (info);
 	return 0;
     }
+    info->dir = dir;
+    strcpy (info->name, name);
 #if RESUME
-    info->hash = STRDUP (hash);
-    if (!info->hash)
+    if (set_hash (&con->uopt->arena, info, hash))
     {
 	OUTOFMEMORY ("new_datum");
-	FREE (info->filename);
-	FREE (info);
 	return 0;
     }
 #endif
@@ -248,9 +802,8 @@ HANDLER (add_file)
     }
 
     /* create the db record for this file */
-    if (!(info = new_datum (av[0], av[1])))
+    if (!(info = new_datum (con, av[0], av[1])))
 	return;
-    info->user = con->user;
     info->size = fsize;
     info->bitrate = bitrateToMask (atoi (av[3]), con->user);
     info->frequency = freqToMask (atoi (av[4]), con->user);
@@ -338,9 +891,8 @@ HANDLER (share_file)
 	return;
     }
 
-    if (!(info = new_datum (av[0], av[2])))
+    if (!(info = new_datum (con, av[0], av[2])))
 	return;
-    info->user = con->user;
     info->size = fsize;
     info->type = type;
 
@@ -498,9 +1050,8 @@ HANDLER (add_directory)
 	}
 
 	/* create the db record for this file */
-	if (!(info = new_datum (path, md5)))
+	if (!(info = new_datum (con, path, md5)))
 	    return;
-	info->user = con->user;
 	info->size = fsize;
 	info->bitrate = bitrateToMask (atoi (bitrate), con->user);
 	info->frequency = freqToMask (atoi (freq), con->user);
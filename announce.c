@@ -19,6 +19,7 @@ HANDLER (announce)
 {
     int i, l;
     USER *user;
+    BLOCK *block;
 
     (void) tag;
     (void) len;
@@ -63,11 +64,11 @@ HANDLER (announce)
     pass_message (con, Buf, l);
 
     /* broadcast the message to our local users */
-    for (i = 0; i < Max_Clients; i++)
-    {
-	if (Clients[i] && ISUSER (Clients[i]))
-	    queue_data (Clients[i], Buf, l);
-    }
+    if (!(block = block_new (Buf, l)))
+	return;
+    for (i = 0; i < Local_Users.count; i++)
+	queue_block (Local_Users.con[i], block);
+    block_free (block);
 }
 
 /* 628 [ <nick> ] <message> */
@@ -76,6 +77,8 @@ HANDLER (wallop)
 {
     char *ptr;
     int i, l;
+    BLOCK *block;
+    CONNECTION *c;
 
     (void) tag;
     (void) len;
@@ -104,13 +107,16 @@ HANDLER (wallop)
     pass_message (con, Buf, l);
 
     /* deliver message to local users */
-    for (i = 0; i < Max_Clients; i++)
+    if (!(block = block_new (Buf, l)))
+	return;
+    for (i = 0; i < Local_Users.count; i++)
     {
-	if (Clients[i] && ISUSER (Clients[i]) &&
-	    Clients[i]->user->level >= LEVEL_MODERATOR &&
-	    (Clients[i]->uopt->usermode & WALLOPLOG_MODE))
-	    queue_data (Clients[i], Buf, l);
+	c = Local_Users.con[i];
+	if (c->user->level >= LEVEL_MODERATOR &&
+	    (c->uopt->usermode & WALLOPLOG_MODE))
+	    queue_block (c, block);
     }
+    block_free (block);
 }
 
 /* 10021 :<server> <loglevel> "<message>" */
@@ -126,7 +126,7 @@ HANDLER (ban)
 	b->when = Current_Time;
 	b->timeout = timeout;
 
-	list = CALLOC (1, sizeof (LIST));
+	list = POOL_ALLOC (&List_Pool);
 	if (!list)
 	{
 	    OUTOFMEMORY("ban");
@@ -149,7 +149,7 @@ HANDLER (ban)
     OUTOFMEMORY ("ban");
     free_ban (b);
     if (list)
-	FREE (list);
+	POOL_FREE (&List_Pool, list);
 }
 
 /* 614 [ :<sender> ] <nick!ip> [ "<reason>" ] */
@@ -191,7 +191,7 @@ HANDLER (unban)
 	{
 	    tmpList = *list;
 	    *list = (*list)->next;
-	    FREE (tmpList);
+	    POOL_FREE (&List_Pool, tmpList);
 	    notify_mods (BANLOG_MODE, "%s removed ban on %s: %s",
 			 user->nick, b->target, ac > 1 ? av[1] : "");
 	    pass_message_args (con, tag, ":%s %s \"%s\"", user->nick,
@@ -357,7 +357,7 @@ load_bans (void)
 	    b->reason = STRDUP ("");
 	    b->when = Current_Time;
 	}
-	list = CALLOC (1, sizeof (LIST));
+	list = POOL_ALLOC (&List_Pool);
 	if (!list)
 	{
 	    OUTOFMEMORY ("load_bans");
@@ -389,7 +389,7 @@ expire_bans (void)
 	{
 	    tmp=*list;
 	    *list=(*list)->next;
-	    FREE(tmp);
+	    POOL_FREE (&List_Pool, tmp);
 	    /* make sure all servers are synched up */
 	    pass_message_args(NULL,MSG_CLIENT_UNBAN,":%s %s \"expired after %d seconds\"",
 		    Server_Name, b->target, b->timeout);
@@ -0,0 +1,148 @@
+/* Copyright (C) 2000 drscholl@users.sourceforge.net
+   This is free software distributed under the terms of the
+   GNU Public License.  See the file COPYING for details.
+
+   $Id$ */
+
+/* microbenchmark for hash_lookup() on a table shaped like Users.  the
+   nicks are mixed case and are looked up in a different random case, and
+   one lookup in eight is for a nick which isn't there.  only the public
+   hash.h interface is used, so the same file can be built against an older
+   hash.c for comparison.  build it with `make bench_hash'.  exits with
+   status 1 if a lookup returns the wrong entry */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "hash.h"
+
+#define NUM_USERS 100000
+#define NUM_QUERIES (1 << 16)
+#define LOOPS 100
+
+static const char Chars[] =
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-";
+
+static char *
+random_nick (void)
+{
+    int i, len = 5 + rand () % 10;
+    char *nick = malloc (len + 1);
+
+    if (!nick)
+    {
+	perror ("malloc");
+	exit (1);
+    }
+    for (i = 0; i < len; i++)
+	nick[i] = Chars[rand () % (sizeof (Chars) - 1)];
+    nick[len] = 0;
+    return nick;
+}
+
+/* copy of `s' with the case of each letter picked at random */
+static char *
+random_case (const char *s)
+{
+    char *p, *d = strdup (s);
+
+    if (!d)
+    {
+	perror ("strdup");
+	exit (1);
+    }
+    for (p = d; *p; p++)
+	*p = (rand () & 1) ? toupper ((unsigned char) *p) :
+	    tolower ((unsigned char) *p);
+    return d;
+}
+
+int
+main (int argc, char **argv)
+{
+    static char *nicks[NUM_USERS];
+    static char *queries[NUM_QUERIES];
+    static char *expect[NUM_QUERIES];
+    HASH *h;
+    char *found, *miss;
+    int i, r, n, users = NUM_USERS, bad = 0;
+    clock_t start;
+    double t;
+
+    if (argc > 1)
+	users = atoi (argv[1]);
+    if (users < 1 || users > NUM_USERS)
+    {
+	fprintf (stderr, "usage: bench_hash [ <users> ] (at most %d)\n",
+		 NUM_USERS);
+	return 1;
+    }
+    srand (1);
+
+    /* sized like Users in init.c.  the key is the nick stored in the entry
+       itself */
+    h = hash_init (521, 0);
+    for (i = 0; i < users; i++)
+    {
+	nicks[i] = random_nick ();
+	if (hash_lookup (h, nicks[i]))
+	{
+	    /* already taken, in some case */
+	    free (nicks[i]);
+	    i--;
+	    continue;
+	}
+	hash_add (h, nicks[i], nicks[i]);
+    }
+
+    for (i = 0; i < NUM_QUERIES; i++)
+    {
+	if (rand () % 8)
+	{
+	    n = rand () % users;
+	    queries[i] = random_case (nicks[n]);
+	    expect[i] = nicks[n];
+	}
+	else
+	{
+	    /* the extra character means it can't be in the table */
+	    miss = random_nick ();
+	    queries[i] = malloc (strlen (miss) + 2);
+	    if (!queries[i])
+	    {
+		perror ("malloc");
+		return 1;
+	    }
+	    sprintf (queries[i], "%s~", miss);
+	    free (miss);
+	    expect[i] = 0;
+	}
+    }
+
+    start = clock ();
+    for (r = 0; r < LOOPS; r++)
+    {
+	for (i = 0; i < NUM_QUERIES; i++)
+	{
+	    found = hash_lookup (h, queries[i]);
+	    if (found != expect[i])
+		bad++;
+	}
+    }
+    t = (double) (clock () - start) / CLOCKS_PER_SEC;
+
+    printf ("hash_lookup: %d users, %.1f ns/lookup", users,
+	    t * 1e9 / ((double) NUM_QUERIES * LOOPS));
+    if (bad)
+	printf (", %d WRONG", bad);
+    putchar ('\n');
+
+    free_hash (h);
+    for (i = 0; i < users; i++)
+	free (nicks[i]);
+    for (i = 0; i < NUM_QUERIES; i++)
+	free (queries[i]);
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,273 @@
+/* Copyright (C) 2000 drscholl@users.sourceforge.net
+   This is free software distributed under the terms of the
+   GNU Public License.  See the file COPYING for details.
+
+   $Id$ */
+
+/* share ingest benchmark.  logs a number of clients in to a running
+   server and has them share a total of `-n' synthetic files with add_file
+   (100) commands, then waits until the server has answered a whois sent
+   behind the last share of each client.  each filename is four random
+   words from a fixed vocabulary, so the posting lists of the index get
+   long.  if the server's pid is given with `-P' its cpu time and size are
+   read from /proc before and after.  build it with `make bench_share' */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MSG_CLIENT_LOGIN 2
+#define MSG_SERVER_EMAIL 3
+#define MSG_CLIENT_ADD_FILE 100
+#define MSG_CLIENT_WHOIS 603
+#define MSG_SERVER_WHOIS_RESPONSE 604
+
+#define MAX_USERS 1000
+#define FLUSH_SIZE 65536
+
+static int Fd[MAX_USERS];
+static char Out[FLUSH_SIZE + 1024];
+static int Outlen = 0;
+
+static void
+usage (void)
+{
+    puts ("usage: bench_share [ -s <host> ] [ -p <port> ] [ -n <files> ]");
+    puts ("                   [ -u <users> ] [ -w <words> ] [ -P <pid> ]");
+    puts ("  -s <host>	server address (default is 127.0.0.1)");
+    puts ("  -p <port>	server port (default is 8888)");
+    puts ("  -n <files>	number of files to share (default is 1000000)");
+    puts ("  -u <users>	number of clients sharing them (default is 200)");
+    puts ("  -w <words>	size of the filename vocabulary (default is 5000)");
+    puts ("  -P <pid>	pid of the server, to report its cpu time and size");
+    exit (1);
+}
+
+static double
+now (void)
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* returns the cpu time used by process `pid' so far, and its resident size
+   in kB in `rss' */
+static double
+server_usage (int pid, long *rss)
+{
+    char path[64], buf[1024], *p;
+    unsigned long utime = 0, stime = 0;
+    FILE *f;
+
+    *rss = 0;
+    snprintf (path, sizeof (path), "/proc/%d/stat", pid);
+    if ((f = fopen (path, "r")))
+    {
+	if (fgets (buf, sizeof (buf), f) && (p = strrchr (buf, ')')))
+	    sscanf (p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		    &utime, &stime);
+	fclose (f);
+    }
+    snprintf (path, sizeof (path), "/proc/%d/status", pid);
+    if ((f = fopen (path, "r")))
+    {
+	while (fgets (buf, sizeof (buf), f))
+	    if (!strncmp (buf, "VmRSS:", 6))
+		*rss = atol (buf + 6);
+	fclose (f);
+    }
+    return (double) (utime + stime) / sysconf (_SC_CLK_TCK);
+}
+
+static void
+flush_out (int fd)
+{
+    int n, off = 0;
+
+    while (off < Outlen)
+    {
+	n = write (fd, Out + off, Outlen - off);
+	if (n <= 0)
+	{
+	    perror ("write");
+	    exit (1);
+	}
+	off += n;
+    }
+    Outlen = 0;
+}
+
+static void
+queue_cmd (int fd, int tag, const char *fmt, ...)
+{
+    va_list ap;
+    unsigned short len;
+    int n;
+
+    va_start (ap, fmt);
+    n = vsnprintf (Out + Outlen + 4, sizeof (Out) - Outlen - 4, fmt, ap);
+    va_end (ap);
+    /* the server speaks little endian */
+    len = n;
+    Out[Outlen] = len & 0xff;
+    Out[Outlen + 1] = len >> 8;
+    Out[Outlen + 2] = tag & 0xff;
+    Out[Outlen + 3] = tag >> 8;
+    Outlen += 4 + n;
+    if (Outlen >= FLUSH_SIZE)
+	flush_out (fd);
+}
+
+/* read and discard server output until a `tag' message arrives */
+static void
+wait_for (int fd, int tag)
+{
+    unsigned char hdr[4];
+    char body[65536];
+    int n, len, got;
+
+    for (;;)
+    {
+	for (got = 0; got < 4; got += n)
+	    if ((n = read (fd, hdr + got, 4 - got)) <= 0)
+	    {
+		fputs ("bench_share: server closed the connection\n", stderr);
+		exit (1);
+	    }
+	len = hdr[0] | (hdr[1] << 8);
+	for (got = 0; got < len; got += n)
+	    if ((n = read (fd, body + got, len - got)) <= 0)
+	    {
+		fputs ("bench_share: server closed the connection\n", stderr);
+		exit (1);
+	    }
+	if ((hdr[2] | (hdr[3] << 8)) == tag)
+	    return;
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+    struct sockaddr_in sin;
+    char **words;
+    int i, j, u, per, pid = 0, files = 1000000, users = 200, vocab = 5000;
+    double start, wall, cpu = 0;
+    long rss, rss0;
+
+    memset (&sin, 0, sizeof (sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = inet_addr ("127.0.0.1");
+    sin.sin_port = htons (8888);
+    while ((i = getopt (argc, argv, "s:p:n:u:w:P:")) != EOF)
+    {
+	switch (i)
+	{
+	case 's':
+	    sin.sin_addr.s_addr = inet_addr (optarg);
+	    break;
+	case 'p':
+	    sin.sin_port = htons (atoi (optarg));
+	    break;
+	case 'n':
+	    files = atoi (optarg);
+	    break;
+	case 'u':
+	    users = atoi (optarg);
+	    break;
+	case 'w':
+	    vocab = atoi (optarg);
+	    break;
+	case 'P':
+	    pid = atoi (optarg);
+	    break;
+	default:
+	    usage ();
+	}
+    }
+    if (users < 1 || users > MAX_USERS || files < users || vocab < 1)
+	usage ();
+    per = files / users;
+
+    words = malloc (sizeof (char *) * vocab);
+    if (!words)
+    {
+	perror ("malloc");
+	exit (1);
+    }
+    for (i = 0; i < vocab; i++)
+    {
+	words[i] = malloc (12);
+	if (!words[i])
+	{
+	    perror ("malloc");
+	    exit (1);
+	}
+	snprintf (words[i], 12, "w%x", (unsigned int) (i * 2654435761U));
+    }
+    srand (1);
+
+    for (u = 0; u < users; u++)
+    {
+	Fd[u] = socket (PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (Fd[u] < 0)
+	{
+	    perror ("socket");
+	    exit (1);
+	}
+	if (connect (Fd[u], (struct sockaddr *) &sin, sizeof (sin)) < 0)
+	{
+	    perror ("connect");
+	    exit (1);
+	}
+	queue_cmd (Fd[u], MSG_CLIENT_LOGIN, "bench%d pass 6699 \"bench 1.0\" 3",
+		   u);
+	flush_out (Fd[u]);
+	wait_for (Fd[u], MSG_SERVER_EMAIL);
+    }
+
+    if (pid)
+	cpu = server_usage (pid, &rss0);
+    start = now ();
+    for (u = 0; u < users; u++)
+    {
+	for (j = 0; j < per; j++)
+	    queue_cmd (Fd[u], MSG_CLIENT_ADD_FILE,
+		       "\"C:\\mp3\\%s - %s %s %s %d.mp3\" "
+		       "0123456789abcdef0123456789abcdef %d 128 44100 300",
+		       words[rand () % vocab], words[rand () % vocab],
+		       words[rand () % vocab], words[rand () % vocab], j,
+		       1000000 + j);
+	/* answered only once everything before it has been processed */
+	queue_cmd (Fd[u], MSG_CLIENT_WHOIS, "bench%d", u);
+	flush_out (Fd[u]);
+    }
+    for (u = 0; u < users; u++)
+	wait_for (Fd[u], MSG_SERVER_WHOIS_RESPONSE);
+    wall = now () - start;
+
+    printf ("%d add_file from %d users: wall %.2fs", per * users, users,
+	    wall);
+    if (pid)
+    {
+	cpu = server_usage (pid, &rss) - cpu;
+	printf (", server cpu %.2fs, rss %ld kB (%+ld kB)", cpu, rss,
+		rss - rss0);
+    }
+    putchar ('\n');
+
+    for (u = 0; u < users; u++)
+	close (Fd[u]);
+    for (i = 0; i < vocab; i++)
+	free (words[i]);
+    free (words);
+    return 0;
+}
@@ -0,0 +1,233 @@
+/* Copyright (C) 2000 drscholl@users.sourceforge.net
+   This is free software distributed under the terms of the
+   GNU Public License.  See the file COPYING for details.
+
+   $Id$ */
+
+/* microbenchmark for the search kernels in simd.c.  each of the kernels
+   this cpu supports is timed on the same synthetic filenames and id lists,
+   and its results are checked against the portable version.  build it
+   with `make bench_simd'.  exits with status 1 if any kernel disagrees */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+
+/* the kernels are static, so they are compiled in here */
+#include "simd.c"
+
+#define NUM_FILES 100000
+#define LOOPS 20
+#define MAX_OUT 64
+
+typedef int (*contains_t) (const char *, int, const char *, int);
+typedef int (*intersect_t) (const unsigned int *, int, int *,
+			    const unsigned int *, int, int *, int *, int);
+
+static const char *Artists[] = {
+    "Metallica", "The Beatles", "Pink Floyd", "Led Zeppelin", "Radiohead",
+    "Nirvana", "Daft Punk", "Massive Attack"
+};
+static const char *Titles[] = {
+    "Nothing Else Matters", "Yesterday", "Comfortably Numb",
+    "Stairway To Heaven", "Karma Police", "Come As You Are",
+    "Around The World", "Teardrop", "Live At Wembley", "Remastered"
+};
+/* lower case, like the output of tokenize() */
+static const char *Tokens[] = {
+    "yesterday", "beatles", "live", "stairway", "numb", "xyzzy", "remaster",
+    "karma", "mp3", "teardrop"
+};
+
+static int Failed = 0;
+#if HAVE_SIMD
+static int Have_Sse42 = 0;
+static int Have_Avx2 = 0;
+#endif /* HAVE_SIMD */
+
+void
+log (const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start (ap, fmt);
+    vprintf (fmt, ap);
+    va_end (ap);
+    putchar ('\n');
+}
+
+static double
+elapsed (clock_t start)
+{
+    return (double) (clock () - start) / CLOCKS_PER_SEC;
+}
+
+static void
+bench_contains (void)
+{
+    static char *files[NUM_FILES];
+    static int lens[NUM_FILES];
+    static char expect[NUM_FILES * LOOPS];
+    const char *names[2] = { "scalar", "sse4.2" };
+    contains_t funcs[2];
+    int i, k, r, n, hits, bad, hit;
+    const char *tok;
+    clock_t start;
+
+    funcs[0] = contains_scalar;
+#if HAVE_SIMD
+    funcs[1] = Have_Sse42 ? contains_sse42 : 0;
+#else
+    funcs[1] = 0;
+#endif /* HAVE_SIMD */
+
+    for (i = 0; i < NUM_FILES; i++)
+    {
+	files[i] = malloc (256);
+	if (!files[i])
+	{
+	    perror ("malloc");
+	    exit (1);
+	}
+	snprintf (files[i], 256,
+		  "C:\\Program Files\\Napster\\Music\\%s\\%s - %s "
+		  "(%d kbps) track %02d.mp3", Artists[rand () % 8],
+		  Artists[rand () % 8], Titles[rand () % 10],
+		  128 + 64 * (rand () % 3), rand () % 20);
+	lens[i] = strlen (files[i]);
+    }
+
+    for (k = 0; k < 2; k++)
+    {
+	if (!funcs[k])
+	{
+	    printf ("substring %-7s not supported\n", names[k]);
+	    continue;
+	}
+	hits = 0;
+	bad = 0;
+	start = clock ();
+	for (r = 0, n = 0; r < LOOPS; r++)
+	{
+	    for (i = 0; i < NUM_FILES; i++, n++)
+	    {
+		tok = Tokens[(i + r) % 10];
+		hit = funcs[k] (files[i], lens[i], tok, strlen (tok)) != 0;
+		hits += hit;
+		if (!k)
+		    expect[n] = hit;
+		else if (hit != expect[n])
+		    bad++;
+	    }
+	}
+	printf ("substring %-7s %6.1f ns/file, %d hits", names[k],
+		elapsed (start) * 1e9 / (NUM_FILES * LOOPS), hits);
+	if (bad)
+	{
+	    printf (", %d WRONG", bad);
+	    Failed = 1;
+	}
+	putchar ('\n');
+    }
+
+    for (i = 0; i < NUM_FILES; i++)
+	free (files[i]);
+}
+
+/* fill `a' with `n' increasing ids at most `gap' apart */
+static void
+make_ids (unsigned int *a, int n, int gap)
+{
+    unsigned int x = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+	a[i] = (x += 1 + rand () % gap);
+}
+
+/* returns the sum of the indexes found, as a checksum */
+static double
+run_intersect (intersect_t func, unsigned int *a, int na, unsigned int *b,
+	       int nb, int *found)
+{
+    int out[MAX_OUT];
+    int pa = 0, pb = 0, n, i;
+    double sum = 0;
+
+    *found = 0;
+    while ((n = func (a, na, &pa, b, nb, &pb, out, MAX_OUT)) > 0)
+    {
+	*found += n;
+	for (i = 0; i < n; i++)
+	    sum += out[i];
+    }
+    return sum;
+}
+
+static void
+bench_intersect (void)
+{
+    static unsigned int a[1 << 20], b[1 << 20];
+    static const int sizes[][2] = {
+	{200000, 200000}, {100000, 400000}, {50000, 800000}, {20000, 640000}
+    };
+    const char *names[3] = { "scalar", "sse4.2", "avx2" };
+    intersect_t funcs[3];
+    int s, k, r, na, nb, found, want = 0;
+    double sum = 0, expect = 0;
+    clock_t start;
+
+    funcs[0] = intersect_scalar;
+#if HAVE_SIMD
+    funcs[1] = Have_Sse42 ? intersect_sse42 : 0;
+    funcs[2] = Have_Avx2 ? intersect_avx2 : 0;
+#else
+    funcs[1] = funcs[2] = 0;
+#endif /* HAVE_SIMD */
+
+    for (s = 0; s < (int) (sizeof (sizes) / sizeof (sizes[0])); s++)
+    {
+	na = sizes[s][0];
+	nb = sizes[s][1];
+	make_ids (a, na, 2 * (nb / na) + 8);
+	make_ids (b, nb, 8);
+	printf ("intersect %d x %d:", na, nb);
+	for (k = 0; k < 3; k++)
+	{
+	    if (!funcs[k])
+		continue;
+	    start = clock ();
+	    for (r = 0; r < LOOPS; r++)
+		sum = run_intersect (funcs[k], a, na, b, nb, &found);
+	    printf ("  %s %.2fms", names[k], elapsed (start) * 1e3 / LOOPS);
+	    if (!k)
+	    {
+		expect = sum;
+		want = found;
+		printf (" (%d)", found);
+	    }
+	    else if (sum != expect || found != want)
+	    {
+		printf (" WRONG (%d)", found);
+		Failed = 1;
+	    }
+	}
+	putchar ('\n');
+    }
+}
+
+int
+main (void)
+{
+    srand (1);
+#if HAVE_SIMD
+    __builtin_cpu_init ();
+    Have_Sse42 = __builtin_cpu_supports ("sse4.2") ? 1 : 0;
+    Have_Avx2 = __builtin_cpu_supports ("avx2") ? 1 : 0;
+#endif /* HAVE_SIMD */
+    simd_init ();
+    bench_contains ();
+    bench_intersect ();
+    return Failed;
+}
@@ -22,14 +22,18 @@ BROWSE;
 static void
 browse_callback (DATUM * info, BROWSE * ctx)
 {
+#if RESUME
+    char hash[33];
+#endif
+
     /* avoid flooding the client */
     if (ctx->max == 0 || ctx->count < ctx->max)
     {
 	send_user (ctx->sender, MSG_SERVER_BROWSE_RESPONSE,
-		   "%s \"%s\" %s %d %hu %hu %hu",
-		   info->user->nick, info->filename,
+		   "%s \"%s%s\" %s %d %hu %hu %hu",
+		   info->dir->user->nick, info->dir->name, info->name,
 #if RESUME
-		   info->hash,
+		   datum_hash (info, hash),
 #else
 		   "00000000000000000000000000000000",
 #endif
@@ -104,6 +108,18 @@ HANDLER (browse)
     }
 }
 
+/* files in the same directory share the same copy of its name, see
+   new_datum() */
+static int
+datum_cmp (DATUM * a, DATUM * b)
+{
+    int r;
+
+    if (a->dir != b->dir && (r = strcasecmp (a->dir->name, b->dir->name)))
+	return r;
+    return strcasecmp (a->name, b->name);
+}
+
 static void
 create_file_list (DATUM * d, LIST ** p)
 {
@@ -112,9 +128,9 @@ create_file_list (DATUM * d, LIST ** p)
     while (*p)
     {
 	f = (*p)->data;
-	if (strcasecmp (d->filename, f->filename) <= 0)
+	if (datum_cmp (d, f) <= 0)
 	{
-	    LIST *n = CALLOC (1, sizeof (LIST));
+	    LIST *n = POOL_ALLOC (&List_Pool);
 
 	    n->data = d;
 	    n->next = *p;
@@ -123,45 +139,10 @@ create_file_list (DATUM * d, LIST ** p)
 	}
 	p = &(*p)->next;
     }
-    *p = CALLOC (1, sizeof (LIST));
+    *p = POOL_ALLOC (&List_Pool);
     (*p)->data = d;
 }
 
-static char *
-last_slash (char *s)
-{
-    /* const */ char *p;
-
-    for (;;)
-    {
-	p = strpbrk (s + 1, "/\\");
-	if (!p)
-	    return s;
-	s = p;
-    }
-}
-
-static char *
-dirname (char *d, int dsize, /* const */ char *s)
-{
-    char *p;
-
-    strncpy (d, s, dsize - 1);
-    d[dsize - 1] = 0;
-    p = last_slash (d);
-    *p = 0;
-    return d;
-}
-
-static char *
-my_basename (char *d, int dsize, /* const */ char *s)
-{
-    s = last_slash (s);
-    strncpy (d, s + 1, dsize - 1);
-    d[dsize - 1] = 0;
-    return d;
-}
-
 /* 10301 [ :<sender> ] <nick>
    new browse requst */
 HANDLER (browse_new)
@@ -199,15 +180,15 @@ HANDLER (browse_new)
 	if (user->con->uopt->files)
 	{
 	    LIST *list = 0, *tmpList;
-	    char dir[_POSIX_PATH_MAX];
-	    char path[_POSIX_PATH_MAX];
-	    char base[_POSIX_PATH_MAX];
+	    char *dir = 0;
 	    char *rsp = 0;
 	    int count = 0;
+#if RESUME
+	    char hash[33];
+#endif
 
 	    hash_foreach (user->con->uopt->files,
 			  (hash_callback_t) create_file_list, &list);
-	    dir[0] = 0;
 	    if(results==0)
 		results=0x7fffffff;	/* hack, we really mean unlimited */
 	    for (tmpList = list; tmpList && results;
@@ -215,14 +196,13 @@ HANDLER (browse_new)
 	    {
 		DATUM *d = tmpList->data;
 
-		dirname (path, sizeof (path), d->filename);
-		my_basename (base, sizeof (base), d->filename);
-		if (count < 5 && dir[0] && !strcasecmp (dir, path))
+		if (count < 5 && dir && !strcasecmp (dir, d->dir->name))
 		{
 		    /* same directory as previous result, append */
-		    rsp = append_string (rsp, " \"%s\" %s %d %d %d %d", base,
+		    rsp = append_string (rsp, " \"%s\" %s %d %d %d %d",
+					 d->name,
 #if RESUME
-					 d->hash,
+					 datum_hash (d, hash),
 #else
 					 "0",
 #endif
@@ -237,7 +217,7 @@ HANDLER (browse_new)
 		else
 		{
 		    /* new directory */
-		    strcpy (dir, path);
+		    dir = d->dir->name;
 		    if (rsp)
 		    {
 			/* send off the previous buffer command */
@@ -245,10 +225,13 @@ HANDLER (browse_new)
 				   rsp);
 			FREE (rsp);
 		    }
-		    rsp = append_string (0, "%s \"%s\" \"%s\" %s %d %d %d %d",
-					 user->nick, dir, base,
+		    /* sent without the trailing separator */
+		    rsp = append_string (0, "%s \"%.*s\" \"%s\" %s %d %d %d %d",
+					 user->nick,
+					 dir[0] ? (int) strlen (dir) - 1 : 0,
+					 dir, d->name,
 #if RESUME
-					 d->hash,
+					 datum_hash (d, hash),
 #else
 					 "0",
 #endif
@@ -13,13 +13,25 @@
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#if HAVE_WRITEV
+#include <limits.h>
+#include <sys/uio.h>
+#endif /* HAVE_WRITEV */
 #include "opennap.h"
 #include "debug.h"
 
+#if HAVE_WRITEV
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+static struct iovec Iov[IOV_MAX];
+static int Iov_Max = 0;		/* what the system actually allows */
+#endif /* HAVE_WRITEV */
+
 static BUFFER *
 buffer_new (void)
 {
-    BUFFER *r = CALLOC (1, sizeof (BUFFER));
+    BUFFER *r = POOL_ALLOC (&Buffer_Pool);
 
     if (!r)
     {
@@ -29,97 +41,105 @@ buffer_new (void)
 #if DEBUG
     r->magic = MAGIC_BUFFER;
 #endif
-    r->data = MALLOC (BUFFER_SIZE);
-    if (!r->data)
-    {
-	OUTOFMEMORY ("buffer_new");
-	FREE (r);
-	return 0;
-    }
+    /* the data follows the struct in the same allocation */
+    r->data = (char *) (r + 1);
     r->datamax = BUFFER_SIZE;
     return r;
 }
 
-/* append bytes to the buffer */
-static BUFFER *
-buffer_queue (BUFFER * b, char *d, int dsize)
+/* release the memory held by a single buffer */
+static void
+buffer_release (BUFFER * b)
+{
+    if (b->block)
+    {
+	block_free (b->block);
+	POOL_FREE (&Buffer_Ref_Pool, b);
+    }
+    else if (b->data == (char *) (b + 1))
+	POOL_FREE (&Buffer_Pool, b);
+    else
+    {
+	/* an input buffer, see handler.c */
+	FREE (b->data);
+	FREE (b);
+    }
+}
+
+/* append bytes to the queue.  returns -1 if memory could not be allocated,
+   in which case the connection is out of sync and must be closed */
+static int
+buffer_queue (QUEUE * q, char *d, int dsize)
 {
-    BUFFER *r = b;
+    BUFFER *b = q->tail;
     int count;
 
-    if (b)
-	while (b->next)
-	    b = b->next;
     while (dsize > 0)
     {
-	if (!b)
-	    r = b = buffer_new ();
-	else if (b->datasize == b->datamax)
+	if (!b || b->datasize == b->datamax)
 	{
-	    b->next = buffer_new ();
-	    b = b->next;
-	}
-	if(!b)
-	{
-	    /*something really bad just happened!  no choice but to close
-	      this connection since it will be out of sync*/
-	    buffer_free(r);
-	    return 0;
+	    if (!(b = buffer_new ()))
+		return -1;
+	    if (q->tail)
+		q->tail->next = b;
+	    else
+		q->head = b;
+	    q->tail = b;
 	}
 	count = dsize;
 	/* dsize could be greater than what is allocated */
 	if (count > b->datamax - b->datasize)
 	    count = b->datamax - b->datasize;
 	memcpy (b->data + b->datasize, d, count);
-	b->datasize+=count;
+	b->datasize += count;
+	q->bytes += count;
 	dsize -= count;
 	d += count;
     }
-    return r;
+    return 0;
 }
 
-/* consume some bytes from the buffer */
-BUFFER *
-buffer_consume (BUFFER * b, int n)
+/* consume `n' bytes from the front of the queue, freeing the buffers which
+   have been used up */
+void
+buffer_consume (QUEUE * q, int n)
 {
-    ASSERT (buffer_validate (b));
-    ASSERT (b->consumed + n <= b->datasize);
-    b->consumed += n;
-    if (b->consumed >= b->datasize)
-    {
-	BUFFER *p = b;
+    BUFFER *b;
 
-	b = b->next;
-	FREE (p->data);
-	FREE (p);
+    ASSERT (n <= q->bytes);
+    q->bytes -= n;
+    while (n > 0)
+    {
+	b = q->head;
+	ASSERT (buffer_validate (b));
+	if (b->consumed + n < b->datasize)
+	{
+	    b->consumed += n;
+	    break;
+	}
+	n -= b->datasize - b->consumed;
+	q->head = b->next;
+	buffer_release (b);
     }
-    return b;
+    if (!q->head)
+	q->tail = 0;
 }
 
-BUFFER *
-buffer_append (BUFFER * a, BUFFER * b)
+/* add the chain of buffers `b' to the end of the queue */
+void
+buffer_append (QUEUE * q, BUFFER * b)
 {
-    BUFFER *r = a;
-
     ASSERT (b != 0);
-    if (!a)
-	return b;
-    ASSERT (buffer_validate (a));
-    while (a->next)
-	a = a->next;
-    a->next = b;
-    return r;
-}
-
-int
-buffer_size (BUFFER * b)
-{
-    int n = 0;
-
-    ASSERT (b == 0 || buffer_validate (b));
+    if (q->tail)
+	q->tail->next = b;
+    else
+	q->head = b;
     for (; b; b = b->next)
-	n += b->datasize - b->consumed;
-    return n;
+    {
+	ASSERT (buffer_validate (b));
+	q->bytes += b->datasize - b->consumed;
+	q->tail = b;
+    }
 }
 
 void
@@ -132,9 +152,39 @@ buffer_free (BUFFER * b)
     {
 	p = b;
 	b = b->next;
-	FREE (p->data);
-	FREE (p);
+	buffer_release (p);
+    }
+}
+
+/* create a shared block holding a copy of `d'.  the caller holds the first
+   reference and must call block_free() when done queueing it */
+BLOCK *
+block_new (char *d, int dsize)
+{
+    BLOCK *b = MALLOC (sizeof (BLOCK) + dsize);
+
+    if (!b)
+    {
+	OUTOFMEMORY ("block_new");
+	return 0;
     }
+#if DEBUG
+    b->magic = MAGIC_BLOCK;
+#endif
+    b->refcount = 1;
+    b->len = dsize;
+    memcpy (b->data, d, dsize);
+    return b;
+}
+
+/* drop a reference to a shared block */
+void
+block_free (BLOCK * b)
+{
+    ASSERT (b->magic == MAGIC_BLOCK);
+    ASSERT (b->refcount > 0);
+    if (--b->refcount == 0)
+	FREE (b);
 }
 
 #if DEBUG
@@ -144,8 +194,20 @@ buffer_validate (BUFFER * b)
     ASSERT_RETURN_IF_FAIL (VALID_LEN (b, sizeof (BUFFER)), 0);
     ASSERT_RETURN_IF_FAIL (b->magic == MAGIC_BUFFER, 0);
     ASSERT_RETURN_IF_FAIL (b->datasize <= b->datamax, 0);
-    ASSERT_RETURN_IF_FAIL (b->data == 0
-			   || VALID_LEN (b->data, b->datasize), 0);
+    if (b->block)
+    {
+	ASSERT_RETURN_IF_FAIL (b->block->magic == MAGIC_BLOCK, 0);
+	ASSERT_RETURN_IF_FAIL (b->block->refcount > 0, 0);
+	ASSERT_RETURN_IF_FAIL (b->data == b->block->data, 0);
+	ASSERT_RETURN_IF_FAIL (b->datasize == b->block->len, 0);
+    }
+    else if (b->data == (char *) (b + 1))
+    {
+	ASSERT_RETURN_IF_FAIL (VALID_LEN (b, sizeof (BUFFER) + b->datamax), 0);
+    }
+    else
+	ASSERT_RETURN_IF_FAIL (b->data == 0
+			       || VALID_LEN (b->data, b->datasize), 0);
     ASSERT_RETURN_IF_FAIL (b->consumed == 0 || b->consumed < b->datasize, 0);
     ASSERT_RETURN_IF_FAIL (b->next == 0
 			   || VALID_LEN (b->next, sizeof (BUFFER *)), 0);
@@ -154,19 +216,19 @@ buffer_validate (BUFFER * b)
 #endif /* DEBUG */
 
 static BUFFER *
-buffer_compress (z_streamp zip, BUFFER ** b)
+buffer_compress (z_streamp zip, QUEUE * q)
 {
-    BUFFER *r = 0, **pr;
+    BUFFER *r = 0, **pr, *b = q->head;
     int n, bytes, flush;
 
-    ASSERT (buffer_validate (*b));
+    ASSERT (buffer_validate (b));
 
     /* set up the input */
-    bytes = (*b)->datasize - (*b)->consumed;
-    zip->next_in = (uchar *) (*b)->data + (*b)->consumed;
+    bytes = b->datasize - b->consumed;
+    zip->next_in = (uchar *) b->data + b->consumed;
     zip->avail_in = bytes;
     /* force a flush if this is the last input to compress */
-    flush = ((*b)->next == 0) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+    flush = (b->next == 0) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
     /* set to 0 so we allocate in the loop */
     zip->avail_out = 0;
 
@@ -199,7 +261,7 @@ buffer_compress (z_streamp zip, BUFFER ** b)
 
     /* subtract any uncompressed bytes */
     bytes -= zip->avail_in;
-    *b = buffer_consume (*b, bytes);
+    buffer_consume (q, bytes);
 
     if (r)
     {
@@ -214,8 +276,7 @@ buffer_compress (z_streamp zip, BUFFER ** b)
 	    ASSERT (r->next == 0);
 	    if (r->next != 0)
 		log ("buffer_compress(): ERROR! r->next was not NULL");
-	    FREE (r->data);
-	    FREE (r);
+	    buffer_release (r);
 	    r = 0;
 	}
     }
@@ -328,10 +389,44 @@ finalize_compress (SERVER * serv)
     FREE (serv->zout);
 }
 
+/* write as much of the output queue for `con' as possible with one system
+   call.  `left' is set to the number of bytes that were offered */
+static int
+write_queue (CONNECTION * con, int *left)
+{
+#if HAVE_WRITEV
+    BUFFER *b;
+    int n;
+
+    if (!Iov_Max)
+    {
+	Iov_Max = sysconf (_SC_IOV_MAX);
+	if (Iov_Max <= 0)
+	    Iov_Max = 16;	/* the minimum POSIX allows */
+	else if (Iov_Max > IOV_MAX)
+	    Iov_Max = IOV_MAX;
+    }
+    *left = 0;
+    for (b = con->sendq.head, n = 0; b && n < Iov_Max; b = b->next, n++)
+    {
+	Iov[n].iov_base = b->data + b->consumed;
+	Iov[n].iov_len = b->datasize - b->consumed;
+	*left += Iov[n].iov_len;
+    }
+    Write_Calls++;
+    return writev (con->fd, Iov, n);
+#else
+    *left = con->sendq.head->datasize - con->sendq.head->consumed;
+    Write_Calls++;
+    return WRITE (con->fd, con->sendq.head->data + con->sendq.head->consumed,
+		  *left);
+#endif /* HAVE_WRITEV */
+}
+
 int
 send_queued_data (CONNECTION * con)
 {
-    int n;
+    int n, left;
 
     ASSERT (validate_connection (con));
 
@@ -339,39 +434,44 @@ send_queued_data (CONNECTION * con)
     {
 	BUFFER *r;
 
-	if (con->sopt->outbuf &&
-	    (r = buffer_compress (con->sopt->zout, &con->sopt->outbuf)))
-	    con->sendbuf = buffer_append (con->sendbuf, r);
+	if (con->sopt->outq.head &&
+	    (r = buffer_compress (con->sopt->zout, &con->sopt->outq)))
+	    buffer_append (&con->sendq, r);
     }
 
     /* is there data to write? */
-    if (!con->sendbuf)
+    if (!con->sendq.head)
 	return 0;		/* nothing to do */
 
-    n = WRITE (con->fd, con->sendbuf->data + con->sendbuf->consumed,
-	       con->sendbuf->datasize - con->sendbuf->consumed);
-    if (n == -1)
+    /* keep writing until the socket is full rather than stopping after one
+       call per pass */
+    while (con->sendq.head)
     {
-	if (N_ERRNO != EWOULDBLOCK && N_ERRNO != EDEADLK)
+	n = write_queue (con, &left);
+	if (n == -1)
 	{
-	    log ("send_queued_data(): write: %s (errno %d) for host %s",
-		 strerror (N_ERRNO), N_ERRNO, con->host);
-	    return -1;
+	    if (N_ERRNO != EWOULDBLOCK && N_ERRNO != EDEADLK)
+	    {
+		log ("send_queued_data(): write: %s (errno %d) for host %s",
+		     strerror (N_ERRNO), N_ERRNO, con->host);
+		return -1;
+	    }
+	    con->writable = 0;	/* wait for the socket to drain */
+	    return 0;
 	}
-	return 0;
-    }
-    else if (n > 0)
-    {
+	/* keep track of the outgoing bandwidth */
+	Bytes_Out += n;
 	/* mark data as written */
-	con->sendbuf = buffer_consume (con->sendbuf, n);
+	buffer_consume (&con->sendq, n);
+	/* stop if the socket didn't take everything */
+	if (n < left)
+	    break;
     }
-    /* keep track of the outgoing bandwidth */
-    Bytes_Out += n;
 
     /* check to make sure the queue hasn't gotten too big */
     n = (ISSERVER (con)) ? Server_Queue_Length : Client_Queue_Length;
 
-    if (buffer_size (con->sendbuf) > n)
+    if (con->sendq.bytes > n)
     {
 	log ("send_queued_data(): output buffer for %s exceeded %d bytes",
 	     con->host, n);
@@ -381,20 +481,59 @@ send_queued_data (CONNECTION * con)
     return 0;
 }
 
+/* queue a shared block for `con'.  normally the output queue is empty since
+   it is flushed on every pass through the main loop, and the block is just
+   referenced.  if the client is falling behind the block is copied onto the
+   end of the queue instead, so that the queue stays packed into a few large
+   buffers rather than one per message.  server output is always copied
+   since it is compressed into new buffers anyway */
+void
+queue_block (CONNECTION * con, BLOCK * block)
+{
+    BUFFER *b;
+
+    ASSERT (validate_connection (con));
+    ASSERT (block->magic == MAGIC_BLOCK);
+    if (ISSERVER (con) || con->sendq.head)
+    {
+	queue_data (con, block->data, block->len);
+	return;
+    }
+    event_touch (con);
+    b = POOL_ALLOC (&Buffer_Ref_Pool);
+    if (!b)
+    {
+	OUTOFMEMORY ("queue_block");
+	con->destroy = 1;	/* out of sync, close the connection */
+	return;
+    }
+#if DEBUG
+    b->magic = MAGIC_BUFFER;
+#endif
+    b->block = block;
+    block->refcount++;
+    b->data = block->data;
+    /* full, so buffer_queue() won't try to append to it */
+    b->datasize = b->datamax = block->len;
+    con->sendq.head = con->sendq.tail = b;
+    con->sendq.bytes = block->len;
+    Bytes_Queued += block->len;
+}
+
 void
 queue_data (CONNECTION * con, char *s, int ssize)
 {
     ASSERT (validate_connection (con));
+    event_touch (con);
+    Bytes_Queued += ssize;
     if (ISSERVER (con))
     {
-	con->sopt->outbuf = buffer_queue (con->sopt->outbuf, s, ssize);
-	if(!con->sopt->outbuf)
+	if (buffer_queue (&con->sopt->outq, s, ssize))
 	    con->destroy=1; /*error queuing the data, close connection*/
     }
     else
     {
-	con->sendbuf = buffer_queue (con->sendbuf, s, ssize);
-	if(!con->sendbuf)
+	if (buffer_queue (&con->sendq, s, ssize))
 	    con->destroy=1; /*error queuing the data, close connection*/
     }
 }
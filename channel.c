@@ -99,7 +99,7 @@ load_channels (void)
 	    while (ptr)
 	    {
 		name = next_arg (&ptr);
-		list = CALLOC (1, sizeof (LIST));
+		list = POOL_ALLOC (&List_Pool);
 		list->data = STRDUP (name);
 		list->next = chan->ops;
 		chan->ops = list;
@@ -211,7 +211,7 @@ HANDLER (channel_ban)
 	OUTOFMEMORY ("channel_ban");
 	return;
     }
-    list = CALLOC (1, sizeof (LIST));
+    list = POOL_ALLOC (&List_Pool);
     if (!list)
     {
 	OUTOFMEMORY ("channel_ban");
@@ -281,7 +281,7 @@ HANDLER (channel_unban)
 	    free_ban (b);
 	    tmpList = *list;
 	    *list = (*list)->next;
-	    FREE (tmpList);
+	    POOL_FREE (&List_Pool, tmpList);
 	    return;
 	}
     }
@@ -429,7 +429,7 @@ HANDLER (channel_op)
 		    tmpList = *list;
 		    *list = (*list)->next;
 		    FREE (tmpList->data);
-		    FREE (tmpList);
+		    POOL_FREE (&List_Pool, tmpList);
 		    /* if the user is present, change their status */
 		    user = hash_lookup (Users, suser);
 		    if (user)
@@ -452,7 +452,7 @@ HANDLER (channel_op)
 	    }
 	if (tag == MSG_CLIENT_OP && !*list)
 	{
-	    *list = CALLOC (1, sizeof (LIST));
+	    *list = POOL_ALLOC (&List_Pool);
 	    (*list)->data = STRDUP (suser);
 	    /* if the user is present, change their status */
 	    user = hash_lookup (Users, suser);
@@ -484,6 +484,7 @@ notify_ops (CHANNEL * chan, const char *fmt, ...)
     CHANUSER *chanUser;
     char buf[256];
     int len;
+    BLOCK *block;
 
     va_list ap;
 
@@ -493,6 +494,8 @@ notify_ops (CHANNEL * chan, const char *fmt, ...)
     len = strlen (buf + 4);
     set_len (buf, len);
     set_tag (buf, MSG_SERVER_NOSUCH);
+    if (!(block = block_new (buf, 4 + len)))
+	return;
     for (list = chan->users; list; list = list->next)
     {
 	chanUser = list->data;
@@ -500,8 +503,9 @@ notify_ops (CHANNEL * chan, const char *fmt, ...)
 	if (ISUSER (chanUser->user->con) &&
 	    ((chanUser->flags & ON_OPERATOR) ||
 	     chanUser->user->level > LEVEL_USER))
-	    queue_data (chanUser->user->con, buf, 4 + len);
+	    queue_block (chanUser->user->con, block);
     }
+    block_free (block);
 }
 
 /* 10206 <channel>
@@ -842,12 +846,12 @@ HANDLER (channel_invite)
     if (list_find (user->invited, chan))
 	return;			/* already invited */
 
-    list = CALLOC (1, sizeof (LIST));
+    list = POOL_ALLOC (&List_Pool);
     list->data = chan;
     list->next = user->invited;
     user->invited = list;
 
-    list = CALLOC (1, sizeof (LIST));
+    list = POOL_ALLOC (&List_Pool);
     list->data = user;
     list->next = chan->invited;
     chan->invited = list;
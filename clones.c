@@ -0,0 +1,160 @@
+/* Copyright (C) 2000 drscholl@users.sourceforge.net
+   This is free software distributed under the terms of the
+   GNU Public License.  See the file COPYING for details.
+
+   $Id$ */
+
+/* keeps track of the number of local connections from each ip address so
+   that `max_clones' can be enforced without looking at every client, and
+   of how often each address has connected recently so that connection
+   floods can be turned away as soon as they are accepted (`connect_limit'
+   and `connect_interval') */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "opennap.h"
+#include "debug.h"
+
+typedef struct
+{
+    int count;			/* current connections from this address */
+    int connects;		/* connections made since `start' */
+    time_t start;		/* beginning of the current connect_interval */
+    TIMER *timer;		/* see expire_clone() */
+    char key[9];		/* the address in hex */
+}
+CLONE;
+
+static HASH *Clones = 0;
+
+static void
+free_clone (CLONE * c)
+{
+    cancel_timer (c->timer);
+    FREE (c);
+}
+
+static CLONE *
+find_clone (unsigned int ip, int create)
+{
+    char key[9];
+    CLONE *c;
+
+    if (!Clones)
+    {
+	if (!create)
+	    return 0;
+	if (!(Clones = hash_init (257, (hash_destroy) free_clone)))
+	{
+	    OUTOFMEMORY ("find_clone");
+	    return 0;
+	}
+    }
+    snprintf (key, sizeof (key), "%08x", ip);
+    if ((c = hash_lookup (Clones, key)) || !create)
+	return c;
+    if (!(c = CALLOC (1, sizeof (CLONE))))
+    {
+	OUTOFMEMORY ("find_clone");
+	return 0;
+    }
+    strcpy (c->key, key);
+    c->start = Current_Time;
+    if (hash_add (Clones, c->key, c))
+    {
+	FREE (c);
+	return 0;
+    }
+    return c;
+}
+
+/* forget about an address once nothing is connected from it.  if the
+   connect rate is being limited, the entry is kept until the current
+   interval is over */
+static void
+expire_clone (CLONE * c)
+{
+    char key[sizeof (c->key)];
+    int left = 0;
+
+    c->timer = 0;
+    if (c->count > 0)
+	return;			/* remove_clone() will get back to it */
+    if (Connect_Limit > 0)
+	left = c->start + Connect_Interval - Current_Time;
+    if (left > 0 &&
+	(c->timer = add_timer (left, 1, (timer_cb_t) expire_clone, c)))
+	return;
+    strcpy (key, c->key);
+    hash_remove (Clones, key);	/* frees `c' */
+}
+
+/* returns nonzero if a connection just accepted from `ip' should be closed
+   because the address has connected too often recently */
+int
+check_connect_rate (unsigned int ip)
+{
+    CLONE *c;
+    int refuse = 0;
+
+    if (Connect_Limit <= 0 || !(c = find_clone (ip, 1)))
+	return 0;
+    if (Current_Time - c->start >= Connect_Interval)
+    {
+	c->start = Current_Time;
+	c->connects = 0;
+    }
+    if (c->connects >= Connect_Limit)
+    {
+	/* only log the first one in each interval */
+	if (c->connects == Connect_Limit)
+	    log ("check_connect_rate(): too many connections from %s",
+		 my_ntoa (ip));
+	refuse = 1;
+    }
+    c->connects++;
+    if (!c->count && !c->timer)
+	expire_clone (c);
+    return refuse;
+}
+
+void
+add_clone (unsigned int ip)
+{
+    CLONE *c = find_clone (ip, 1);
+
+    if (c)
+	c->count++;
+}
+
+void
+remove_clone (unsigned int ip)
+{
+    CLONE *c = find_clone (ip, 0);
+
+    /* may be missing if we ran out of memory in add_clone() */
+    if (!c)
+	return;
+    ASSERT (c->count > 0);
+    if (--c->count == 0 && !c->timer)
+	expire_clone (c);
+}
+
+int
+count_clones (unsigned int ip)
+{
+    CLONE *c = find_clone (ip, 0);
+
+    return c ? c->count : 0;
+}
+
+#if DEBUG
+void
+free_clones (void)
+{
+    if (Clones)
+	free_hash (Clones);
+    Clones = 0;
+}
+#endif /* DEBUG */
@@ -0,0 +1,267 @@
+/* Copyright (C) 2000 drscholl@users.sourceforge.net
+   This is free software distributed under the terms of the
+   GNU Public License.  See the file COPYING for details.
+
+   $Id$ */
+
+/* per-command statistics.  run_command() times each handler and counts
+   the output it queues, so that it is possible to see which commands the
+   server spends its time on.  (output produced later on, such as search
+   results from the search threads, is not counted.)  handler times are
+   kept in a log-linear histogram (in the manner of HdrHistogram): each
+   power of two is split into 8 buckets, so percentiles are accurate to
+   within 12.5% whatever their magnitude, in a fixed 1k per command */
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif /* WIN32 */
+#include <stdio.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include "opennap.h"
+#include "debug.h"
+
+#define SUB_BITS 3
+#define SUB_COUNT (1 << SUB_BITS)	/* buckets per power of two */
+#define NUM_BUCKETS ((33 - SUB_BITS) * SUB_COUNT)	/* 0 to 2^32 ns */
+
+struct _cmdstat
+{
+    unsigned short tag;
+    unsigned int count;		/* times the handler was called */
+    unsigned int last_count;	/* `count' at the last update_stats() */
+    double total;		/* ns spent in the handler */
+    unsigned int max;		/* ns */
+    double bytes;		/* output queued by the handler */
+    unsigned int hist[NUM_BUCKETS];
+};
+
+/* sorted by tag */
+static CMDSTAT **Stats = 0;
+static int Stats_Count = 0;
+static int Stats_Max = 0;
+
+/* returns a timestamp in nanoseconds.  only differences are meaningful */
+unsigned long
+cmdstat_clock (void)
+{
+#if HAVE_CLOCK_GETTIME
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (unsigned long) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#elif defined(WIN32)
+    return GetTickCount () * 1000000UL;
+#else
+    struct timeval tv;
+
+    gettimeofday (&tv, 0);
+    return (unsigned long) tv.tv_sec * 1000000000UL + tv.tv_usec * 1000UL;
+#endif
+}
+
+CMDSTAT *
+cmdstat_new (unsigned short tag)
+{
+    CMDSTAT *s;
+    int i;
+
+    if (Stats_Count == Stats_Max)
+    {
+	if (safe_realloc ((void **) &Stats, sizeof (CMDSTAT *) *
+			  (Stats_Max ? Stats_Max * 2 : 64)))
+	{
+	    OUTOFMEMORY ("cmdstat_new");
+	    return 0;
+	}
+	Stats_Max = Stats_Max ? Stats_Max * 2 : 64;
+    }
+    if (!(s = CALLOC (1, sizeof (CMDSTAT))))
+    {
+	OUTOFMEMORY ("cmdstat_new");
+	return 0;
+    }
+    s->tag = tag;
+    for (i = Stats_Count; i > 0 && Stats[i - 1]->tag > tag; i--)
+	Stats[i] = Stats[i - 1];
+    Stats[i] = s;
+    Stats_Count++;
+    return s;
+}
+
+/* record one call of the handler which took `ns' and queued `bytes' */
+void
+cmdstat_add (CMDSTAT * s, unsigned long ns, unsigned int bytes)
+{
+    unsigned int v;
+    int shift;
+
+    v = ns > 0xffffffffUL ? 0xffffffffU : (unsigned int) ns;
+    for (shift = 0; (v >> shift) >= 2 * SUB_COUNT; shift++)
+	;
+    s->hist[shift * SUB_COUNT + (v >> shift)]++;
+    s->count++;
+    s->total += v;
+    if (v > s->max)
+	s->max = v;
+    s->bytes += bytes;
+}
+
+/* returns the upper end (ns) of the bucket holding the `q' quantile */
+static double
+percentile (CMDSTAT * s, double q)
+{
+    unsigned int want, seen = 0, v;
+    int i, shift;
+
+    if (!s->count)
+	return 0;
+    want = (unsigned int) (q * s->count);
+    if (want >= s->count)
+	want = s->count - 1;
+    for (i = 0; i < NUM_BUCKETS; i++)
+    {
+	seen += s->hist[i];
+	if (seen > want)
+	    break;
+    }
+    if (i < 2 * SUB_COUNT)
+	return i;
+    shift = i / SUB_COUNT - 1;
+    v = ((i % SUB_COUNT + SUB_COUNT + 1) << shift) - 1;
+    return v < s->max ? v : s->max;
+}
+
+/* count avg max p50 p90 p99 p99.9 bytes, times in microseconds */
+static char *
+format_stat (CMDSTAT * s, char *buf, int bufsize)
+{
+    snprintf (buf, bufsize, "%u %.1f %.1f %.1f %.1f %.1f %.1f %.0f",
+	      s->count, s->count ? s->total / s->count / 1000. : 0.,
+	      s->max / 1000., percentile (s, .5) / 1000.,
+	      percentile (s, .9) / 1000., percentile (s, .99) / 1000.,
+	      percentile (s, .999) / 1000., s->bytes);
+    return buf;
+}
+
+/* called from update_stats().  logs the commands which have been used
+   since the last call */
+void
+cmdstats_log (void)
+{
+    char buf[128];
+    int i;
+
+    log ("update_stats(): command stats: tag, calls since last time, "
+	 "total calls, avg/max/p50/p90/p99/p99.9 us, bytes queued");
+    for (i = 0; i < Stats_Count; i++)
+    {
+	if (Stats[i]->count == Stats[i]->last_count)
+	    continue;
+	log ("update_stats(): %hu %u %s", Stats[i]->tag,
+	     Stats[i]->count - Stats[i]->last_count,
+	     format_stat (Stats[i], buf, sizeof (buf)));
+	Stats[i]->last_count = Stats[i]->count;
+    }
+}
+
+/* the stats in the Prometheus text format, see metrics.c.  the histogram
+   buckets are merged into powers of four, from about 1us up to 1s */
+void
+cmdstats_metrics (METRICS * m)
+{
+    CMDSTAT *s;
+    unsigned int seen;
+    int i, j, k;
+
+    metrics_printf (m, "# HELP opennap_commands_total Commands handled.\n"
+		    "# TYPE opennap_commands_total counter\n");
+    for (i = 0; i < Stats_Count; i++)
+	if (Stats[i]->count)
+	    metrics_printf (m, "opennap_commands_total{tag=\"%hu\"} %u\n",
+			    Stats[i]->tag, Stats[i]->count);
+    metrics_printf (m, "# HELP opennap_command_output_bytes_total Output "
+		    "queued by command handlers.\n"
+		    "# TYPE opennap_command_output_bytes_total counter\n");
+    for (i = 0; i < Stats_Count; i++)
+	if (Stats[i]->count)
+	    metrics_printf (m, "opennap_command_output_bytes_total{tag=\"%hu\"} "
+			    "%.0f\n", Stats[i]->tag, Stats[i]->bytes);
+    metrics_printf (m, "# HELP opennap_command_duration_seconds Time spent "
+		    "in command handlers.\n"
+		    "# TYPE opennap_command_duration_seconds histogram\n");
+    for (i = 0; i < Stats_Count; i++)
+    {
+	s = Stats[i];
+	if (!s->count)
+	    continue;
+	/* every value below 2^k ns is in the first
+	   SUB_COUNT * (k - SUB_BITS + 1) buckets */
+	for (k = 10, j = 0, seen = 0; k <= 30; k += 2)
+	{
+	    for (; j < SUB_COUNT * (k - SUB_BITS + 1); j++)
+		seen += s->hist[j];
+	    metrics_printf (m, "opennap_command_duration_seconds_bucket"
+			    "{tag=\"%hu\",le=\"%.9g\"} %u\n", s->tag,
+			    (double) (1UL << k) / 1e9, seen);
+	}
+	metrics_printf (m, "opennap_command_duration_seconds_bucket"
+			"{tag=\"%hu\",le=\"+Inf\"} %u\n"
+			"opennap_command_duration_seconds_sum{tag=\"%hu\"} %g\n"
+			"opennap_command_duration_seconds_count{tag=\"%hu\"} %u\n",
+			s->tag, s->count, s->tag, s->total / 1e9, s->tag,
+			s->count);
+    }
+}
+
+/* 10118 [ :<user> ] [ <server> ]
+   server: <tag> <count> <avg> <max> <p50> <p90> <p99> <p99.9> <bytes>
+   times are in microseconds.  the list ends with an empty 10118 */
+HANDLER (command_stats)
+{
+    USER *user;
+    char buf[128];
+    int i;
+
+    (void) len;
+    ASSERT (validate_connection (con));
+    if (pop_user (con, &pkt, &user) != 0)
+	return;
+    if (user->level < LEVEL_ADMIN)
+    {
+	if (ISUSER (con))
+	    permission_denied (con);
+	return;
+    }
+    if (!*pkt || !strcasecmp (pkt, Server_Name))
+    {
+	for (i = 0; i < Stats_Count; i++)
+	{
+	    if (Stats[i]->count)
+		send_user (user, MSG_SERVER_COMMAND_STATS, "%hu %s",
+			   Stats[i]->tag,
+			   format_stat (Stats[i], buf, sizeof (buf)));
+	}
+	send_user (user, MSG_SERVER_COMMAND_STATS, "");
+    }
+    else
+	pass_message_args (con, tag, ":%s %s", user->nick, pkt);
+}
+
+#if DEBUG
+void
+free_cmdstats (void)
+{
+    int i;
+
+    for (i = 0; i < Stats_Count; i++)
+	FREE (Stats[i]);
+    if (Stats)
+	FREE (Stats);
+    Stats = 0;
+    Stats_Count = Stats_Max = 0;
+}
+#endif /* DEBUG */
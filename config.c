@@ -47,6 +47,8 @@ static struct config Vars[] = {
     {"listen_addr", VAR_TYPE_STR, UL & Listen_Addr, UL "0.0.0.0"},
     {"max_browse_result", VAR_TYPE_INT, UL & Max_Browse_Result, 500},
     {"collect_interval", VAR_TYPE_INT, UL & Collect_Interval, 300},
+    {"collect_step", VAR_TYPE_INT, UL & Collect_Step, 20000},
+    {"index_step", VAR_TYPE_INT, UL & Index_Step, 1000},
     {"compression_level", VAR_TYPE_INT, UL & Compression_Level, 1},
 #ifndef WIN32
     {"uid", VAR_TYPE_INT, UL & Uid, -1},
@@ -73,8 +75,13 @@ static struct config Vars[] = {
     {"max_client_string",VAR_TYPE_INT,UL&Max_Client_String,32},
     {"max_reason",VAR_TYPE_INT,UL&Max_Reason,64},
     {"max_clones",VAR_TYPE_INT,UL&Max_Clones,0},
+    {"connect_limit",VAR_TYPE_INT,UL&Connect_Limit,0},
+    {"connect_interval",VAR_TYPE_INT,UL&Connect_Interval,10},
     {"search_timeout",VAR_TYPE_INT,UL&Search_Timeout,180},
+    {"search_threads",VAR_TYPE_INT,UL&Search_Threads,2},
+    {"slow_command",VAR_TYPE_INT,UL&Slow_Command,0},
     {"stats_port",VAR_TYPE_INT,UL&Stats_Port,8889},
+    {"stats_metrics",VAR_TYPE_BOOL,ON_STATS_METRICS,0},
     {"eject_when_full",VAR_TYPE_BOOL,ON_EJECT_WHEN_FULL,0},
     {"flood_commands",VAR_TYPE_INT,UL&Flood_Commands,0},
     {"flood_time",VAR_TYPE_INT,UL&Flood_Time,0},
@@ -115,7 +122,7 @@ set_list_var (struct config *v, const char *s)
     ac = split_line (av, FIELDS (av), Buf);
     for (i = 0; i < ac; i++)
     {
-	tmpList = CALLOC (1, sizeof (LIST));
+	tmpList = POOL_ALLOC (&List_Pool);
 	tmpList->data = STRDUP (av[i]);
 	tmpList->next = list;
 	list = tmpList;
@@ -31,6 +31,8 @@
 #define VALID_LEN debug_valid
 #define VALID_STR(p) debug_valid(p,strlen(p)+1)
 #define MEMORY_USED debug_usage()
+#define POOL_ALLOC(p) debug_pool_alloc(p,__FILE__,__LINE__)
+#define POOL_FREE(p,x) debug_pool_free(p,x,__FILE__,__LINE__)
 
 /* internal functions, DO NOT CALL DIRECTLY -- use the above macros */
 void debug_init (void);
@@ -43,6 +45,10 @@ void debug_cleanup (void);
 int debug_valid (void *, int);
 int debug_usage (void);
 
+struct _pool;
+void *debug_pool_alloc (struct _pool *, const char *, int);
+void debug_pool_free (struct _pool *, void *, const char *, int);
+
 #else
 
 #define INIT()
@@ -56,6 +62,8 @@ int debug_usage (void);
 #define VALID_LEN(p,l)
 #define ASSERT(p)
 #define MEMORY_USED -1
+#define POOL_ALLOC pool_alloc
+#define POOL_FREE pool_free
 
 #endif /* DEBUG */
 
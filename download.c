@@ -16,6 +16,9 @@ HANDLER (download)
     char *av[2];
     USER *user, *sender;
     DATUM *info = 0;
+#if RESUME
+    char hash[33];
+#endif
 
     (void) len;
     ASSERT (validate_connection (con));
@@ -66,7 +69,7 @@ HANDLER (download)
 			   "%s %u %d \"%s\" %s %d", user->nick,
 			   user->ip, user->port, av[1],
 #if RESUME
-			   info->hash,
+			   datum_hash (info, hash),
 #else
 			   "00000000000000000000000000000000",
 #endif
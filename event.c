@@ -0,0 +1,470 @@
+/* Copyright (C) 2000 drscholl@users.sourceforge.net
+   This is free software distributed under the terms of the
+   GNU Public License.  See the file COPYING for details.
+
+   $Id$ */
+
+/* i/o event notification for the main loop.  event_wait() blocks until
+   there is something to do and leaves the connections which need to be
+   looked at in the Ready list.  when built with epoll(4) support only the
+   connections which actually have pending i/o (or which have had output
+   queued since the last pass) are placed on the list, so the cost of each
+   pass is proportional to the number of active connections rather than
+   the total number of connections.  the select() backend simply places all
+   clients on the list. */
+
+#ifdef WIN32
+#include <windows.h>
+#include <winsock.h>
+#endif /* WIN32 */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#endif /* !WIN32 */
+#if HAVE_EPOLL
+#include <sys/epoll.h>
+#endif /* HAVE_EPOLL */
+#include "opennap.h"
+#include "debug.h"
+
+CONNECTION **Ready = 0;		/* connections to process this pass */
+int Num_Ready = 0;
+static int Max_Ready = 0;
+
+/* listening sockets (server ports and the stats port) */
+static int *Listeners = 0;
+static int Num_Listeners = 0;
+
+static int
+ready_grow (int size)
+{
+    if (size <= Max_Ready)
+	return 0;
+    if (size < Max_Ready * 2)
+	size = Max_Ready * 2;
+    if (safe_realloc ((void **) &Ready, sizeof (CONNECTION *) * size))
+    {
+	OUTOFMEMORY ("ready_grow");
+	return -1;
+    }
+    Max_Ready = size;
+    return 0;
+}
+
+/* a flooding client is not read from until its flood counter has decayed,
+   see FLOODING().  arm a timer to call `func' at that point */
+static void
+flood_wait (CONNECTION * con, timer_cb_t func)
+{
+    con->flood_timer =
+	add_timer_ms ((int) (con->flood - Flood_Time + 1 - Current_Time) *
+		      1000, 1, func, con);
+}
+
+#if HAVE_EPOLL
+
+#define MAX_EVENTS 256
+#define EV_LISTENER ((uint64_t) 1 << 32)
+
+static int Epoll_Fd = -1;
+static struct epoll_event Events[MAX_EVENTS];
+
+/* listeners which have pending connections from the last event_wait() */
+static int *Pending = 0;
+static int Num_Pending = 0;
+
+/* older headers lack this, but the value is part of the kernel abi */
+#ifndef EPOLLRDHUP
+#define EPOLLRDHUP 0x2000
+#endif
+
+/* install the interest set for `con' in the kernel.  client sockets are
+   edge triggered, so once an event is reported we keep the connection on
+   the Ready list until reading or writing returns EWOULDBLOCK (or a read
+   comes up short).  a FIN often arrives in the same edge as the last of
+   the data, so EPOLLRDHUP is asked for to learn that a short read was not
+   the end of it, see `hangup'. */
+static int
+event_ctl (CONNECTION * con, int op)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLET;
+    if (!con->throttled)
+	ev.events |= EPOLLIN | EPOLLRDHUP;
+    if (con->wantwrite)
+	ev.events |= EPOLLOUT;
+    ev.data.u64 = con->id;
+    if (epoll_ctl (Epoll_Fd, op, con->fd, &ev) == -1)
+    {
+	logerr ("event_ctl", "epoll_ctl");
+	return -1;
+    }
+    return 0;
+}
+
+static void
+ready_add (CONNECTION * con)
+{
+    if (con->ready)
+	return;
+    if (Num_Ready == Max_Ready && ready_grow (Max_Ready + 64))
+	return;
+    Ready[Num_Ready++] = con;
+    con->ready = 1;
+}
+
+int
+event_init (void)
+{
+    Epoll_Fd = epoll_create (Max_Connections > 0 ? Max_Connections : 1024);
+    if (Epoll_Fd == -1)
+    {
+	logerr ("event_init", "epoll_create");
+	return -1;
+    }
+    return 0;
+}
+
+void
+event_listen (int fd)
+{
+    struct epoll_event ev;
+
+    if (safe_realloc ((void **) &Listeners, sizeof (int) * (Num_Listeners + 1))
+	|| safe_realloc ((void **) &Pending,
+			 sizeof (int) * (Num_Listeners + 1)))
+    {
+	OUTOFMEMORY ("event_listen");
+	return;
+    }
+    Listeners[Num_Listeners++] = fd;
+
+    /* listening sockets are level triggered so that we don't have to drain
+       the accept queue in one go */
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_LISTENER | (unsigned int) fd;
+    if (epoll_ctl (Epoll_Fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+	logerr ("event_listen", "epoll_ctl");
+}
+
+/* called when a new connection is added to the Clients list */
+int
+event_add (CONNECTION * con)
+{
+    con->readable = 0;
+    con->writable = 0;
+    con->ready = 0;
+    con->throttled = 0;
+    con->hangup = 0;
+    /* a nonblocking connect() reports completion as writable */
+    con->wantwrite = con->connecting;
+    return event_ctl (con, EPOLL_CTL_ADD);
+}
+
+/* called from remove_connection().  the kernel drops the registration when
+   the socket is closed, we just need to forget about it ourselves */
+void
+event_del (CONNECTION * con)
+{
+    cancel_timer (con->flood_timer);
+    con->flood_timer = 0;
+    con->throttled = 0;
+}
+
+/* called when output has been queued for `con'.  enable write interest and
+   make sure the main loop visits this connection on the next pass */
+void
+event_touch (CONNECTION * con)
+{
+    if (!con->wantwrite)
+    {
+	con->wantwrite = 1;
+	event_ctl (con, EPOLL_CTL_MOD);
+    }
+    ready_add (con);
+}
+
+/* re-enable reading once the client is no longer flooding.  it goes back
+   on the Ready list since there may be commands left in its input buffer
+   which the kernel knows nothing about */
+static void
+event_unthrottle (CONNECTION * con)
+{
+    ASSERT (validate_connection (con));
+    con->flood_timer = 0;
+    con->throttled = 0;
+    event_ctl (con, EPOLL_CTL_MOD);
+    con->readable = 1;
+    ready_add (con);
+}
+
+/* stop reading from a flooding client until its flood counter expires */
+void
+event_throttle (CONNECTION * con)
+{
+    if (con->throttled)
+	return;
+    con->throttled = 1;
+    con->readable = 0;
+    event_ctl (con, EPOLL_CTL_MOD);
+    flood_wait (con, (timer_cb_t) event_unthrottle);
+}
+
+/* `timeout' is in milliseconds */
+int
+event_wait (int timeout)
+{
+    int i, n;
+    CONNECTION *con;
+
+    /* don't block if connections carried over from the last pass still
+       have work to do */
+    if (Num_Ready > 0)
+	timeout = 0;
+    n = epoll_wait (Epoll_Fd, Events, MAX_EVENTS, timeout);
+    Num_Pending = 0;
+    if (n == -1)
+    {
+	logerr ("event_wait", "epoll_wait");
+	return -1;
+    }
+    for (i = 0; i < n; i++)
+    {
+	if (Events[i].data.u64 & EV_LISTENER)
+	{
+	    Pending[Num_Pending++] = (int) (Events[i].data.u64 & ~EV_LISTENER);
+	    continue;
+	}
+	con = Clients[Events[i].data.u64];
+	ASSERT (validate_connection (con));
+	if (Events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+	    con->readable = 1;
+	if (Events[i].events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+	    con->readable = con->hangup = 1;
+	if (Events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+	    con->writable = 1;
+	ready_add (con);
+    }
+    return n;
+}
+
+int
+event_pending (int fd)
+{
+    int i;
+
+    for (i = 0; i < Num_Pending; i++)
+	if (Pending[i] == fd)
+	    return 1;
+    return 0;
+}
+
+/* called at the end of each pass through the main loop.  drop write
+   interest for connections whose output has been flushed and keep only
+   those connections which can still make progress on the Ready list */
+void
+event_reset (void)
+{
+    int i, j, want;
+    CONNECTION *con;
+
+    for (i = 0, j = 0; i < Num_Ready; i++)
+    {
+	con = Ready[i];
+	if (!con)
+	    continue;		/* removed */
+	want = con->connecting || con->sendq.head ||
+	    (ISSERVER (con) && con->sopt->outq.head);
+	if (want != con->wantwrite)
+	{
+	    con->wantwrite = want;
+	    event_ctl (con, EPOLL_CTL_MOD);
+	}
+	if ((con->readable && !con->throttled) ||
+	    (con->writable && con->wantwrite))
+	    Ready[j++] = con;
+	else
+	    con->ready = 0;
+    }
+    Num_Ready = j;
+}
+
+void
+event_close (void)
+{
+    if (Epoll_Fd != -1)
+	CLOSE (Epoll_Fd);
+    Epoll_Fd = -1;
+    if (Pending)
+	FREE (Pending);
+    if (Listeners)
+	FREE (Listeners);
+    if (Ready)
+	FREE (Ready);
+}
+
+#else
+
+static fd_set Read_Set;
+static fd_set Write_Set;
+static int Touched = 0;		/* set by event_touch() */
+
+int
+event_init (void)
+{
+    return 0;
+}
+
+void
+event_listen (int fd)
+{
+    if (safe_realloc ((void **) &Listeners, sizeof (int) * (Num_Listeners + 1)))
+    {
+	OUTOFMEMORY ("event_listen");
+	return;
+    }
+    Listeners[Num_Listeners++] = fd;
+}
+
+int
+event_add (CONNECTION * con)
+{
+    con->readable = 0;
+    con->writable = 0;
+    con->throttled = 0;
+    con->hangup = 0;
+    return 0;
+}
+
+void
+event_del (CONNECTION * con)
+{
+    cancel_timer (con->flood_timer);
+    con->flood_timer = 0;
+    con->throttled = 0;
+}
+
+/* all clients are visited on every pass, just make sure that the next
+   one happens right away */
+void
+event_touch (CONNECTION * con)
+{
+    (void) con;
+    Touched = 1;
+}
+
+/* nothing to do here, the timer just makes sure that event_wait() returns
+   when the client may be read from again */
+static void
+event_unthrottle (CONNECTION * con)
+{
+    ASSERT (validate_connection (con));
+    con->flood_timer = 0;
+    con->throttled = 0;
+}
+
+/* flooding clients are left out of the read set in event_wait() */
+void
+event_throttle (CONNECTION * con)
+{
+    if (con->throttled)
+	return;
+    con->throttled = 1;
+    flood_wait (con, (timer_cb_t) event_unthrottle);
+}
+
+/* `timeout' is in milliseconds */
+int
+event_wait (int timeout)
+{
+    int i, n, maxfd = -1;
+    struct timeval t;
+    CONNECTION *con;
+
+    FD_ZERO (&Read_Set);
+    FD_ZERO (&Write_Set);
+    for (i = 0; i < Num_Listeners; i++)
+    {
+	FD_SET (Listeners[i], &Read_Set);
+	if (Listeners[i] > maxfd)
+	    maxfd = Listeners[i];
+    }
+
+    for (i = 0; i < Live_Clients.count; i++)
+    {
+	con = Live_Clients.con[i];
+	/* only check the socket if the client is not flooding.
+	 * this effectively throttles flooding clients
+	 */
+	if (!con->throttled && FLOODING (con))
+	    event_throttle (con);
+	if (!con->throttled)
+	{
+	    FD_SET (con->fd, &Read_Set);
+	    /* don't wait if there are commands left in the input buffer */
+	    if (con->backlog)
+		timeout = 0;
+	}
+	/* check sockets for writing */
+	if (con->connecting || con->sendq.head ||
+	    (ISSERVER (con) && con->sopt->outq.head))
+	    FD_SET (con->fd, &Write_Set);
+	if (con->fd > maxfd)
+	    maxfd = con->fd;
+    }
+
+    if (Touched)
+    {
+	timeout = 0;
+	Touched = 0;
+    }
+    t.tv_sec = timeout / 1000;
+    t.tv_usec = (timeout % 1000) * 1000;
+    if ((n = select (maxfd + 1, &Read_Set, &Write_Set, NULL,
+		     timeout < 0 ? NULL : &t)) < 0)
+    {
+	logerr ("event_wait", "select");
+	return -1;
+    }
+
+    Num_Ready = 0;
+    if (ready_grow (Live_Clients.count))
+	return -1;
+    for (i = 0; i < Live_Clients.count; i++)
+    {
+	con = Live_Clients.con[i];
+	con->readable = (FD_ISSET (con->fd, &Read_Set) ||
+			 (con->backlog && !con->throttled)) ? 1 : 0;
+	con->writable = FD_ISSET (con->fd, &Write_Set) ? 1 : 0;
+	Ready[Num_Ready++] = con;
+    }
+    return n;
+}
+
+int
+event_pending (int fd)
+{
+    return FD_ISSET (fd, &Read_Set);
+}
+
+void
+event_reset (void)
+{
+    Num_Ready = 0;
+}
+
+void
+event_close (void)
+{
+    if (Listeners)
+	FREE (Listeners);
+    if (Ready)
+	FREE (Ready);
+}
+
+#endif /* HAVE_EPOLL */
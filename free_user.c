@@ -67,5 +67,6 @@ free_user (USER * user)
     FREE (user->pass);
     FREE (user->clientinfo);
     /* NOTE: user->server is just a ref, not a malloc'd pointer */
-    FREE (user);
+    /* a search thread may still be looking at this user's files */
+    retire (user);
 }
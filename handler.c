@@ -4,6 +4,7 @@
 
    $Id$ */
 
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -80,6 +81,12 @@ HANDLER (encapsulated)
     }
 }
 
+/* command flags */
+#define CMD_UNREG	1	/* may be sent before logging in */
+#define CMD_NOFLOOD	2	/* not counted by flood protection */
+#define CMD_SHARE	4	/* part of a share sequence */
+#define CMD_UNSHARE	8	/* part of an unshare sequence */
+
 typedef struct
 {
     unsigned int message;
@@ -87,8 +94,7 @@ typedef struct
 }
 HANDLER;
 
-/* this is the table of valid commands we accept from both users and servers
-   THIS TABLE MUST BE SORTED BY MESSAGE TYPE */
+/* this is the table of valid commands we accept from both users and servers */
 static HANDLER Protocol[] = {
     {MSG_CLIENT_LOGIN, login},	/* 2 */
     {MSG_CLIENT_LOGIN_REGISTER, login},	/* 6 */
@@ -192,7 +198,8 @@ static HANDLER Protocol[] = {
     {MSG_CLIENT_REMOVE_SERVER, remove_server},	/* 10111 */
     {MSG_CLIENT_LINKS, server_links},	/* 10112 */
     {MSG_CLIENT_USAGE_STATS, server_usage},	/* 10115 */
-    {MSG_CLIENT_REHASH, rehash},		/* 10116 */
+    {MSG_CLIENT_REHASH, rehash},		/* 10117 */
+    {MSG_CLIENT_COMMAND_STATS, command_stats},	/* 10118 */
     {MSG_CLIENT_REGISTER_USER, register_user},	/* 10200 */
     {MSG_CLIENT_CHANNEL_LEVEL, channel_level},	/* 10201 - deprecated */
     {MSG_CLIENT_KICK_USER, kick},	/* 10202 - deprecated */
@@ -213,40 +220,98 @@ static HANDLER Protocol[] = {
 };
 static int Protocol_Size = sizeof (Protocol) / sizeof (HANDLER);
 
-/* use a binary search to find the table in the entry */
-static int
-find_handler (unsigned int tag)
+/* commands which need special treatment in handle_connection() */
+static struct
+{
+    unsigned int message;
+    unsigned int flags;
+}
+Command_Flags[] = {
+    {MSG_SERVER_ERROR, CMD_UNREG},	/* 0 */
+    {MSG_CLIENT_LOGIN, CMD_UNREG},	/* 2 */
+    {4, CMD_UNREG},		/* unknown: v2.0 beta 5a sends this? */
+    {MSG_CLIENT_LOGIN_REGISTER, CMD_UNREG},	/* 6 */
+    {MSG_CLIENT_REGISTER, CMD_UNREG},	/* 7 */
+    {MSG_CLIENT_CHECK_PASS, CMD_UNREG},	/* 11 */
+    {MSG_CLIENT_ADD_FILE, CMD_NOFLOOD | CMD_SHARE},	/* 100 */
+    {MSG_CLIENT_REMOVE_FILE, CMD_NOFLOOD | CMD_UNSHARE},	/* 102 */
+    {MSG_CLIENT_CHECK_PORT, CMD_UNREG},	/* 300 */
+    {MSG_CLIENT_ADD_DIRECTORY, CMD_SHARE},	/* 870 */
+    {MSG_SERVER_LOGIN, CMD_UNREG},	/* 10010 */
+    {MSG_SERVER_LOGIN_ACK, CMD_UNREG},	/* 10011 */
+    {MSG_CLIENT_SHARE_FILE, CMD_NOFLOOD | CMD_SHARE},	/* 10300 */
+};
+
+/* Protocol[] and Command_Flags[] are merged into a two level table indexed
+   directly by the message type, so that finding a command and its flags is
+   a couple of array lookups.  the message types are clustered (0-999 and
+   10000-10300), so only a few pages of 256 entries are ever used */
+typedef struct
+{
+    HANDLER ((*handler));
+    unsigned int flags;
+    CMDSTAT *stats;		/* created the first time it is used */
+}
+COMMAND;
+
+#define MAX_PAGES 8
+
+static COMMAND Pages[MAX_PAGES][256];
+static int Num_Pages = 0;
+static COMMAND *Commands[256];	/* indexed by the high byte of the tag */
+
+static COMMAND *
+find_command (unsigned short tag)
 {
-    int min = 0, max = Protocol_Size - 1, try;
+    COMMAND *page = Commands[tag >> 8];
+
+    return page ? &page[tag & 0xff] : 0;
+}
 
-    while (!SigCaught)
+/* returns the table entry for `tag', creating its page if needed */
+static COMMAND *
+add_command (unsigned int tag)
+{
+    ASSERT (tag < 65536);
+    if (!Commands[tag >> 8])
     {
-	try = (max + min) / 2;
-	if (tag == Protocol[try].message)
-	    return try;
-	else if (min == max)
-	    return -1;		/* not found */
-	else if (tag < Protocol[try].message)
-	{
-	    if (try == min)
-		return -1;
-	    max = try - 1;
-	}
-	else
+	if (Num_Pages == MAX_PAGES)
 	{
-	    if (try == max)
-		return -1;
-	    min = try + 1;
+	    /* shouldn't happen unless a new range of commands is added */
+	    log ("add_command(): out of pages, increase MAX_PAGES");
+	    return 0;
 	}
-	ASSERT (min <= max);
+	Commands[tag >> 8] = Pages[Num_Pages++];
     }
-    return -1;
+    return &Commands[tag >> 8][tag & 0xff];
 }
 
-/* this is not a real handler, but takes the same arguments as one */
-HANDLER (dispatch_command)
+int
+init_handlers (void)
+{
+    COMMAND *cmd;
+    unsigned int i;
+
+    for (i = 0; i < (unsigned int) Protocol_Size; i++)
+    {
+	if (!(cmd = add_command (Protocol[i].message)))
+	    return -1;
+	ASSERT (cmd->handler == 0);
+	cmd->handler = Protocol[i].handler;
+    }
+    for (i = 0; i < sizeof (Command_Flags) / sizeof (Command_Flags[0]); i++)
+    {
+	if (!(cmd = add_command (Command_Flags[i].message)))
+	    return -1;
+	cmd->flags = Command_Flags[i].flags;
+    }
+    return 0;
+}
+
+static void
+run_command (CONNECTION * con, COMMAND * cmd, unsigned short tag,
+	     unsigned short len, char *pkt)
 {
-    int l;
     unsigned char byte;
 
     ASSERT (validate_connection (con));
@@ -262,12 +327,30 @@ HANDLER (dispatch_command)
 	    (con->recvbuf->data, con->recvbuf->consumed + 4 + len + 1));
     byte = *(pkt + len);
     *(pkt + len) = 0;
-    l = find_handler (tag);
-    if (l != -1)
+    if (cmd && cmd->handler)
     {
-	ASSERT (Protocol[l].handler != 0);
+	unsigned long start, elapsed;
+	unsigned int queued = Bytes_Queued;
+	char what[256];
+
+	if (!cmd->stats)
+	    cmd->stats = cmdstat_new (tag);
+	/* the handler may chop up the packet or even free the user, so
+	   describe the command up front in case it turns out to be slow */
+	if (Slow_Command > 0)
+	    snprintf (what, sizeof (what), "%s%s%s, len=%hu, data=%.*s",
+		      ISUSER (con) ? con->user->nick : "",
+		      ISUSER (con) ? "!" : "", con->host, len, 128, pkt);
+	start = cmdstat_clock ();
 	/* note that we pass only the data part of the packet */
-	Protocol[l].handler (con, tag, len, pkt);
+	cmd->handler (con, tag, len, pkt);
+	elapsed = cmdstat_clock () - start;
+	if (cmd->stats)
+	    cmdstat_add (cmd->stats, elapsed, Bytes_Queued - queued);
+	if (Slow_Command > 0 &&
+	    elapsed >= (unsigned long) Slow_Command * 1000000UL)
+	    log ("dispatch_command(): tag %hu took %.1f ms: %s", tag,
+		 elapsed / 1000000., what);
 	goto done;
     }
     log ("dispatch_command(): unknown message: tag=%hu, length=%hu, data=%s",
@@ -279,7 +362,7 @@ HANDLER (dispatch_command)
     if (ISSERVER (con))
     {
 	unsigned char ch;
-	int bytes;
+	int bytes, l;
 
 	/* dump some bytes from the input buffer to see if it helps aid
 	   debugging */
@@ -302,140 +385,201 @@ HANDLER (dispatch_command)
     *(pkt + len) = byte;
 }
 
-void
-handle_connection (CONNECTION * con)
+/* this is not a real handler, but takes the same arguments as one */
+HANDLER (dispatch_command)
+{
+    run_command (con, find_command (tag), tag, len, pkt);
+}
+
+/* size of the input buffer given to a client when it first sends
+   something.  it grows if a single command won't fit and is released
+   again once the client has been drained, so idle clients cost nothing */
+#define RECVBUF_SIZE 16384
+
+/* the maximum number of commands processed from one connection on each
+   pass through the main loop, so that a client with a lot of queued input
+   (eg. a long list of shares) can't starve everyone else */
+#define MAX_BATCH 64
+
+/* compressed input from server links */
+static char Inbuf[RECVBUF_SIZE];
+
+/* the input buffer last released by a drained client.  it is handed to
+   the next client which reads, so a client that only ever has whole
+   commands waiting doesn't allocate a buffer for each of them */
+static BUFFER *Spare_Input = 0;
+
+/* move the unprocessed part of the input buffer to the front.  this is
+   only done before reading more data, so at most one partial command is
+   copied per read */
+static void
+compact_input (BUFFER * b)
 {
     int n;
-    unsigned short tag, len;
 
-    ASSERT (validate_connection (con));
+    if (!b->consumed)
+	return;
+    n = b->datasize - b->consumed;
+    if (n > 0)
+	memmove (b->data, b->data + b->consumed, n);
+    b->datasize = n;
+    b->consumed = 0;
+}
 
-    if (ISSERVER (con))
+/* returns nonzero if the connection should be closed */
+static int
+read_error (CONNECTION * con, int n)
+{
+    if (n == -1)
     {
-	/* server data is compressed.  read as much as we can and pass it
-	   to the decompressor */
-	n = READ (con->fd, Buf, sizeof (Buf));
-	if (n <= 0)
-	{
-	    if (n == -1)
-		log ("handle_connection(): read: %s (errno %d) for host %s",
-		     strerror(N_ERRNO), N_ERRNO, con->host);
-	    else
-		log ("handle_connection(): EOF from %s", con->host);
-	    con->destroy = 1;
-	    return;
-	}
-	Bytes_In += n;
-	if (buffer_decompress (con->recvbuf, con->sopt->zin, Buf, n))
+	if (N_ERRNO == EWOULDBLOCK)
 	{
-	    con->destroy = 1;
-	    return;
+	    con->readable = 0;
+	    return 0;
 	}
+	log ("handle_connection(): read: %s (errno %d) for host %s",
+	     strerror (N_ERRNO), N_ERRNO, con->host);
     }
     else
+	log ("handle_connection(): EOF from %s", con->host);
+    return 1;
+}
+
+/* fill the input buffer of a client with as much as will fit in one
+   read().  returns nonzero if the connection should be closed */
+static int
+read_client (CONNECTION * con)
+{
+    BUFFER *b = con->recvbuf;
+    unsigned short len;
+    int n, want;
+
+    if (!b && Spare_Input)
+    {
+	b = con->recvbuf = Spare_Input;
+	Spare_Input = 0;
+    }
+    else if (!b)
     {
-	/* create the input buffer if it doesn't yet exist */
-	if (!con->recvbuf)
+	b = CALLOC (1, sizeof (BUFFER));
+	if (!b)
 	{
-	    con->recvbuf = CALLOC (1, sizeof (BUFFER));
-	    if (!con->recvbuf)
-	    {
-		OUTOFMEMORY ("handle_connection");
-		con->destroy = 1;
-		return;
-	    }
+	    OUTOFMEMORY ("handle_connection");
+	    return 1;
+	}
 #if DEBUG
-	    con->recvbuf->magic = MAGIC_BUFFER;
+	b->magic = MAGIC_BUFFER;
 #endif
-	    con->recvbuf->data = MALLOC (5);
-	    if (!con->recvbuf->data)
-	    {
-		OUTOFMEMORY ("handle_connection");
-		con->destroy = 1;
-		return;
-	    }
-	    con->recvbuf->datamax = 4;
-	}
-	/* read the packet header if we haven't seen it already */
-	while (con->recvbuf->datasize < 4)
+	/* allocate 1 extra byte for the \0 that dispatch_command()
+	   requires */
+	b->data = MALLOC (RECVBUF_SIZE + 1);
+	if (!b->data)
 	{
-	    n = READ (con->fd, con->recvbuf->data + con->recvbuf->datasize,
-		      4 - con->recvbuf->datasize);
-	    if (n == -1)
-	    {
-		if (N_ERRNO != EWOULDBLOCK)
-		{
-		    log ("handle_connection(): read: %s (errno %d) for host %s",
-			 strerror(N_ERRNO), N_ERRNO, con->host);
-		    con->destroy = 1;
-		}
-		return;
-	    }
-	    else if (n == 0)
-	    {
-		con->destroy = 1;
-		return;
-	    }
-	    Bytes_In += n;
-	    con->recvbuf->datasize += n;
+	    FREE (b);
+	    OUTOFMEMORY ("handle_connection");
+	    return 1;
 	}
-	/* read the packet body */
-	memcpy (&len, con->recvbuf->data, 2);
+	b->datamax = RECVBUF_SIZE;
+	con->recvbuf = b;
+    }
+    compact_input (b);
+    /* if there isn't enough space to hold the next command, resize the
+       input buffer */
+    if (b->datasize >= 4)
+    {
+	memcpy (&len, b->data, 2);
 	len = BSWAP16 (len);
-	if (len > 0)
+	if (b->datamax < 4 + len)
 	{
-	    if (len > Max_Command_Length)
+	    if (safe_realloc ((void **) &b->data, 4 + len + 1))
 	    {
-		log ("handle_connection(): %hu byte message from %s",
-		     len, con->host);
-		con->destroy = 1;
-		return;
+		OUTOFMEMORY ("handle_connection");
+		return 1;
 	    }
+	    b->datamax = 4 + len;
+	}
+    }
+    want = b->datamax - b->datasize;
+    n = READ (con->fd, b->data + b->datasize, want);
+    if (n <= 0)
+	return read_error (con, n);
+    Bytes_In += n;
+    b->datasize += n;
+    /* a short read means the socket has been drained.  the event code
+       will tell us when more arrives, unless it has already said that the
+       peer is gone, in which case we keep reading to get the EOF */
+    if (n < want && !con->hangup)
+	con->readable = 0;
+    return 0;
+}
 
-	    /* if there isn't enough space to read the entire body, resize the
-	       input buffer */
-	    if (con->recvbuf->datamax < 4 + len)
-	    {
-		/* allocate 1 extra byte for the \0 that dispatch_command()
-		   requires */
-		if (safe_realloc ((void **) &con->recvbuf->data, 4 + len + 1))
-		{
-		    OUTOFMEMORY ("handle_connection");
-		    con->destroy = 1;
-		    return;
-		}
-		con->recvbuf->datamax = 4 + len;
-	    }
-	    n = READ (con->fd, con->recvbuf->data + con->recvbuf->datasize,
-		      len + 4 - con->recvbuf->datasize);
-	    if (n == -1)
-	    {
-		/* since the header and body could arrive in separate packets,
-		   we have to check for this here so we don't close the
-		   connection on this nonfatal error.  we just wait for the
-		   next packet to arrive */
-		if (N_ERRNO != EWOULDBLOCK)
-		{
-		log ("handle_connection(): read: %s (errno %d) for host %s",
-		     strerror(N_ERRNO), N_ERRNO, con->host);
-		    con->destroy = 1;
-		}
-		return;
-	    }
-	    else if (n == 0)
-	    {
-		log ("handle_connection(): EOF from %s", con->host);
+/* the peer starts compressing right after the login handshake, so
+   anything which came in behind the command that made `con' a server has
+   to be run through the decompressor */
+static int
+decompress_rest (CONNECTION * con)
+{
+    BUFFER *b = con->recvbuf;
+    char *rest;
+    int n = b->datasize - b->consumed;
+
+    if (!n)
+	return 0;
+    rest = MALLOC (n);
+    if (!rest)
+    {
+	OUTOFMEMORY ("handle_connection");
+	return -1;
+    }
+    memcpy (rest, b->data + b->consumed, n);
+    b->datasize = b->consumed = 0;
+    n = buffer_decompress (b, con->sopt->zin, rest, n);
+    FREE (rest);
+    return n;
+}
+
+void
+handle_connection (CONNECTION * con)
+{
+    int n, count, flags, server = ISSERVER (con);
+    unsigned short tag, len;
+    COMMAND *cmd;
+
+    ASSERT (validate_connection (con));
+
+    /* if commands were left over from the last pass, get through those
+       before reading any more */
+    if (con->backlog)
+	con->backlog = 0;
+    else if (server)
+    {
+	/* server data is compressed.  read as much as we can and pass it
+	   to the decompressor */
+	n = READ (con->fd, Inbuf, sizeof (Inbuf));
+	if (n <= 0)
+	{
+	    if (read_error (con, n))
 		con->destroy = 1;
-		return;
-	    }
-	    con->recvbuf->datasize += n;
-	    Bytes_In += n;
+	    return;
+	}
+	Bytes_In += n;
+	if (n < (int) sizeof (Inbuf) && !con->hangup)
+	    con->readable = 0;
+	compact_input (con->recvbuf);
+	if (buffer_decompress (con->recvbuf, con->sopt->zin, Inbuf, n))
+	{
+	    con->destroy = 1;
+	    return;
 	}
     }
-    /* process as many complete commands as possible.  for a client this
-       will be exactly one, but a server link may have sent multiple commands
-       in one compressed packet */
-    while (con->recvbuf->consumed < con->recvbuf->datasize)
+    else if (read_client (con))
+    {
+	con->destroy = 1;
+	return;
+    }
+
+    /* process all of the complete commands we have, up to MAX_BATCH */
+    for (count = 0;; count++)
     {
 	/* if we don't have the complete packet header, wait until we
 	   read more data */
@@ -446,16 +590,28 @@ handle_connection (CONNECTION * con)
 	memcpy (&tag, con->recvbuf->data + con->recvbuf->consumed + 2, 2);
 	len = BSWAP16 (len);
 	tag = BSWAP16 (tag);
+	if (!server && len > Max_Command_Length)
+	{
+	    log ("handle_connection(): %hu byte message from %s",
+		 len, con->host);
+	    con->destroy = 1;
+	    return;
+	}
 	/* check if the entire packet body has arrived */
 	if (con->recvbuf->consumed + 4 + len > con->recvbuf->datasize)
 	    break;
+	/* leave the rest for the next pass if this client has had its
+	   share, or has started flooding */
+	if (count == MAX_BATCH || FLOODING (con))
+	{
+	    con->backlog = 1;
+	    con->readable = 1;	/* keeps it on the Ready list */
+	    return;
+	}
+	cmd = find_command (tag);
+	flags = cmd ? cmd->flags : 0;
 	/* require that the client register before doing anything else */
-	if (con->class == CLASS_UNKNOWN &&
-	    (tag != MSG_CLIENT_LOGIN && tag != MSG_CLIENT_LOGIN_REGISTER &&
-	     tag != MSG_CLIENT_REGISTER && tag != MSG_SERVER_LOGIN &&
-	     tag != MSG_SERVER_LOGIN_ACK && tag != MSG_SERVER_ERROR &&
-	     tag != 4 &&	/* unknown: v2.0 beta 5a sends this? */
-	     tag != 300 && tag != 11))
+	if (con->class == CLASS_UNKNOWN && !(flags & CMD_UNREG))
 	{
 	    log ("handle_connection(): %s is not registered", con->host);
 	    *(con->recvbuf->data + con->recvbuf->consumed + 4 + len) = 0;
@@ -479,9 +635,7 @@ handle_connection (CONNECTION * con)
 	}
 
 	    /* do flood protection */
-	if (ISUSER (con) && Flood_Commands > 0 &&
-		tag != MSG_CLIENT_ADD_FILE && tag != MSG_CLIENT_SHARE_FILE &&
-		tag != MSG_CLIENT_REMOVE_FILE)
+	if (ISUSER (con) && Flood_Commands > 0 && !(flags & CMD_NOFLOOD))
 	{
 	    if(con->flood<Current_Time)
 		con->flood=Current_Time;
@@ -519,9 +673,7 @@ handle_connection (CONNECTION * con)
 	       since this case will seldom happen */
 	    if (con->user->sharing)
 	    {
-		if (tag != MSG_CLIENT_ADD_FILE
-		    && tag != MSG_CLIENT_SHARE_FILE
-		    && tag != MSG_CLIENT_ADD_DIRECTORY)
+		if (!(flags & CMD_SHARE))
 		{
 		    pass_message_args (con, MSG_SERVER_USER_SHARING,
 				       "%s %hu %u", con->user->nick,
@@ -531,7 +683,7 @@ handle_connection (CONNECTION * con)
 	    }
 	    else if (con->user->unsharing)
 	    {
-		if (tag != MSG_CLIENT_REMOVE_FILE)
+		if (!(flags & CMD_UNSHARE))
 		{
 		    pass_message_args (con, MSG_SERVER_USER_SHARING,
 				       "%s %hu %u", con->user->nick,
@@ -541,21 +693,45 @@ handle_connection (CONNECTION * con)
 	    }
 	}
 	/* call the protocol handler */
-	dispatch_command (con, tag, len,
-			  con->recvbuf->data + con->recvbuf->consumed + 4);
+	run_command (con, cmd, tag, len,
+		     con->recvbuf->data + con->recvbuf->consumed + 4);
 	/* mark data as processed */
 	con->recvbuf->consumed += 4 + len;
+	if (con->destroy)
+	    return;
+	if (!server && ISSERVER (con))
+	{
+	    server = 1;
+	    if (decompress_rest (con))
+	    {
+		con->destroy = 1;
+		return;
+	    }
+	}
     }
-    if (con->recvbuf->consumed)
+    if (con->recvbuf->consumed == con->recvbuf->datasize)
     {
-	n = con->recvbuf->datasize - con->recvbuf->consumed;
-	if (n > 0)
+	/* everything has been processed */
+	con->recvbuf->datasize = 0;
+	con->recvbuf->consumed = 0;
+	if (!server)
 	{
-	    /* shift down unprocessed data */
-	    memmove (con->recvbuf->data,
-		     con->recvbuf->data + con->recvbuf->consumed, n);
+	    /* keep one buffer of the usual size around for the next
+	       client, free any others */
+	    if (!Spare_Input && con->recvbuf->datamax == RECVBUF_SIZE)
+		Spare_Input = con->recvbuf;
+	    else
+		buffer_free (con->recvbuf);
+	    con->recvbuf = 0;
 	}
-	con->recvbuf->datasize = n;
-	con->recvbuf->consumed = 0;	/* reset */
     }
 }
+
+#if DEBUG
+void
+free_spare_input (void)
+{
+    buffer_free (Spare_Input);
+    Spare_Input = 0;
+}
+#endif /* DEBUG */
@@ -5,7 +5,6 @@
    $Id$ */
 
 #include <string.h>
-#include <ctype.h>
 #include <stdlib.h>
 #include "hash.h"
 #include "debug.h"
@@ -14,10 +13,30 @@
 #include "opennap.h"
 #endif
 
-/* a simple hash table.  keys are case insensitive for this application */
+/* a simple hash table.  keys are case insensitive for this application.
 
-/* initialize a hash table.  `buckets' should be a prime number for maximum
-   dispersion of entries into buckets */
+   entries are stored directly in an array of slots using linear probing.
+   each slot keeps the hash code of its key so that strcasecmp() is only
+   called on a probable match.  the table doubles when it becomes 3/4 full
+   and shrinks when it drops below 1/8 full.  rather than moving every
+   entry at once, the old array is kept around after a resize and a few of
+   its slots are moved over on each hash_add() and hash_remove() until it
+   is empty, so that no single call pays for the whole table. */
+
+#define MIN_SIZE 8
+#define REHASH_STEP 16		/* old slots moved per add/remove */
+
+/* placeholder key for slots whose entry has been removed.  lookups have to
+   keep probing past these, but they can be reused by hash_add() */
+static const char Deleted[] = "";
+
+/* key of the slots in tables which compare keys with hash_match */
+static const char Nokey[] = "";
+
+#define LIVE(he) ((he)->key && (he)->key != Deleted)
+
+/* initialize a hash table.  `buckets' is the number of entries the table
+   is expected to hold, it will grow as needed */
 HASH *
 hash_init (int buckets, hash_destroy f)
 {
@@ -25,8 +44,11 @@ hash_init (int buckets, hash_destroy f)
 
     if (!h)
 	return 0;
-    h->numbuckets = buckets;
-    if ((h->bucket = CALLOC (buckets, sizeof (HASHENT *))) == 0)
+    h->minsize = MIN_SIZE;
+    while (h->minsize < buckets)
+	h->minsize <<= 1;
+    h->size = h->minsize;
+    if ((h->slot = CALLOC (h->size, sizeof (HASHENT))) == 0)
     {
 	FREE (h);
 	return 0;
@@ -35,128 +57,273 @@ hash_init (int buckets, hash_destroy f)
     return h;
 }
 
-static unsigned int
-hash_string (HASH * table, const char *key)
+#define ONES ((hash_t) 0x0101010101010101ULL)
+
+/* fold the 8 chars packed into `w' to lower case.  `upper' has the high
+   bit set in each byte which is in the range 'A'..'Z', which is then
+   shifted down to the 0x20 bit.  the high bit is masked off before adding
+   so nothing carries into the next byte, and bytes with the high bit set
+   are left alone just like tolower() does in the C locale */
+static hash_t
+fold_word (hash_t w)
+{
+    hash_t x = w & (0x7f * ONES);
+    hash_t upper;
+
+    upper = (x + (0x80 - 'A') * ONES) & ~(x + (0x80 - 'Z' - 1) * ONES);
+    return w | ((upper & ~w & (0x80 * ONES)) >> 2);
+}
+
+/* case insensitive hash of `key', computed 8 chars at a time */
+hash_t
+hash_string (const char *key)
 {
-    unsigned long h = 0, g;
+    size_t len;
+    hash_t h, w;
 
     ASSERT (key != 0);
-    for (; *key; key++)
+    len = strlen (key);
+    h = len * (hash_t) 0x9e3779b97f4a7c15ULL;
+    for (;;)
     {
-	h = (h << 4) + tolower (*key);
-	if ((g = h & 0xF0000000))
-	    h ^= g >> 24;
-	h &= ~g;
+	w = 0;
+	memcpy (&w, key, len < 8 ? len : 8);
+	h = (h ^ fold_word (w)) * (hash_t) 0xff51afd7ed558ccdULL;
+	h ^= h >> 32;
+	if (len <= 8)
+	    break;
+	key += 8;
+	len -= 8;
     }
-    return h % table->numbuckets;
+    h *= (hash_t) 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 29;
+    return h;
 }
 
-int
-hash_add (HASH * table, const char *key, void *data)
+/* returns the slot holding `key' in the array `slot', or 0 if not present.
+   there is always at least one empty slot so the loop terminates */
+static HASHENT *
+find_slot (HASH * h, HASHENT * slot, int size, hash_t sum, const char *key)
+{
+    unsigned int i = (unsigned int) sum & (size - 1);
+
+    for (; slot[i].key; i = (i + 1) & (size - 1))
+    {
+	if (slot[i].sum == sum && slot[i].key != Deleted &&
+	    !(h->match ? h->match (key, slot[i].data) :
+	      strcasecmp (key, slot[i].key)))
+	    return &slot[i];
+    }
+    return 0;
+}
+
+static void
+put_slot (HASH * h, hash_t sum, const char *key, void *data)
+{
+    unsigned int i = (unsigned int) sum & (h->size - 1);
+
+    while (LIVE (&h->slot[i]))
+	i = (i + 1) & (h->size - 1);
+    if (h->slot[i].key == Deleted)
+	h->tombs--;
+    h->slot[i].key = key;
+    h->slot[i].data = data;
+    h->slot[i].sum = sum;
+}
+
+/* move up to `n' slots from the old array into the current one */
+static void
+rehash_step (HASH * h, int n)
 {
-    HASHENT *he = CALLOC (1, sizeof (HASHENT));
-    unsigned int sum;
+    HASHENT *he;
 
-    if (!he)
+    while (h->old && n-- > 0)
+    {
+	he = &h->old[h->migrate++];
+	if (LIVE (he))
+	{
+	    put_slot (h, he->sum, he->key, he->data);
+	    /* not cleared, entries further along may have probed past it */
+	    he->key = Deleted;
+	}
+	if (h->migrate == h->oldsize)
+	{
+	    FREE (h->old);
+	    h->old = 0;
+	}
+    }
+}
+
+/* start moving the entries into a new array sized for the current number
+   of entries */
+static int
+hash_resize (HASH * h)
+{
+    HASHENT *slot;
+    int size = h->minsize;
+
+    /* finish off the previous resize first */
+    if (h->old)
+	rehash_step (h, h->oldsize);
+    while (size <= h->dbsize * 2)
+	size <<= 1;
+    if ((slot = CALLOC (size, sizeof (HASHENT))) == 0)
 	return -1;
+    h->old = h->slot;
+    h->oldsize = h->size;
+    h->migrate = 0;
+    h->slot = slot;
+    h->size = size;
+    h->tombs = 0;
+    return 0;
+}
+
+int
+hash_add (HASH * table, const char *key, void *data)
+{
     ASSERT (key != 0);
     ASSERT (data != 0);
     ASSERT (table != 0);
-    he->key = key;
-    he->data = data;
-    sum = hash_string (table, key);
-    he->next = table->bucket[sum];
-    table->bucket[sum] = he;
+    /* hash_foreach() callbacks may remove entries but not add them */
+    ASSERT (table->walking == 0);
+    if (table->old)
+	rehash_step (table, REHASH_STEP);
+    /* entries still in the old array count against the new one since they
+       will end up there */
+    if ((table->dbsize + table->tombs + 1) * 4 > table->size * 3 &&
+	hash_resize (table) &&
+	table->dbsize + table->tombs + 1 >= table->size)
+	return -1;
+    put_slot (table, hash_string (key), table->match ? Nokey : key, data);
     table->dbsize++;
     return 0;
 }
 
 void *
 hash_lookup (HASH * table, const char *key)
+{
+    if (!table)
+	return 0;
+    ASSERT (key != 0);
+    return hash_lookup_sum (table, key, hash_string (key));
+}
+
+/* like hash_lookup(), for callers which already have the hash code of
+   `key' from hash_string() */
+void *
+hash_lookup_sum (HASH * table, const char *key, hash_t sum)
 {
     HASHENT *he;
-    unsigned int sum;
 
     if (!table)
 	return 0;
     ASSERT (key != 0);
-    sum = hash_string (table, key);
-    he = table->bucket[sum];
-
-    for (; he; he = he->next)
-    {
-	if (strcasecmp (key, he->key) == 0)
-	    return he->data;
-    }
-    return 0;
+    he = find_slot (table, table->slot, table->size, sum, key);
+    if (!he && table->old)
+	he = find_slot (table, table->old, table->oldsize, sum, key);
+    return he ? he->data : 0;
 }
 
 int
 hash_remove (HASH * table, const char *key)
 {
-    HASHENT **he, *ptr;
-    unsigned int sum;
+    HASHENT *he;
+    hash_t sum;
+    void *data;
 
     ASSERT (table != 0);
     ASSERT (key != 0);
-    sum = hash_string (table, key);
-    for (he = &table->bucket[sum]; *he; he = &(*he)->next)
+    sum = hash_string (key);
+    if ((he = find_slot (table, table->slot, table->size, sum, key)))
+	table->tombs++;
+    else if (!table->old ||
+	     !(he = find_slot (table, table->old, table->oldsize, sum, key)))
+	return -1;
+    /* `key' usually points into the data, so unlink before destroying */
+    data = he->data;
+    he->key = Deleted;
+    table->dbsize--;
+    if (table->destroy)
+	table->destroy (data);
+
+    /* entries don't move while hash_foreach() is walking the table */
+    if (!table->walking)
     {
-	if (!strcasecmp (key, (*he)->key))
-	{
-	    ptr = (*he)->next;
-	    if (table->destroy)
-		table->destroy ((*he)->data);
-	    FREE (*he);
-	    table->dbsize--;
-	    *he = ptr;
-	    return 0;
-	}
+	if (table->old)
+	    rehash_step (table, REHASH_STEP);
+	else if (table->size > table->minsize &&
+		 table->dbsize < table->size / 8)
+	    hash_resize (table);
     }
-    return -1;
+    return 0;
 }
 
 void
 free_hash (HASH * h)
 {
-    HASHENT *he, *ptr;
     int i;
 
     ASSERT (h != 0);
     /* destroy remaining entries */
-    for (i = 0; i < h->numbuckets; i++)
+    if (h->old)
     {
-	he = h->bucket[i];
-	while (he)
-	{
-	    ptr = he;
-	    he = he->next;
-	    if (h->destroy)
-		h->destroy (ptr->data);
-	    FREE (ptr);
-	}
+	for (i = h->migrate; i < h->oldsize; i++)
+	    if (LIVE (&h->old[i]) && h->destroy)
+		h->destroy (h->old[i].data);
+	FREE (h->old);
     }
-    FREE (h->bucket);
+    for (i = 0; i < h->size; i++)
+	if (LIVE (&h->slot[i]) && h->destroy)
+	    h->destroy (h->slot[i].data);
+    FREE (h->slot);
     FREE (h);
 }
 
+/* returns the next entry at or after `pos', or 0 when the end of the table
+   is reached, in which case `pos' goes back to the start.  the table may be
+   changed in between calls.  if it has been resized, the walk continues from
+   the same relative position in the new array, so some entries may be
+   skipped or returned twice, as may entries still waiting to be moved from
+   the old array.  this is meant for background work which can afford to
+   miss an entry now and then */
+void *
+hash_next (HASH * h, HASHPOS * pos)
+{
+    HASHENT *he;
+
+    if (pos->size != h->size)
+    {
+	if (pos->size)
+	    pos->slot = (int) ((double) pos->slot * h->size / pos->size);
+	pos->size = h->size;
+    }
+    while (pos->slot < h->size)
+    {
+	he = &h->slot[pos->slot++];
+	if (LIVE (he))
+	    return he->data;
+    }
+    pos->slot = 0;
+    return 0;
+}
+
 void
 hash_foreach (HASH * h, void (*func) (void *, void *), void *funcdata)
 {
-    HASHENT *he, *ptr;
     int i;
 
-    for (i = 0; i < h->numbuckets; i++)
+    /* `func' is allowed to remove entries from the table.  removed slots
+       are only marked as deleted and nothing is moved until we are done, so
+       this doesn't cause problems iterating the rest of the table */
+    h->walking++;
+    if (h->old)
     {
-	he = h->bucket[i];
-	while (he)
-	{
-	    /* we use a temp pointer here so that we can remove this entry
-	       from the hash table inside of `func' and not cause problems
-	       iterating the rest of the bucket */
-	    ptr = he;
-	    he = he->next;
-	    func (ptr->data, funcdata);
-	}
+	for (i = h->migrate; i < h->oldsize; i++)
+	    if (LIVE (&h->old[i]))
+		func (h->old[i].data, funcdata);
     }
+    for (i = 0; i < h->size; i++)
+	if (LIVE (&h->slot[i]))
+	    func (h->slot[i].data, funcdata);
+    h->walking--;
 }
@@ -8,33 +8,64 @@
 #define hash_h
 
 #include <sys/types.h>
+#ifdef WIN32
+typedef unsigned __int64 hash_t;
+#else
+#include <stdint.h>
+typedef uint64_t hash_t;
+#endif /* WIN32 */
 
 typedef void (*hash_destroy) (void *);
 
+/* returns 0 if `key' is the key of the entry `data' */
+typedef int (*hash_match) (const char *key, void *data);
+
 typedef struct _hashent
 {
   const char *key;
   void *data;
-  struct _hashent *next;
+  hash_t sum; /* hash code of the lower case version of `key' */
 }
 HASHENT;
 
 typedef struct _hash
 {
-  HASHENT **bucket;
-  int numbuckets;
+  HASHENT *slot;
+  int size; /* # of slots, always a power of 2 */
+  int minsize; /* never shrink below this */
+  int tombs; /* # of slots in `slot' left by removed entries */
+  HASHENT *old; /* previous array while it is being rehashed */
+  int oldsize;
+  int migrate; /* next slot in `old' to move */
+  int walking; /* inside of hash_foreach() */
   int dbsize; /* # of elements in the table */
   hash_destroy destroy;
+  /* if set, the keys passed to hash_add() are not kept, and this is used
+     to compare keys with the data instead.  for tables whose keys can be
+     rebuilt from the data */
+  hash_match match;
 }
 HASH;
 
 typedef void (*hash_callback_t) (void *, void *);
 
+/* position in a table which is being walked a piece at a time, see
+   hash_next() */
+typedef struct _hashpos
+{
+  int slot; /* next slot to look at */
+  int size; /* size of the table when `slot' was set */
+}
+HASHPOS;
+
 HASH *hash_init (int, hash_destroy);
 int hash_add (HASH *, const char *, void *);
 void *hash_lookup (HASH *, const char *);
+hash_t hash_string (const char *);
+void *hash_lookup_sum (HASH *, const char *, hash_t);
 int hash_remove (HASH *, const char *);
 void free_hash (HASH *);
 void hash_foreach (HASH *h, hash_callback_t, void *funcdata);
+void *hash_next (HASH *, HASHPOS *);
 
 #endif /* hash_h */
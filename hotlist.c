@@ -67,7 +67,7 @@ HANDLER (add_hotlist)
 	return;
 
     /* add this user to the list of users waiting for notification */
-    list = MALLOC (sizeof (LIST));
+    list = POOL_ALLOC (&List_Pool);
     if (!list)
     {
 	OUTOFMEMORY ("add_hotlist");
@@ -78,7 +78,7 @@ HANDLER (add_hotlist)
     hotlist->users = list;
 
     /* add the hotlist entry to this particular users list */
-    list = MALLOC (sizeof (LIST));
+    list = POOL_ALLOC (&List_Pool);
     if (!list)
     {
 	OUTOFMEMORY ("add_hotlist");
@@ -154,6 +154,9 @@ init_server (const char *cf)
 
     load_bans ();
 
+    if (init_handlers ())
+	return -1;
+
 #if !defined(WIN32) && !defined(__EMX__)
     if (set_max_connections (Connection_Hard_Limit))
 	return -1;
@@ -235,6 +238,7 @@ init_server (const char *cf)
     init_random ();
     motd_init ();
     load_filter ();
+    simd_init ();
 
     return 0;
 }
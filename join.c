@@ -55,8 +55,9 @@ HANDLER (join)
     CHANNEL *chan;
     LIST *list;
     CHANUSER *chanUser, *cu;
-    int chanop = 0;
+    int chanop = 0, l;
     char chanbuf[256];		/* needed when creating a rollover channel */
+    BLOCK *block;
 
     (void) tag;
     (void) len;
@@ -259,7 +260,7 @@ HANDLER (join)
     }
 
     /* add this channel to the list of this user is subscribed to */
-    list = MALLOC (sizeof (LIST));
+    list = POOL_ALLOC (&List_Pool);
     if (!list)
     {
 	OUTOFMEMORY ("join");
@@ -270,13 +271,18 @@ HANDLER (join)
     user->channels = list;
 
     /* add this user to the channel members list */
-    chanUser = CALLOC (1, sizeof (CHANUSER));
+    chanUser = POOL_ALLOC (&Chanuser_Pool);
+    if (!chanUser)
+    {
+	OUTOFMEMORY ("join");
+	goto error;
+    }
 #if DEBUG
     chanUser->magic = MAGIC_CHANUSER;
 #endif
     chanUser->user = user;
 
-    list = MALLOC (sizeof (LIST));
+    list = POOL_ALLOC (&List_Pool);
     if (!list)
     {
 	OUTOFMEMORY ("join");
@@ -309,16 +315,20 @@ HANDLER (join)
     }
 
     /* notify members of the channel that this user has joined */
-    for (list = chan->users; list; list = list->next)
+    l = form_message (Buf, sizeof (Buf), MSG_SERVER_JOIN, "%s %s %d %d",
+		      chan->name, user->nick, user->shared, user->speed);
+    block = block_new (Buf, l);
+    for (list = chan->users; block && list; list = list->next)
     {
 	cu = list->data;
 	ASSERT (cu != 0);
 	ASSERT (cu->magic == MAGIC_CHANUSER);
 	if (ISUSER (cu->user->con) && cu->user != user &&
 	    (!user->cloaked || cu->user->level >= LEVEL_MODERATOR))
-	    send_cmd (cu->user->con, MSG_SERVER_JOIN, "%s %s %d %d",
-		      chan->name, user->nick, user->shared, user->speed);
+	    queue_block (cu->user->con, block);
     }
+    if (block)
+	block_free (block);
 
     /* notify ops/mods+ of this users status */
     if (chanop)
@@ -16,6 +16,8 @@ notify_mods (unsigned int level, const char *fmt, ...)
 {
     int i, len;
     va_list ap;
+    BLOCK *block;
+    CONNECTION *con;
 
     va_start (ap, fmt);
     vsnprintf (Buf + 4, sizeof (Buf) - 4, fmt, ap);
@@ -23,13 +25,16 @@ notify_mods (unsigned int level, const char *fmt, ...)
     set_tag (Buf, MSG_SERVER_NOSUCH);
     len = strlen (Buf + 4);
     set_len (Buf, len);
-    for (i = 0; i < Max_Clients; i++)
+    if (!(block = block_new (Buf, len + 4)))
+	return;
+    for (i = 0; i < Local_Users.count; i++)
     {
-	if (Clients[i] && ISUSER (Clients[i]) &&
-	    Clients[i]->user->level >= LEVEL_MODERATOR &&
-	    (Clients[i]->uopt->usermode & level))
-	    queue_data (Clients[i], Buf, len + 4);
+	con = Local_Users.con[i];
+	if (con->user->level >= LEVEL_MODERATOR &&
+	    (con->uopt->usermode & level))
+	    queue_block (con, block);
     }
+    block_free (block);
 }
 
 /* request to kill (disconnect) a user */
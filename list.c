@@ -11,7 +11,7 @@
 LIST *
 list_new (void *p)
 {
-    LIST *list = CALLOC (1, sizeof (LIST));
+    LIST *list = POOL_ALLOC (&List_Pool);
 
     if (list)
 	list->data = p;
@@ -33,7 +33,7 @@ list_delete (LIST * list, void *data)
 	{
 	    tmp = *ptr;
 	    *ptr = (*ptr)->next;
-	    FREE (tmp);
+	    POOL_FREE (&List_Pool, tmp);
 	    break;
 	}
     }
@@ -76,7 +76,7 @@ list_free (LIST * l, list_destroy_t cb)
 	l = l->next;
 	if (cb)
 	    cb (t->data);
-	FREE (t);
+	POOL_FREE (&List_Pool, t);
     }
 }
 
@@ -7,6 +7,8 @@
 #ifndef list_h
 #define list_h
 
+#include "pool.h"
+
 typedef struct list LIST;
 
 struct list {
@@ -39,7 +41,7 @@ LIST *list_find (LIST *, void *);
 int list_validate (LIST *);
 
 #if DEBUG
-#define LIST_NEW(p,d) { p = CALLOC (1, sizeof (LIST)); if (p) (p)->data = d; }
+#define LIST_NEW(p,d) { p = POOL_ALLOC (&List_Pool); if (p) (p)->data = d; }
 #else
 #define LIST_NEW(p,d) p = list_new (d)
 #endif /* DEBUG */
@@ -86,25 +86,6 @@ zap_local_user (CONNECTION * con, const char *reason)
     con->destroy = 1;
 }
 
-static int
-count_clones (unsigned int ip)
-{
-    int clones = 0;
-    int j = 0;
-
-    for (j = 0; j < Max_Clients; j++)
-    {
-	if (Clients[j] && (ISUSER (Clients[j]) || ISUNKNOWN (Clients[j])) &&
-	    Clients[j]->ip == ip)
-	{
-	    clones++;
-	    if (clones >= Max_Clones)
-		break;		/* no need to count any more */
-	}
-    }
-    return clones;
-}
-
 /* if the server is full, try to find the client connected to the server
  * the longest that isn't sharing any files.  expell that client to make
  * room for other (possibly sharing) clients.
@@ -112,27 +93,21 @@ count_clones (unsigned int ip)
 static int
 eject_client (CONNECTION * con)
 {
-    int i, loser = -1;
-    time_t when = Current_Time;
+    CONNECTION *loser = eject_candidate ();
 
-    for (i = 0; i < Max_Clients; i++)
-    {
-	if (Clients[i] && ISUSER (Clients[i]) && Clients[i] != con &&
-	    Clients[i]->user->sharing == 0 &&
-	    Clients[i]->user->connected < when)
-	{
-	    loser = i;
-	    when = Clients[i]->user->connected;
-	}
-    }
-    if (loser == -1)
+    (void) con;
+    /* `con' is still logging in, so it can't be a candidate */
+    if (!loser || loser->user->connected >= Current_Time)
 	return 0;		/* no client to eject, reject current login */
-    kill_client (Clients[loser]->user->nick, "server full, not sharing");
-    send_cmd (Clients[loser], MSG_SERVER_NOSUCH,
+    ASSERT (loser != con);
+    /* don't pick it again before it is reaped */
+    eject_remove (loser);
+    kill_client (loser->user->nick, "server full, not sharing");
+    send_cmd (loser, MSG_SERVER_NOSUCH,
 	      "server is full and you are not sharing");
-    send_cmd (Clients[loser], MSG_SERVER_DISCONNECTING, "0");
-    Clients[loser]->killed = 1;
-    Clients[loser]->destroy = 1;
+    send_cmd (loser, MSG_SERVER_DISCONNECTING, "0");
+    loser->killed = 1;
+    loser->destroy = 1;
     return 1;			/* ok for current login to proceed despite being full */
 }
 
@@ -151,7 +126,7 @@ find_server (char *s)
 	    return list->data;
     }
     /* not found yet, allocate */
-    list = CALLOC (1, sizeof (LIST));
+    list = POOL_ALLOC (&List_Pool);
     list->data = STRDUP (s);
     list->next = Server_Names;
     Server_Names = list;
@@ -540,15 +515,21 @@ HANDLER (login)
 	user->local = 1;
 	user->conport = con->port;
 	user->server = Server_Name;	/* NOTE: this is not malloc'd */
+	if (conlist_add (&Local_Users, con))
+	    goto failed;
 	con->uopt = CALLOC (1, sizeof (USEROPT));
 	if (!con->uopt)
 	{
 	    OUTOFMEMORY ("login");
+	    conlist_remove (&Local_Users, con);
 	    goto failed;
 	}
 	con->uopt->usermode = LOGALL_MODE;
 	con->user = user;
 	con->class = CLASS_USER;
+	eject_add (con);	/* not sharing anything yet */
+	cancel_timer (con->timer);	/* login timeout */
+	con->timer = 0;
 	/* send the login ack */
 #if EMAIL
 	if (db)
@@ -51,8 +51,12 @@ int Max_Browse_Result;
 unsigned int Interface = INADDR_ANY;
 time_t Server_Start;		/* time at which the server was started */
 int Collect_Interval;
+int Collect_Step;		/* garbage collection work per main loop pass */
+int Index_Step;			/* files indexed per main loop pass */
 unsigned int Bytes_In = 0;
 unsigned int Bytes_Out = 0;
+unsigned int Bytes_Queued = 0;	/* output queued, see run_command() */
+unsigned int Write_Calls = 0;	/* system calls used to send Bytes_Out */
 int User_Db_Interval;		/* how often to save the user database */
 int Channel_Limit;
 int Login_Timeout;
@@ -64,7 +68,11 @@ int Max_Topic;
 int Max_Client_String;
 int Max_Reason;
 int Max_Clones;
+int Connect_Limit;
+int Connect_Interval;
 int Search_Timeout;
+int Search_Threads;		/* number of threads to run searches in */
+int Slow_Command;		/* ms, log commands which take longer */
 unsigned int Total_Bytes_In = 0;	/* bytes received */
 unsigned int Total_Bytes_Out = 0;	/* bytes sent */
 
@@ -87,6 +95,8 @@ LIST *Bans = 0;
 CONNECTION **Clients = NULL;
 int Num_Clients = 0;
 int Max_Clients = 0;
+CONLIST Live_Clients = { 0, 0, 0, 0 };
+CONLIST Local_Users = { 0, 0, 0, 1 };
 
 HASH *Users;			/* global users list */
 HASH *File_Table;		/* global file list */
@@ -109,6 +119,8 @@ LIST *Server_Names = 0;
 
 int Local_Files = 0;		/* number of files shared by local users */
 int Num_Files = 0;
+unsigned int File_Postings = 0;
+unsigned int Dead_Postings = 0;
 double Num_Gigs = 0;		/* in kB */
 int SigCaught = 0;
 char Buf[2048];			/* global scratch buffer */
@@ -121,6 +133,7 @@ static void
 update_stats (void)
 {
     int i, l;
+    BLOCK *block;
     int numServers = list_count (Servers);
     time_t delta;
 
@@ -133,7 +146,8 @@ update_stats (void)
 	 Num_Gigs / 1048576., Num_Files, Users->dbsize);
     log ("update_stats(): %d local clients, %d linked servers",
 	 Num_Clients - numServers, numServers);
-    log ("update_stats(): %d local files", Local_Files);
+    log ("update_stats(): %d local files, %d waiting to be indexed",
+	 Local_Files, fdb_backlog ());
     log ("update_stats(): File_Table contains %d entries",
 	 File_Table->dbsize);
     log ("update_stats(): %.0f searches/sec",
@@ -142,6 +156,11 @@ update_stats (void)
     log ("update_stats(): %d channels", Channels->dbsize);
     log ("update_stats(): %.2f kbytes/sec in, %.2f kbytes/sec out",
 	 (float) Bytes_In / 1024. / delta, (float) Bytes_Out / 1024. / delta);
+    log ("update_stats(): %u write calls, %.0f bytes per call", Write_Calls,
+	 Write_Calls ? (float) Bytes_Out / Write_Calls : 0.);
+    pool_stats ();
+    fdb_collect_stats ();
+    cmdstats_log ();
     Total_Bytes_In += Bytes_In;
     Total_Bytes_Out += Bytes_Out;
     log ("update_stats(): %u bytes sent, %u bytes received",
@@ -150,6 +169,7 @@ update_stats (void)
     /* reset counters */
     Bytes_In = 0;
     Bytes_Out = 0;
+    Write_Calls = 0;
     Search_Count = 0;
     Last_Click = Current_Time;
 
@@ -161,11 +181,11 @@ update_stats (void)
     l = strlen (Buf + 4);
     set_len (Buf, l);
     l += 4;
-    for (i = 0; i < Max_Clients; i++)
-    {
-	if (Clients[i] && ISUSER (Clients[i]))
-	    queue_data (Clients[i], Buf, l);
-    }
+    if (!(block = block_new (Buf, l)))
+	return;
+    for (i = 0; i < Local_Users.count; i++)
+	queue_block (Local_Users.con[i], block);
+    block_free (block);
 }
 
 #if HAVE_LIBWRAP
@@ -182,6 +202,7 @@ accept_connection (int s)
     socklen_t sinsize;
     struct sockaddr_in sin;
     int f;
+    unsigned int ip;
 
     for (;;)
     {
@@ -192,6 +213,18 @@ accept_connection (int s)
 		nlogerr ("accept_connection", "accept");
 	    return;
 	}
+	/* if we have a local connection, use the external
+	   interface so others can download from them */
+	if (sin.sin_addr.s_addr == inet_addr ("127.0.0.1"))
+	    ip = Server_Ip;
+	else
+	    ip = BSWAP32 (sin.sin_addr.s_addr);
+	/* turn away connection floods before doing any work for them */
+	if (check_connect_rate (ip))
+	{
+	    CLOSE (f);
+	    continue;
+	}
 #if HAVE_LIBWRAP
 	if (!hosts_ctl (PACKAGE, STRING_UNKNOWN, inet_ntoa (sin.sin_addr),
 			STRING_UNKNOWN))
@@ -208,13 +241,11 @@ accept_connection (int s)
 	    return;
 	}
 	cli->fd = f;
-	/* if we have a local connection, use the external
-	   interface so others can download from them */
+	cli->ip = ip;
 	if (sin.sin_addr.s_addr == inet_addr ("127.0.0.1"))
 	{
 	    log
 		("accept_connection(): connected via loopback, using external ip");
-	    cli->ip = Server_Ip;
 	    cli->host = STRDUP (Server_Name);
 	    if (!cli->host)
 	    {
@@ -224,7 +255,6 @@ accept_connection (int s)
 	}
 	else
 	{
-	    cli->ip = BSWAP32(sin.sin_addr.s_addr);
 	    cli->host = STRDUP (inet_ntoa (sin.sin_addr));
 	    if (!cli->host)
 	    {
@@ -234,7 +264,6 @@ accept_connection (int s)
 	}
 	cli->port = ntohs (sin.sin_port);
 	cli->class = CLASS_UNKNOWN;
-	cli->timer = Current_Time;	/* set a login timer */
 	if (add_client (cli))
 	    return;
 	set_nonblocking (f);
@@ -250,44 +279,6 @@ accept_connection (int s)
     FREE (cli);
 }
 
-static void
-report_stats (int fd)
-{
-    int n;
-    struct sockaddr_in sin;
-    socklen_t sinsize = sizeof (sin);
-    float loadavg = 0;
-
-    n = accept (fd, (struct sockaddr *) &sin, &sinsize);
-    if (n == -1)
-    {
-	logerr ("report_stats", "accept");
-	return;
-    }
-    log ("report_stats(): connection from %s:%d", inet_ntoa (sin.sin_addr),
-	 htons (sin.sin_port));
-#ifdef linux
-    {
-	FILE *f = fopen ("/proc/loadavg", "r");
-
-	if (f)
-	{
-	    fscanf (f, "%f", &loadavg);
-	    fclose (f);
-	}
-	else
-	{
-	    log ("report_stats(): /proc/loadavg: %s (errno %d)",
-		 strerror (errno), errno);
-	}
-    }
-#endif /* linux */
-    snprintf (Buf, sizeof (Buf), "%d %d %.2f %.0f 0\n", Users->dbsize,
-	      Num_Files, loadavg, Num_Gigs * 1024.);
-    WRITE (n, Buf, strlen (Buf));
-    CLOSE (n);
-}
-
 static void
 usage (void)
 {
@@ -345,7 +336,7 @@ args (int argc, char **argv, int *sockfdcount)
 	    iface = inet_addr (optarg);
 	    break;
 	case 'p':
-	    tmpList = CALLOC (1, sizeof (LIST));
+	    tmpList = POOL_ALLOC (&List_Pool);
 	    tmpList->data = STRDUP (optarg);
 	    tmpList->next = ports;
 	    ports = tmpList;
@@ -446,10 +437,12 @@ main (int argc, char **argv)
     int *sockfd;		/* server sockets */
     int sockfdcount;		/* number of server sockets */
     int sp = -1;		/* stats port */
+    int jobfd;			/* signals finished searches */
     int i;			/* generic counter */
-    int maxfd;
-    fd_set set, wset;
-    struct timeval t;
+    int timeout;
+    int collecting = 0;		/* garbage collection in progress */
+    int indexing = 0;		/* files waiting to be indexed */
+    CONNECTION *con;
 
 #ifdef WIN32
     WSADATA wsa;
@@ -464,7 +457,7 @@ main (int argc, char **argv)
     if ((Server_Flags & ON_NO_LISTEN) == 0 && Stats_Port != -1)
     {
 	/* listen on port 8889 for stats reporting */
-	if ((sp = new_tcp_socket (ON_REUSEADDR)) == -1)
+	if ((sp = new_tcp_socket (ON_NONBLOCKING | ON_REUSEADDR)) == -1)
 	    exit (1);
 	if (bind_interface (sp, Interface, Stats_Port))
 	    exit (1);
@@ -489,124 +482,100 @@ main (int argc, char **argv)
        update_stats() */
     Last_Click = Current_Time;
 
+    if (event_init ())
+	exit (1);
+    for (i = 0; i < sockfdcount; i++)
+	event_listen (sockfd[i]);
+    if (sp != -1)
+	event_listen (sp);
+    if ((jobfd = workers_init ()) != -1)
+	event_listen (jobfd);
+
     /* main event loop */
     while (!SigCaught)
     {
-	Current_Time = time (0);
+	timeout = next_timer ();
+	/* don't sleep while there is indexing or garbage collection left
+	   to do */
+	if (indexing || collecting)
+	    timeout = 0;
+	if (event_wait (timeout) < 0)
+	    continue;
 
-	FD_ZERO (&set);
-	FD_ZERO (&wset);
-	maxfd = -1;
-	for (i = 0; i < sockfdcount; i++)
-	{
-	    FD_SET (sockfd[i], &set);
-	    if (sockfd[i] > maxfd)
-		maxfd = sockfd[i];
-	}
-	if ((Server_Flags & ON_NO_LISTEN) == 0)
-	{
-	    FD_SET (sp, &set);
-	    if (sp > maxfd)
-		maxfd = sp;
-	}
+	Current_Time = time (0);
 
-	for (i = 0; i < Max_Clients; i++)
+	/* process incoming requests */
+	for (i = 0; !SigCaught && i < Num_Ready; i++)
 	{
-	    if (Clients[i])
+	    con = Ready[i];
+	    if (con->readable && !con->destroy)
 	    {
-		/* only check the socket if the client is not flooding.
+		/* only read from the socket if the client is not flooding.
 		 * this effectively throttles flooding clients
 		 */
-		if(Flood_Commands == 0 || !ISUSER(Clients[i]) ||
-			Clients[i]->flood < Current_Time + Flood_Time)
-		{
-		    FD_SET (Clients[i]->fd, &set);
-		}
-		/* check sockets for writing */
-#define CheckWrite(p) (p->sendbuf || (ISSERVER(p) && p->sopt->outbuf))
-		if (Clients[i]->connecting || CheckWrite (Clients[i]))
-		    FD_SET (Clients[i]->fd, &wset);
-		if (Clients[i]->fd > maxfd)
-		    maxfd = Clients[i]->fd;
-	    }
-	}
-
-	t.tv_sec = next_timer ();
-	/* if flood control is on, make sure we don't wait longer than the
-	 * flood control interval
-	 */
-	if(Flood_Commands > 0 && t.tv_sec > Flood_Time)
-	{
-	    ASSERT(Flood_Time!=0);
-	    t.tv_sec = Flood_Time;
-	}
-	t.tv_usec = 0;
-	if (select (maxfd + 1, &set, &wset, NULL, &t) < 0)
-	{
-	    logerr ("main", "select");
-	    continue;
-	}
-
-	/* process incoming requests */
-	for (i = 0; !SigCaught && i < Max_Clients; i++)
-	{
-	    if (Clients[i])
-	    {
-		if (!Clients[i]->destroy && FD_ISSET (Clients[i]->fd, &set))
-		    handle_connection (Clients[i]);
+		if (FLOODING (con))
+		    event_throttle (con);
+		else
+		    handle_connection (con);
 	    }
 	}
 
 	if (SigCaught)
 	    break;
 
-	/* write out data and reap dead client connections */
-	for (i = 0; !SigCaught && i < Max_Clients; i++)
+	/* deliver the results of searches done by the search threads */
+	if (jobfd != -1 && event_pending (jobfd))
+	    job_reap ();
+
+	/* write out data and reap dead client connections.  note that
+	   Num_Ready may grow while we are in this loop since removing a
+	   connection can generate messages for other clients */
+	for (i = 0; !SigCaught && i < Num_Ready; i++)
 	{
-	    if (Clients[i])
+	    con = Ready[i];
+	    if (!con)
+		continue;
+	    if (con->writable &&
+		(con->connecting || con->sendq.head ||
+		 (ISSERVER (con) && con->sopt->outq.head)))
+	    {
+		/* check for return from nonblocking connect() call */
+		if (con->connecting)
+		    complete_connect (con);
+		else if (send_queued_data (con) == -1)
+		    con->destroy = 1;
+	    }
+	    if (con->destroy)
 	    {
-		if (FD_ISSET (Clients[i]->fd, &wset))
-		{
-		    /* check for return from nonblocking connect() call */
-		    if (Clients[i]->connecting)
-			complete_connect (Clients[i]);
-		    else if (send_queued_data (Clients[i]) == -1)
-			Clients[i]->destroy = 1;
-		}
-		/* kill idle conenctions */
-		else if (Clients[i]->class == CLASS_UNKNOWN &&
-			 Current_Time - Clients[i]->timer >= Login_Timeout)
-		{
-		    log ("main(): login timeout for %s", Clients[i]->host);
-		    if (Clients[i]->server_login)
-			notify_mods (SERVERLOG_MODE,
-				     "Server link to %s timed out",
-				     Clients[i]->host);
-		    Clients[i]->destroy = 1;
-		}
-		if (Clients[i]->destroy)
-		{
-		    send_queued_data (Clients[i]);	/* flush */
-		    remove_connection (Clients[i]);
-		}
+		send_queued_data (con);	/* flush */
+		remove_connection (con);
+		Ready[i] = 0;
 	    }
 	}
 
-	if (sp != -1 && FD_ISSET (sp, &set))
+	/* keep connections which still have work to do for the next pass */
+	event_reset ();
+
+	if (sp != -1 && event_pending (sp))
 	    report_stats (sp);
 
 	/* check for new incoming connections. handle this last so that
-	   we don't screw up the loops above.  this is crucial when using
-	   poll() because Max_Clients could increase to something greater
-	   than ufdsize-2 causing us to read off the end of the array */
+	   we don't screw up the loops above */
 	for (i = 0; i < sockfdcount; i++)
 	{
-	    if (FD_ISSET (sockfd[i], &set))
+	    if (event_pending (sockfd[i]))
 		accept_connection (sockfd[i]);
 	}
 
 	/* execute any pending events now */
-	exec_timers (Current_Time);
+	exec_timers ();
+
+	/* do a little of the garbage collection at a time so that we don't
+	   stop responding to clients while it runs */
+	collecting = fdb_collect_step ();
+
+	/* index some of the files shared since the last pass */
+	indexing = fdb_index_step ();
     }
 
     log ("main(): shutting down");
@@ -620,9 +589,8 @@ main (int argc, char **argv)
     dump_state ();		/* save to disk */
 
     /* close all client connections */
-    for (i = 0; i < Max_Clients; i++)
-	if (Clients[i])
-	    remove_connection (Clients[i]);
+    while (Live_Clients.count > 0)
+	remove_connection (Live_Clients.con[Live_Clients.count - 1]);
 
     /* only clean up memory if we are in debug mode, its kind of pointless
        otherwise */
@@ -633,20 +601,37 @@ main (int argc, char **argv)
 	FREE (sockfd);
 
     /* clean up */
-    if (Clients)
-	FREE (Clients);
+    free_clients ();
+    free_spare_input ();
 
-    if (Servers)
-	FREE (Servers);
+    event_close ();
+
+    /* stop the search threads before freeing the lists they use */
+    workers_close ();
+
+    list_free (Servers, 0);
 
     free_hash (File_Table);
 #if RESUME
     free_hash (MD5);
 #endif /* RESUME */
+    if (Live_Ids)
+	FREE (Live_Ids);
+    if (Datums)
+    {
+	for (i = 0; i < Datums->npages; i++)
+	    if (Datums->pages[i])
+		FREE (Datums->pages[i]);
+	FREE (Datums);
+    }
+    fdb_index_free ();
     free_hash (Users);
     free_hash (Channels);
     free_hash (Hotlist);
     free_hash (User_Db);
+    free_clones ();
+    free_cmdstats ();
+    free_stats_clients ();
     free_timers ();
 
     hash_destroy (Filter);
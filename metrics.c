@@ -0,0 +1,397 @@
+/* Copyright (C) 2000 drscholl@users.sourceforge.net
+   This is free software distributed under the terms of the
+   GNU Public License.  See the file COPYING for details.
+
+   $Id$ */
+
+/* the stats port.  collectors such as napigator connect and are sent a
+   single line with the size of the server.  if `stats_metrics' is set, a
+   client which sends an http GET request instead is sent the state of the
+   server in the Prometheus text format.  the sockets are nonblocking and
+   are serviced from a timer, so a slow or stuck collector can't hold up
+   the main loop */
+
+#ifdef WIN32
+#include <windows.h>
+#include <winsock.h>
+#endif /* WIN32 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif /* !WIN32 */
+#include "opennap.h"
+#include "pool.h"
+#include "debug.h"
+
+#define MAX_STATS_CLIENTS 8
+#define STATS_POLL 20		/* ms between attempts to read or write */
+#define STATS_WAIT 500		/* ms to wait for a request before sending
+				   the one line reply */
+#define STATS_TIMEOUT 10	/* seconds to give a client to go away */
+
+struct _metrics
+{
+    char *data;
+    int len;
+    int max;
+};
+
+typedef struct
+{
+    int fd;
+    time_t start;
+    int polls;			/* times stats_poll() has been called */
+    char req[256];		/* start of the request */
+    int reqlen;
+    METRICS out;		/* the reply */
+    int sent;			/* bytes of `out' written so far */
+    TIMER *timer;
+}
+STATS_CLIENT;
+
+static STATS_CLIENT *Stats_Clients[MAX_STATS_CLIENTS];
+
+/* append to the reply, growing it as needed */
+void
+metrics_printf (METRICS * m, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for (;;)
+    {
+	if (m->max > m->len)
+	{
+	    va_start (ap, fmt);
+	    n = vsnprintf (m->data + m->len, m->max - m->len, fmt, ap);
+	    va_end (ap);
+	    /* older libraries return -1 if the output was truncated */
+	    if (n >= 0 && n < m->max - m->len)
+	    {
+		m->len += n;
+		return;
+	    }
+	}
+	if (safe_realloc ((void **) &m->data, m->max ? m->max * 2 : 4096))
+	{
+	    OUTOFMEMORY ("metrics_printf");
+	    return;
+	}
+	m->max = m->max ? m->max * 2 : 4096;
+    }
+}
+
+static void
+gauge (METRICS * m, const char *name, const char *help, double val)
+{
+    metrics_printf (m, "# HELP %s %s\n# TYPE %s gauge\n%s %.0f\n", name,
+		    help, name, name, val);
+}
+
+/* users, files, load average, size in MB, and a 0 for napigator */
+static void
+stats_line (METRICS * m)
+{
+    float loadavg = 0;
+
+#ifdef linux
+    FILE *f = fopen ("/proc/loadavg", "r");
+
+    if (f)
+    {
+	fscanf (f, "%f", &loadavg);
+	fclose (f);
+    }
+    else
+    {
+	log ("stats_line(): /proc/loadavg: %s (errno %d)",
+	     strerror (errno), errno);
+    }
+#endif /* linux */
+    metrics_printf (m, "%d %d %.2f %.0f 0\n", Users->dbsize, Num_Files,
+		    loadavg, Num_Gigs * 1024.);
+}
+
+static void
+link_metrics (METRICS * m)
+{
+    CONNECTION *con;
+    z_streamp z;
+    int i, dir;
+
+    metrics_printf (m, "# HELP opennap_link_bytes_total Data sent to and "
+		    "received from peer servers, before and after "
+		    "compression.\n"
+		    "# TYPE opennap_link_bytes_total counter\n");
+    for (i = 0; i < Live_Clients.count; i++)
+    {
+	con = Live_Clients.con[i];
+	if (!ISSERVER (con) || !con->sopt->zin || !con->sopt->zout)
+	    continue;
+	metrics_printf (m, "opennap_link_bytes_total{server=\"%s\","
+			"direction=\"in\",stream=\"compressed\"} %lu\n"
+			"opennap_link_bytes_total{server=\"%s\","
+			"direction=\"in\",stream=\"raw\"} %lu\n"
+			"opennap_link_bytes_total{server=\"%s\","
+			"direction=\"out\",stream=\"raw\"} %lu\n"
+			"opennap_link_bytes_total{server=\"%s\","
+			"direction=\"out\",stream=\"compressed\"} %lu\n",
+			con->host, con->sopt->zin->total_in,
+			con->host, con->sopt->zin->total_out,
+			con->host, con->sopt->zout->total_in,
+			con->host, con->sopt->zout->total_out);
+    }
+    metrics_printf (m, "# HELP opennap_link_compression_ratio Raw bytes "
+		    "per compressed byte on each server link.\n"
+		    "# TYPE opennap_link_compression_ratio gauge\n");
+    for (i = 0; i < Live_Clients.count; i++)
+    {
+	con = Live_Clients.con[i];
+	if (!ISSERVER (con) || !con->sopt->zin || !con->sopt->zout)
+	    continue;
+	for (dir = 0; dir < 2; dir++)
+	{
+	    z = dir ? con->sopt->zout : con->sopt->zin;
+	    if (dir ? z->total_out : z->total_in)
+		metrics_printf (m, "opennap_link_compression_ratio"
+				"{server=\"%s\",direction=\"%s\"} %.3f\n",
+				con->host, dir ? "out" : "in",
+				dir ? (double) z->total_in / z->total_out :
+				(double) z->total_out / z->total_in);
+	}
+    }
+}
+
+static void
+pool_metrics (METRICS * m)
+{
+    POOL **pool;
+
+    metrics_printf (m, "# HELP opennap_pool_objects Objects in the "
+		    "allocator pools.\n"
+		    "# TYPE opennap_pool_objects gauge\n");
+    for (pool = Pools; *pool; pool++)
+	metrics_printf (m, "opennap_pool_objects{pool=\"%s\",state=\"used\"} "
+			"%d\nopennap_pool_objects{pool=\"%s\",state=\"free\"} "
+			"%d\n", (*pool)->name, (*pool)->used, (*pool)->name,
+			(*pool)->allocated - (*pool)->used);
+    metrics_printf (m, "# HELP opennap_pool_bytes Memory held by the "
+		    "allocator pools.\n"
+		    "# TYPE opennap_pool_bytes gauge\n");
+    for (pool = Pools; *pool; pool++)
+	metrics_printf (m, "opennap_pool_bytes{pool=\"%s\"} %u\n",
+			(*pool)->name, (*pool)->bytes);
+}
+
+static void
+build_metrics (METRICS * m)
+{
+    CONNECTION *con;
+    double queued = 0;
+    int i, bytes, largest = 0;
+
+    for (i = 0; i < Live_Clients.count; i++)
+    {
+	con = Live_Clients.con[i];
+	bytes = con->sendq.bytes;
+	if (ISSERVER (con))
+	    bytes += con->sopt->outq.bytes;
+	queued += bytes;
+	if (bytes > largest)
+	    largest = bytes;
+    }
+
+    gauge (m, "opennap_connections", "Local connections of every kind.",
+	   Live_Clients.count);
+    gauge (m, "opennap_local_users", "Locally connected users.",
+	   Local_Users.count);
+    gauge (m, "opennap_servers", "Linked peer servers.",
+	   list_count (Servers));
+    gauge (m, "opennap_users", "Users on the network.", Users->dbsize);
+    gauge (m, "opennap_files", "Files shared on the network.", Num_Files);
+    gauge (m, "opennap_shared_bytes", "Size of the files shared on the "
+	   "network.", Num_Gigs * 1024.);
+    gauge (m, "opennap_file_table_buckets", "Slots in the word index.",
+	   File_Table->size);
+    gauge (m, "opennap_file_table_words", "Words in the word index.",
+	   File_Table->dbsize);
+    gauge (m, "opennap_file_table_postings", "Entries in the word index.",
+	   File_Postings);
+    gauge (m, "opennap_file_table_tombstones", "Entries in the word index "
+	   "for removed files, waiting to be garbage collected.",
+	   Dead_Postings);
+    gauge (m, "opennap_index_backlog", "Files waiting to be indexed.",
+	   fdb_backlog ());
+    gauge (m, "opennap_output_queued_bytes", "Output waiting to be sent.",
+	   queued);
+    gauge (m, "opennap_output_queue_max_bytes", "Output waiting to be "
+	   "sent to the connection with the most.", largest);
+    metrics_printf (m, "# HELP opennap_output_bytes_total Output queued "
+		    "for clients.\n"
+		    "# TYPE opennap_output_bytes_total counter\n"
+		    "opennap_output_bytes_total %u\n", Bytes_Queued);
+    gauge (m, "opennap_remote_searches", "Searches waiting for replies "
+	   "from peer servers.", remote_search_count ());
+    cmdstats_metrics (m);
+    link_metrics (m);
+    pool_metrics (m);
+}
+
+/* nonzero once the whole request header has arrived, or as much of it as
+   we care to look at */
+static int
+request_done (STATS_CLIENT * sc)
+{
+    return sc->reqlen == sizeof (sc->req) - 1 ||
+	strstr (sc->req, "\n\r\n") || strstr (sc->req, "\n\n");
+}
+
+static void
+stats_reply (STATS_CLIENT * sc)
+{
+    char *path;
+    int len;
+
+    if (strncmp (sc->req, "GET ", 4))
+    {
+	stats_line (&sc->out);
+	return;
+    }
+    path = sc->req + 4;
+    len = strcspn (path, " \r\n");
+    if ((len == 1 && *path == '/') ||
+	(len == 8 && !strncmp (path, "/metrics", 8)))
+    {
+	metrics_printf (&sc->out, "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Connection: close\r\n\r\n");
+	build_metrics (&sc->out);
+    }
+    else
+	metrics_printf (&sc->out, "HTTP/1.0 404 Not Found\r\n"
+			"Content-Type: text/plain\r\n"
+			"Connection: close\r\n\r\nnot found\n");
+}
+
+/* do what can be done without blocking.  returns nonzero when the client
+   is finished with */
+static int
+stats_step (STATS_CLIENT * sc)
+{
+    int n;
+
+    if (!sc->out.len)
+    {
+	if (Server_Flags & ON_STATS_METRICS)
+	{
+	    n = READ (sc->fd, sc->req + sc->reqlen,
+		      sizeof (sc->req) - 1 - sc->reqlen);
+	    if (n == -1 && N_ERRNO != EWOULDBLOCK)
+		return 1;
+	    if (n > 0)
+	    {
+		sc->reqlen += n;
+		sc->req[sc->reqlen] = 0;
+	    }
+	    /* a client which sends nothing gets the one line reply */
+	    if (n != 0 && !request_done (sc) &&
+		sc->polls * STATS_POLL < STATS_WAIT)
+		return 0;
+	}
+	stats_reply (sc);
+	if (!sc->out.len)
+	    return 1;		/* out of memory */
+    }
+    while (sc->sent < sc->out.len)
+    {
+	n = WRITE (sc->fd, sc->out.data + sc->sent, sc->out.len - sc->sent);
+	if (n == -1)
+	    return N_ERRNO != EWOULDBLOCK;
+	sc->sent += n;
+    }
+    return 1;
+}
+
+static void
+stats_close (STATS_CLIENT * sc)
+{
+    int i;
+
+    for (i = 0; i < MAX_STATS_CLIENTS; i++)
+	if (Stats_Clients[i] == sc)
+	    Stats_Clients[i] = 0;
+    cancel_timer (sc->timer);
+    CLOSE (sc->fd);
+    if (sc->out.data)
+	FREE (sc->out.data);
+    FREE (sc);
+}
+
+static void
+stats_poll (STATS_CLIENT * sc)
+{
+    sc->timer = 0;
+    sc->polls++;
+    if (stats_step (sc) || Current_Time - sc->start >= STATS_TIMEOUT ||
+	!(sc->timer = add_timer_ms (STATS_POLL, 1, (timer_cb_t) stats_poll,
+				    sc)))
+	stats_close (sc);
+}
+
+/* called when there is a connection waiting on the stats port */
+void
+report_stats (int fd)
+{
+    int n, i;
+    struct sockaddr_in sin;
+    socklen_t sinsize = sizeof (sin);
+    STATS_CLIENT *sc;
+
+    n = accept (fd, (struct sockaddr *) &sin, &sinsize);
+    if (n == -1)
+    {
+	if (N_ERRNO != EWOULDBLOCK)
+	    nlogerr ("report_stats", "accept");
+	return;
+    }
+    log ("report_stats(): connection from %s:%d", inet_ntoa (sin.sin_addr),
+	 htons (sin.sin_port));
+    for (i = 0; i < MAX_STATS_CLIENTS && Stats_Clients[i]; i++)
+	;
+    if (i == MAX_STATS_CLIENTS)
+    {
+	log ("report_stats(): too many stats clients");
+	CLOSE (n);
+	return;
+    }
+    if (!(sc = CALLOC (1, sizeof (STATS_CLIENT))))
+    {
+	OUTOFMEMORY ("report_stats");
+	CLOSE (n);
+	return;
+    }
+    set_nonblocking (n);
+    sc->fd = n;
+    sc->start = Current_Time;
+    Stats_Clients[i] = sc;
+    stats_poll (sc);
+}
+
+#if DEBUG
+void
+free_stats_clients (void)
+{
+    int i;
+
+    for (i = 0; i < MAX_STATS_CLIENTS; i++)
+	if (Stats_Clients[i])
+	    stats_close (Stats_Clients[i]);
+}
+#endif /* DEBUG */
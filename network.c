@@ -260,14 +260,14 @@ set_limit (int attr, int value)
     lim.rlim_cur = value;
     if (lim.rlim_max > 0 && lim.rlim_cur > lim.rlim_max)
 	lim.rlim_max = lim.rlim_cur;	/* adjust max value */
-#ifndef HAVE_POLL
+#if !defined(HAVE_POLL) && !HAVE_EPOLL
     if (attr == RLIMIT_FD_MAX && lim.rlim_cur > FD_SETSIZE)
     {
 	log
 	    ("set_limit(): warning: compiled limit (%d) is smaller than hard limit (%d)",
 	     FD_SETSIZE, lim.rlim_max);
     }
-#endif /* HAVE_POLL */
+#endif /* !HAVE_POLL && !HAVE_EPOLL */
     if (setrlimit (attr, &lim))
     {
 	logerr ("set_limit", "setrlimit");
@@ -120,6 +120,14 @@ SOURCE=.\client_quit.c
 # End Source File
 # Begin Source File
 
+SOURCE=.\clones.c
+# End Source File
+# Begin Source File
+
+SOURCE=.\cmdstats.c
+# End Source File
+# Begin Source File
+
 SOURCE=.\config.c
 # End Source File
 # Begin Source File
@@ -132,6 +140,10 @@ SOURCE=.\download.c
 # End Source File
 # Begin Source File
 
+SOURCE=.\event.c
+# End Source File
+# Begin Source File
+
 SOURCE=.\filter.c
 # End Source File
 # Begin Source File
@@ -204,6 +216,10 @@ SOURCE=.\md5.c
 # End Source File
 # Begin Source File
 
+SOURCE=.\metrics.c
+# End Source File
+# Begin Source File
+
 SOURCE=.\motd.c
 # End Source File
 # Begin Source File
@@ -228,6 +244,10 @@ SOURCE=.\ping.c
 # End Source File
 # Begin Source File
 
+SOURCE=.\pool.c
+# End Source File
+# Begin Source File
+
 SOURCE=.\privmsg.c
 # End Source File
 # Begin Source File
@@ -276,6 +296,10 @@ SOURCE=.\serverlib.c
 # End Source File
 # Begin Source File
 
+SOURCE=.\simd.c
+# End Source File
+# Begin Source File
+
 SOURCE=.\synch.c
 # End Source File
 # Begin Source File
@@ -306,6 +330,10 @@ SOURCE=.\util.c
 
 SOURCE=.\whois.c
 # End Source File
+# Begin Source File
+
+SOURCE=.\workers.c
+# End Source File
 # End Group
 # Begin Group "Header Files"
 
@@ -328,6 +356,10 @@ SOURCE=.\opennap.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\pool.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\textdb.h
 # End Source File
 # End Group
@@ -29,6 +29,7 @@
 #define MAGIC_HOTLIST 0xb0f8ad23
 #define MAGIC_CONNECTION 0x3c4474a3
 #define MAGIC_BUFFER 0xe5a7a3be
+#define MAGIC_BLOCK 0x5d3b91c7
 #define MAGIC_CHANUSER 0x728dc736
 #define MAGIC_OPS 0xa28e453f
 
@@ -50,6 +51,9 @@
 typedef unsigned char uchar;
 
 typedef struct _buffer BUFFER;
+typedef struct _cmdstat CMDSTAT;
+typedef struct _metrics METRICS;
+typedef struct _block BLOCK;
 
 /* to avoid copying a lot of data around with memmove() we use the following
    structure for output buffers */
@@ -63,8 +67,33 @@ struct _buffer
     int datamax;		/* size of allocated memory block */
     int consumed;		/* how many bytes of data consumed from this buffer */
     BUFFER *next;
+    BLOCK *block;		/* if set, `data' belongs to this shared block */
 };
 
+/* a message which is sent to many connections at once (channel messages,
+   broadcasts).  it is formed one time and each connection's output queue
+   points at it instead of having its own copy.  see queue_block() */
+struct _block
+{
+#if DEBUG
+    unsigned int magic;
+#endif
+    int refcount;
+    int len;
+    char data[1];		/* really `len' bytes */
+};
+
+/* a chain of output buffers.  we keep track of the last buffer and the
+   number of bytes waiting to be sent so that adding to the queue and
+   checking its length don't need to walk the chain */
+typedef struct _queue
+{
+    BUFFER *head;
+    BUFFER *tail;
+    int bytes;			/* bytes not yet consumed */
+}
+QUEUE;
+
 #define BUFFER_SIZE 2048	/* default buffer length for output queues */
 
 typedef struct _connection CONNECTION;
@@ -72,6 +101,7 @@ typedef struct _user USER;
 typedef struct _channel CHANNEL;
 typedef struct _hotlist HOTLIST;
 typedef struct _chanuser CHANUSER;
+typedef struct _timer TIMER;
 
 /* bitmasks for the `flags' member of struct _chanuser */
 #define ON_OPERATOR	1
@@ -176,7 +206,7 @@ typedef struct
 {
     z_streamp zin;		/* input stream decompressor */
     z_streamp zout;		/* output stream compressor */
-    BUFFER *outbuf;		/* compressed output buffer */
+    QUEUE outq;			/* output waiting to be compressed */
 }
 SERVER;
 
@@ -200,7 +230,11 @@ typedef struct
        when hotlist->numusers is zero.  */
     LIST *hotlist;
     HASH *files;		/* db entries for this user's shared files */
+    HASH *dirs;			/* FILEDIRs used by `files' */
+    ARENA arena;		/* memory for the entries in `files' */
     LIST *ignore;		/* server side ignore list */
+    int eject;			/* 1 + position in the heap of users who are
+				   not sharing (see serverlib.c), or 0 */
 }
 USEROPT;
 
@@ -217,7 +251,7 @@ struct _connection
     char *host;			/* host from which this connection originates */
     USER *user;			/* pointer to the user associated with this
 				   connection, if CLASS_USER */
-    BUFFER *sendbuf;		/* output buffer */
+    QUEUE sendq;		/* output buffer */
     BUFFER *recvbuf;		/* input buffer */
 
     union
@@ -235,8 +269,10 @@ struct _connection
     }
     opt;
 
-    time_t	timer;		/* timer to detect idle connections */
+    TIMER	*timer;		/* login timeout */
+    int		slot[2];	/* positions in Live_Clients and Local_Users */
     time_t	flood;		/* flood protection counter */
+    TIMER	*flood_timer;	/* ends throttling, see event_throttle() */
 
     unsigned int connecting:1;
     unsigned int destroy:1;	/* connection should be destoyed in
@@ -251,7 +287,15 @@ struct _connection
     unsigned int compress:4;	/* compression level for this connection */
     unsigned int class:2;	/* connection class (unknown, user, server) */
     unsigned int numerics:1;	/* use real numerics for opennap extensions */
-    unsigned int xxx:5;		/* unused */
+    unsigned int readable:1;	/* socket may have unread input */
+    unsigned int writable:1;	/* socket may accept more output */
+    unsigned int ready:1;	/* on the Ready list (see event.c) */
+    unsigned int throttled:1;	/* read interest disabled due to flooding */
+    unsigned int wantwrite:1;	/* write interest enabled */
+    unsigned int jobwait:1;	/* used by job_reap() */
+    unsigned int backlog:1;	/* complete commands left in recvbuf, see
+				   handle_connection() */
+    unsigned int hangup:1;	/* peer closed its end, read until EOF */
 
     short yyy; /* unused - remaining 16 bits of above bitmasks */
 };
@@ -266,15 +310,6 @@ struct _hotlist
     LIST *users;
 };
 
-/* list of DATUM entries, used in the global file list */
-typedef struct
-{
-    char *key;			/* keyword */
-    LIST *list;			/* list of files containing this keyword */
-    int count;			/* number of files in the list */
-}
-FLIST;
-
 /* content-type */
 enum
 {
@@ -287,24 +322,109 @@ enum
     CT_UNKNOWN
 };
 
+/* a directory of a user's shared files, kept once for all of the files
+   in it.  see intern_dir() */
+typedef struct
+{
+    USER *user;			/* user who possesses the files */
+    char name[1];		/* including the trailing separator, or "" */
+}
+FILEDIR;
+
+/* a shared file.  the full name is `dir->name' followed by `name'.  there
+   are millions of these on a large server so they are kept small: the
+   user and directory are stored once for all of a user's files in the
+   directory, and the name is allocated along with the struct.  see
+   new_datum() */
 typedef struct
 {
-    USER *user;			/* user who possesses this file */
-    char *filename;
+    FILEDIR *dir;		/* directory and user of this file */
 #if RESUME
-    char *hash;			/* the md5 hash of the file */
+    union
+    {
+	unsigned char md5[16];	/* if `binhash' is set */
+	char *text;		/* hashes which aren't 32 hex digits */
+    }
+    hash;			/* use datum_hash() to get it as text */
 #endif
-    unsigned int size;		/* size of file in bytes.  set to -1 if
-				   the structure is invalid */
+    unsigned int size;		/* size of file in bytes */
+    unsigned int id;		/* order in which the file was indexed.  the
+				   posting lists in File_Table are sorted
+				   by this field */
     unsigned short duration;
-    /* next 4 fields make up 16 bits */
+    unsigned char postings;	/* entries in File_Table.  not in the
+				   bitfield below, which the search threads
+				   read while it is being updated */
     unsigned int bitrate : 5;	/* offset into BitRate[] */
     unsigned int frequency:3;	/* offset into SampleRate[] */
     unsigned int type:3;	/* content type */
-    unsigned int refcount:5;	/* how many references to this structure? */
+    unsigned int binhash:1;	/* `hash.md5' is in use */
+    char name[1];		/* file name without the directory */
 }
 DATUM;
 
+/* compare DATUM ids allowing for wraparound of the counter.  this is valid
+   as long as no file remains shared while 2^31 newer files are added */
+#define ID_LT(a,b) ((int) ((a) - (b)) < 0)
+
+/* the DATUMs are freed along with the rest of their user's memory when the
+   user leaves, without first removing them from File_Table.  the entries
+   left behind in the file lists are recognized by their id, which has its
+   bit cleared in this map, and are weeded out by fdb_garbage_collect().
+   see add_file.c */
+typedef struct
+{
+    unsigned int base;		/* id of the first bit.  every id before this
+				   is no longer shared */
+    unsigned int nbits;		/* ids after the end are still shared */
+    unsigned int bits[1];
+}
+IDMAP;
+
+extern IDMAP *Live_Ids;
+
+/* the DATUM for each id, see id_datum().  ids are handed out in order, so
+   the files of one user mostly sit together and each page is released
+   once every file in it is gone.  like Live_Ids, the table of pages is
+   replaced rather than resized while the search threads may be reading
+   it */
+#define ID_PAGE 1024
+
+typedef struct
+{
+    DATUM *d[ID_PAGE];		/* 0 once the file is no longer shared */
+    int live;			/* entries still in use */
+}
+IDPAGE;
+
+typedef struct
+{
+    unsigned int base;		/* id of the first entry of pages[0] */
+    int npages;
+    IDPAGE *pages[1];		/* 0 where all the files are gone */
+}
+IDTABLE;
+
+extern IDTABLE *Datums;
+
+/* nonzero if the DATUM with `id' may still be looked at */
+#define ID_LIVE(m,id) (ID_LT ((id), (m)->base) ? 0 : \
+	(unsigned int) ((id) - (m)->base) >= (m)->nbits ? 1 : \
+	((m)->bits[((id) - (m)->base) >> 5] >> (((id) - (m)->base) & 31)) & 1)
+
+/* list of DATUM entries, used in the global file list */
+typedef struct
+{
+    char *key;			/* keyword */
+    unsigned int *ids;		/* ids of the files containing this keyword,
+				   see id_datum() */
+    int count;			/* number of files in the list */
+    int max;			/* allocated size of ids */
+    int pins;			/* number of searches using this list, see
+				   workers.c */
+}
+FLIST;
+
 typedef struct _ban
 {
     char *target;	/* target of the ban */
@@ -350,16 +470,58 @@ typedef struct link
 
 typedef void (*timer_cb_t) (void *);
 
+/* a unit of work for the search threads */
+typedef struct _job JOB;
+
+typedef void (*job_cb_t) (JOB *);
+
+struct _job
+{
+    JOB *next;			/* list of outstanding jobs */
+    JOB *qnext;			/* queue of jobs waiting for a thread */
+    CONNECTION *con;		/* connection the job is for, set to 0 if
+				   the connection goes away */
+    unsigned int seq;		/* submission order */
+    int finished;
+    job_cb_t run;		/* called from a search thread */
+    job_cb_t done;		/* called from the main thread when finished */
+};
+
+/* hint that the memory at `p' will be read soon */
+#ifdef __GNUC__
+#define PREFETCH(p) __builtin_prefetch (p)
+#else
+#define PREFETCH(p)
+#endif
+
+/* data which is written by the main thread while the search threads may
+   be reading it is accessed through these */
+#if HAVE_THREADS
+#define PUBLISH(p,v) __atomic_store_n (&(p), (v), __ATOMIC_RELEASE)
+#define SNAPSHOT(p) __atomic_load_n (&(p), __ATOMIC_ACQUIRE)
+#else
+#define PUBLISH(p,v) ((p) = (v))
+#define SNAPSHOT(p) (p)
+#endif /* HAVE_THREADS */
+
 extern unsigned int Bytes_In;
 extern unsigned int Bytes_Out;
+extern unsigned int Bytes_Queued;
 extern int Channel_Limit;
 extern int Client_Queue_Length;
 extern int Collect_Interval;
+extern int Collect_Step;
+extern int Index_Step;
 extern int Compression_Level;
 extern char *Config_Dir;
 extern time_t Current_Time;
 extern int Flood_Commands;
 extern int Flood_Time;
+
+/* nonzero if reads from this client are currently being throttled */
+#define FLOODING(c) (Flood_Commands > 0 && ISUSER (c) && \
+	(c)->flood >= Current_Time + Flood_Time)
+
 extern unsigned int Interface;
 extern time_t Last_Click;
 extern char *Listen_Addr;
@@ -374,6 +536,7 @@ extern int Max_Shared;
 extern int Max_User_Channels;	/* # of channels is a user allowed to join */
 extern int Nick_Expire;
 extern unsigned int Search_Count;	/* # of searches in the last click */
+extern int Search_Threads;
 extern int Search_Timeout;
 extern unsigned int Server_Flags;
 extern char *Server_Name;
@@ -382,12 +545,14 @@ extern char *Server_Pass;
 extern LIST *Server_Ports;
 extern int Server_Queue_Length;
 extern int SigCaught;		/* flag to control main loop */
+extern int Slow_Command;
 extern int Stat_Click;
 extern int Stats_Port;
 extern time_t Server_Start;
 extern unsigned int Total_Bytes_In;
 extern unsigned int Total_Bytes_Out;
 extern int User_Db_Interval;
+extern unsigned int Write_Calls;
 extern int Max_Channel_Length;
 extern int Max_Ignore;
 extern int Max_Hotlist;
@@ -395,6 +560,8 @@ extern int Max_Topic;
 extern int Max_Client_String;
 extern int Max_Reason;
 extern int Max_Clones;
+extern int Connect_Limit;
+extern int Connect_Interval;
 
 extern const int BitRate[];
 extern const int SampleRate[];
@@ -416,6 +583,7 @@ extern int Max_Rss_Size;
 #define ON_NO_LISTEN		(1<<4)	/* don't listen on port 8889 */
 #define ON_BACKGROUND		(1<<5)	/* run in daemon mode */
 #define ON_EJECT_WHEN_FULL	(1<<6)	/* eject nonsharing clients when full */
+#define ON_STATS_METRICS	(1<<7)	/* serve metrics on the stats port */
 
 extern char Buf[2048];
 
@@ -423,7 +591,33 @@ extern CONNECTION **Clients;	/* locally connected clients */
 extern int Num_Clients;
 extern int Max_Clients;
 
+/* dense arrays of connections, which can be walked without skipping over
+   the holes in Clients[].  each connection records its position in
+   CONNECTION.slot[] so that it can be removed in constant time */
+typedef struct
+{
+    CONNECTION **con;
+    int count;
+    int max;
+    int slot;			/* index into CONNECTION.slot[] */
+}
+CONLIST;
+
+extern CONLIST Live_Clients;	/* everything in Clients[] */
+extern CONLIST Local_Users;	/* locally connected users */
+
+extern CONNECTION **Ready;	/* clients to process this pass */
+extern int Num_Ready;
+
+/* search kernels, see simd.c */
+extern int (*Ids_Intersect) (const unsigned int *, int, int *,
+			     const unsigned int *, int, int *, int *, int);
+extern int (*Str_Contains) (const char *, int, const char *, int);
+
 extern int Num_Files;		/* total number of available files */
+extern unsigned int File_Postings;	/* entries in File_Table */
+extern unsigned int Dead_Postings;	/* entries for removed files, see
+					   fdb_garbage_collect() */
 extern double Num_Gigs;		/* total size of files available (in kB) */
 
 extern LIST *Bans;
@@ -605,6 +799,8 @@ void set_val (char *d, unsigned short val);
 #define MSG_CLIENT_USAGE_STATS		10115	/* server usage stats */
 #define MSG_SERVER_USAGE_STATS		10115
 #define MSG_CLIENT_REHASH		10117	/* reload config file */
+#define MSG_CLIENT_COMMAND_STATS	10118	/* per-command statistics */
+#define MSG_SERVER_COMMAND_STATS	10118
 #define MSG_CLIENT_REGISTER_USER	10200
 #define MSG_CLIENT_CHANNEL_LEVEL	10201	/* deprecated, use 823 instead*/
 #define MSG_CLIENT_KICK_USER		10202	/* deprecated, use 829 instead*/
@@ -627,39 +823,80 @@ void set_val (char *d, unsigned short val);
 
 /* utility routines */
 int add_client (CONNECTION *);
-void add_timer (int, int, timer_cb_t, void *);
+void add_clone (unsigned int);
+TIMER *add_timer (int, int, timer_cb_t, void *);
+TIMER *add_timer_ms (int, int, timer_cb_t, void *);
 char *append_string (char *in, const char *fmt, ...);
 int bind_interface (int, unsigned int, int);
-BUFFER *buffer_append (BUFFER *, BUFFER *);
-BUFFER *buffer_consume (BUFFER *, int);
+BLOCK *block_new (char *, int);
+void block_free (BLOCK *);
+void buffer_append (QUEUE *, BUFFER *);
+void buffer_consume (QUEUE *, int);
 void buffer_free (BUFFER *);
-int buffer_size (BUFFER *);
 int buffer_decompress (BUFFER *, z_streamp, char *, int);
 int buffer_validate (BUFFER *);
 void cancel_search (CONNECTION * con);
+void cancel_timer (TIMER *);
+void cmdstat_add (CMDSTAT *, unsigned long, unsigned int);
+unsigned long cmdstat_clock (void);
+CMDSTAT *cmdstat_new (unsigned short);
+void cmdstats_log (void);
+void cmdstats_metrics (METRICS *);
 int check_ban (CONNECTION *, const char *, const char *);
+int check_connect_rate (unsigned int);
 int check_connect_status (int);
 int check_pass (const char *info, const char *pass);
+int conlist_add (CONLIST *, CONNECTION *);
+void conlist_remove (CONLIST *, CONNECTION *);
+void eject_add (CONNECTION *);
+CONNECTION *eject_candidate (void);
+void eject_remove (CONNECTION *);
 void close_db (void);
 void complete_connect (CONNECTION * con);
 void config (const char *);
 void config_defaults (void);
+int count_clones (unsigned int);
 USERDB *create_db (USER *);
+#if RESUME
+char *datum_hash (DATUM *, char *);
+#endif
 void dump_channels(void);
-void exec_timers (time_t);
+int event_add (CONNECTION *);
+void event_close (void);
+void event_del (CONNECTION *);
+int event_init (void);
+void event_listen (int);
+int event_pending (int);
+void event_reset (void);
+void event_throttle (CONNECTION *);
+void event_touch (CONNECTION *);
+int event_wait (int);
+void exec_timers (void);
 void expand_hex (char *, int);
 void expire_bans (void);
+int fdb_backlog (void);
 void fdb_garbage_collect (HASH *);
+int fdb_collect_step (void);
+void fdb_collect_stats (void);
+int fdb_index_step (void);
+#if DEBUG
+void fdb_index_free (void);
+#endif
 void finalize_compress (SERVER *);
 CHANNEL *find_channel (LIST *, const char *);
 int form_message (char *, int, int, const char *, ...);
 void free_ban (BAN *);
 void free_channel (CHANNEL *);
+void free_clones (void);
+void free_clients (void);
+void free_cmdstats (void);
+void free_stats_clients (void);
 void free_config (void);
-void free_datum (DATUM *);
+void unshare_datum (DATUM *);
 void free_flist (FLIST *);
 void free_hotlist (HOTLIST *);
 void free_pointer (void *);
+void free_spare_input (void);
 void free_timers (void);
 void free_user (USER *);
 char *generate_nonce (void);
@@ -668,8 +905,11 @@ int get_level (const char *);
 unsigned short get_local_port (int);
 void get_random_bytes (char *d, int);
 void handle_connection (CONNECTION *);
+DATUM *id_datum (IDTABLE *, unsigned int);
+IDPAGE *id_page (IDTABLE *, unsigned int);
 void init_compress (CONNECTION *, int);
 int init_db (void);
+int init_handlers (void);
 void init_random (void);
 int init_server (const char *);
 int invalid_channel (const char *);
@@ -681,6 +921,9 @@ int is_filtered (const char *);
 int is_ignoring (LIST *, const char *);
 int is_linked (CONNECTION *, const char *);
 int is_server (const char *);
+void job_cancel (CONNECTION *);
+void job_reap (void);
+void job_submit (JOB *);
 int glob_match(const char *, const char *);
 int load_bans (void);
 void load_channels (void);
@@ -688,6 +931,7 @@ void load_filter (void);
 void log (const char *fmt, ...);
 unsigned int lookup_ip (const char *host);
 int make_tcp_connection (const char *host, int port, unsigned int *ip);
+void metrics_printf (METRICS *, const char *, ...);
 void motd_init(void);
 void motd_close(void);
 char *my_ntoa (unsigned int);
@@ -697,7 +941,7 @@ CONNECTION *new_connection (void);
 int new_tcp_socket (int);
 char *next_arg (char **);
 char *next_arg_noskip (char **);
-time_t next_timer (void);
+int next_timer (void);
 char *normalize_ban(char *, char *, int);
 void nosuchuser (CONNECTION *);
 void nosuchchannel (CONNECTION*);
@@ -711,10 +955,16 @@ void permission_denied (CONNECTION * con);
 int pop_user (CONNECTION * con, char **pkt, USER ** user);
 int pop_user_server (CONNECTION * con, int tag, char **pkt, char **nick, USER ** user);
 void print_args (int, char **);
+void queue_block (CONNECTION *, BLOCK *);
 void queue_data (CONNECTION *, char *, int);
+void remove_client (CONNECTION *);
+void remove_clone (unsigned int);
 void remove_connection (CONNECTION *);
 void remove_links (const char *);
 void remove_user (CONNECTION *);
+int remote_search_count (void);
+void report_stats (int);
+void retire (void *);
 int safe_realloc (void **, int);
 int save_bans (void);
 void send_cmd (CONNECTION *, unsigned int msgtype, const char *fmt, ...);
@@ -727,10 +977,12 @@ int set_max_connections (int);
 int set_nonblocking (int);
 int set_rss_size (int);
 int set_tcp_buffer_len (int, int);
+void simd_init (void);
 int split_line (char **template, int templatecount, char *pkt);
 char *strlower (char *);
 void synch_server (CONNECTION *);
 LIST *tokenize (char *);
+int tokenize_words (char *, char **, hash_t *, int);
 void truncate_reason (char *);
 void unparsable(CONNECTION *);
 int userdb_dump (void);
@@ -740,6 +992,8 @@ int validate_user (USER *);
 int validate_channel (CHANNEL *);
 int validate_connection (CONNECTION *);
 int validate_hotlist (HOTLIST *);
+void workers_close (void);
+int workers_init (void);
 
 #define HANDLER(f) void f (CONNECTION *con, unsigned short tag, unsigned short len, char *pkt)
 /* this is not a real handler, but has the same arguments as one */
@@ -781,6 +1035,7 @@ HANDLER (clear_channel);
 HANDLER (clear_ignore);
 HANDLER (client_quit);
 HANDLER (cloak);
+HANDLER (command_stats);
 HANDLER (cycle_client);
 HANDLER (data_port_error);
 HANDLER (download);
@@ -28,8 +28,8 @@ channel_remove (CHANNEL * chan, USER * user)
 	{
 	    tmpList = *list;
 	    *list = (*list)->next;
-	    FREE (tmpList);
-	    FREE (chanUser);
+	    POOL_FREE (&List_Pool, tmpList);
+	    POOL_FREE (&Chanuser_Pool, chanUser);
 	    break;
 	}
     }
@@ -47,6 +47,7 @@ part_channel (CHANNEL * chan, USER * user)
     int len;
     CHANUSER *chanUser;
     LIST *list;
+    BLOCK *block;
 
     ASSERT (validate_channel (chan));
     ASSERT (validate_user (user));
@@ -58,7 +59,8 @@ part_channel (CHANNEL * chan, USER * user)
 	len = form_message (Buf, sizeof (Buf), MSG_SERVER_PART,
 			    "%s %s %d %d", chan->name, user->nick,
 			    user->shared, user->speed);
-	for (list = chan->users; list; list = list->next)
+	block = block_new (Buf, len);
+	for (list = chan->users; block && list; list = list->next)
 	{
 	    /* we only notify local clients */
 	    chanUser = list->data;
@@ -67,9 +69,11 @@ part_channel (CHANNEL * chan, USER * user)
 	    {
 		if (!user->cloaked
 		    || chanUser->user->level >= LEVEL_MODERATOR)
-		    queue_data (chanUser->user->con, Buf, len);
+		    queue_block (chanUser->user->con, block);
 	    }
 	}
+	if (block)
+	    block_free (block);
     }
     /* if there are no users left in this channel, destroy it */
     else if (chan->flags & ON_CHANNEL_USER)
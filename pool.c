@@ -0,0 +1,188 @@
+/* Copyright (C) 2000 drscholl@users.sourceforge.net
+   This is free software distributed under the terms of the
+   GNU Public License.  See the file COPYING for details.
+
+   $Id$ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "opennap.h"
+#include "debug.h"
+
+#define SLAB_SIZE 65536		/* bytes allocated at a time for each pool */
+
+POOL Buffer_Pool = POOL_INIT ("buffer", sizeof (BUFFER) + BUFFER_SIZE);
+POOL Buffer_Ref_Pool = POOL_INIT ("shared buffer", sizeof (BUFFER));
+POOL List_Pool = POOL_INIT ("list", sizeof (LIST));
+POOL Chanuser_Pool = POOL_INIT ("channel member", sizeof (CHANUSER));
+
+POOL *Pools[] = {
+    &Buffer_Pool,
+    &Buffer_Ref_Pool,
+    &List_Pool,
+    &Chanuser_Pool,
+    0
+};
+
+/* the first POOL_ALIGN bytes of each slab link it to the next one */
+static int
+pool_grow (POOL * pool)
+{
+    int bytes = SLAB_SIZE;
+    char *slab;
+
+    if (bytes < POOL_ALIGN + 16 * pool->size)
+	bytes = POOL_ALIGN + 16 * pool->size;
+    slab = malloc (bytes);
+    if (!slab)
+	return -1;
+    *(void **) slab = pool->slab_list;
+    pool->slab_list = slab;
+    pool->slabs++;
+    pool->bytes += bytes;
+    pool->next = slab + POOL_ALIGN;
+    pool->end = slab + bytes;
+    return 0;
+}
+
+void *
+pool_alloc (POOL * pool)
+{
+    void *p;
+
+    if (pool->free)
+    {
+	p = pool->free;
+	pool->free = *(void **) p;
+    }
+    else
+    {
+	if (pool->end - pool->next < pool->size && pool_grow (pool))
+	    return 0;
+	p = pool->next;
+	pool->next += pool->size;
+	pool->allocated++;
+    }
+    pool->used++;
+    memset (p, 0, pool->size);
+    return p;
+}
+
+void
+pool_free (POOL * pool, void *p)
+{
+    ASSERT (p != 0);
+    ASSERT (pool->used > 0);
+    *(void **) p = pool->free;
+    pool->free = p;
+    pool->used--;
+}
+
+#define ARENA_MIN 4096		/* size of an arena's first chunk */
+#define ARENA_MAX 65536		/* chunks don't grow beyond this */
+
+/* returns `len' bytes from the arena aligned to `align' bytes */
+static void *
+arena_get (ARENA * a, int len, int align)
+{
+    char *p;
+    int bytes;
+
+    p = (char *) (((unsigned long) a->next + align - 1) & ~(align - 1));
+    if (!a->next || a->end - p < len)
+    {
+	if (a->chunksize < ARENA_MIN)
+	    a->chunksize = ARENA_MIN;
+	bytes = a->chunksize;
+	if (bytes < POOL_ALIGN + len)
+	    bytes = POOL_ALIGN + len;
+	p = MALLOC (bytes);
+	if (!p)
+	    return 0;
+	/* the first POOL_ALIGN bytes of each chunk link it to the next */
+	*(void **) p = a->chunks;
+	a->chunks = p;
+	a->end = p + bytes;
+	p += POOL_ALIGN;
+	if (a->chunksize < ARENA_MAX)
+	    a->chunksize *= 2;
+    }
+    a->next = p + len;
+    return p;
+}
+
+/* returns zeroed memory */
+void *
+arena_alloc (ARENA * a, int len)
+{
+    void *p = arena_get (a, len, POOL_ALIGN);
+
+    if (p)
+	memset (p, 0, len);
+    return p;
+}
+
+char *
+arena_strdup (ARENA * a, const char *s)
+{
+    int len = strlen (s) + 1;
+    char *p = arena_get (a, len, 1);
+
+    if (p)
+	memcpy (p, s, len);
+    return p;
+}
+
+/* release all of the memory in the arena.  the search threads may still be
+   looking at files stored in it, so the chunks go through retire() */
+void
+arena_free (ARENA * a)
+{
+    void *p;
+
+    while ((p = a->chunks))
+    {
+	a->chunks = *(void **) p;
+	retire (p);
+    }
+    memset (a, 0, sizeof (ARENA));
+}
+
+#if DEBUG
+/* in debug mode each object is allocated separately so that the memory
+   debugger can check it and report it if it is leaked */
+void *
+debug_pool_alloc (POOL * pool, const char *file, int line)
+{
+    void *p = debug_calloc (1, pool->size, file, line);
+
+    if (p && ++pool->used > pool->allocated)
+    {
+	pool->allocated = pool->used;
+	pool->bytes += pool->size;
+    }
+    return p;
+}
+
+void
+debug_pool_free (POOL * pool, void *p, const char *file, int line)
+{
+    ASSERT (pool->used > 0);
+    pool->used--;
+    debug_free (p, file, line);
+}
+#endif /* DEBUG */
+
+void
+pool_stats (void)
+{
+    POOL **pool;
+
+    for (pool = Pools; *pool; pool++)
+    {
+	log ("pool_stats(): %s: %d in use, %d free, %u kbytes in %d slabs",
+	     (*pool)->name, (*pool)->used, (*pool)->allocated - (*pool)->used,
+	     (*pool)->bytes / 1024,
+	     (*pool)->slabs);
+    }
+}
@@ -0,0 +1,68 @@
+/* Copyright (C) 2000 drscholl@users.sourceforge.net
+   This is free software distributed under the terms of the
+   GNU Public License.  See the file COPYING for details.
+
+   $Id$ */
+
+#ifndef pool_h
+#define pool_h
+
+/* pools of small fixed size objects.  the objects are carved out of large
+   slabs and kept on a free list when released, which avoids the per
+   allocation overhead of malloc() for the millions of list elements and
+   files on a big server.  slabs are never given back to the system.
+
+   use the POOL_ALLOC() and POOL_FREE() macros from debug.h rather than
+   calling pool_alloc() and pool_free() directly so that debug builds can
+   track each object.  the pools are not thread safe, only the main thread
+   may allocate and free objects */
+
+typedef struct _pool
+{
+    const char *name;
+    int size;			/* object size */
+    int used;			/* objects handed out */
+    int allocated;		/* objects carved out of the slabs */
+    int slabs;
+    unsigned int bytes;		/* memory held by the pool */
+    void *free;			/* released objects, linked through the first
+				   word */
+    char *next;			/* unused part of the newest slab */
+    char *end;
+    void *slab_list;
+}
+POOL;
+
+/* objects are aligned to this many bytes */
+#define POOL_ALIGN 8
+
+#define POOL_INIT(name,size) { name, ((size) + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1), 0, 0, 0, 0, 0, 0, 0, 0 }
+
+/* returns zeroed memory, like calloc() */
+void *pool_alloc (POOL *);
+void pool_free (POOL *, void *);
+void pool_stats (void);
+
+extern POOL Buffer_Pool;	/* BUFFER with BUFFER_SIZE bytes of data */
+extern POOL Buffer_Ref_Pool;	/* BUFFER pointing at a shared BLOCK */
+extern POOL List_Pool;
+extern POOL Chanuser_Pool;
+extern POOL *Pools[];		/* all of the above, ends with a null */
+
+/* an arena hands out pieces of memory of any size, which can't be freed
+   individually but are all released at once by arena_free().  it should
+   be zeroed before first use */
+typedef struct _arena
+{
+    char *next;			/* unused part of the newest chunk */
+    char *end;
+    void *chunks;
+    int chunksize;		/* size of the next chunk to allocate */
+}
+ARENA;
+
+void *arena_alloc (ARENA *, int);
+char *arena_strdup (ARENA *, const char *);
+void arena_free (ARENA *);
+
+#endif /* pool_h */
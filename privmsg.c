@@ -323,7 +323,7 @@ HANDLER (ignore)
 		Max_Ignore);
 	return;
     }
-    list = MALLOC (sizeof (LIST));
+    list = POOL_ALLOC (&List_Pool);
     list->data = STRDUP (pkt);
     list->next = con->uopt->ignore;
     con->uopt->ignore = list;
@@ -352,7 +352,7 @@ HANDLER (unignore)
 	    tmpList = *list;
 	    *list = (*list)->next;
 	    FREE (tmpList->data);
-	    FREE (tmpList);
+	    POOL_FREE (&List_Pool, tmpList);
 	    return;
 	}
     }
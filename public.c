@@ -71,6 +71,7 @@ HANDLER (public)
     LIST *list;
     char *ptr;
     CHANUSER *chanUser;
+    BLOCK *block;
 
     (void) tag;
     ASSERT (validate_connection (con));
@@ -125,6 +126,8 @@ HANDLER (public)
     len = form_message (PublicBuf, sizeof (PublicBuf), MSG_SERVER_PUBLIC,
 			"%s %s %s", chan->name,
 			sender->cloaked ? "Operator" : sender->nick, pkt);
+    if (!(block = block_new (PublicBuf, len)))
+	return;
 
     /* send this message to everyone in the channel */
     for (list = chan->users; list; list = list->next)
@@ -137,9 +140,10 @@ HANDLER (public)
 		send_cmd (chanUser->user->con, MSG_SERVER_PUBLIC, "%s %s %s",
 			  chan->name, sender->nick, pkt);
 	    else
-		queue_data (chanUser->user->con, PublicBuf, len);
+		queue_block (chanUser->user->con, block);
 	}
     }
+    block_free (block);
 }
 
 /* 824 [ :<user> ] <channel> "<text>" */
@@ -150,6 +154,7 @@ HANDLER (emote)
     CHANNEL *chan;
     char *ptr, *av[2];
     LIST *list;
+    BLOCK *block;
 
     (void) tag;
     ASSERT (validate_connection (con));
@@ -200,6 +205,8 @@ HANDLER (emote)
     len = form_message (PublicBuf, sizeof (PublicBuf), tag, "%s %s \"%s\"",
 			chan->name,
 			user->cloaked ? "Operator" : user->nick, av[1]);
+    if (!(block = block_new (PublicBuf, len)))
+	return;
 
     /* send this message to all channel members */
     for (list = chan->users; list; list = list->next)
@@ -212,7 +219,8 @@ HANDLER (emote)
 		send_cmd (chanUser->user->con, tag, "%s %s \"%s\"",
 			  chan->name, user->nick, av[1]);
 	    else
-		queue_data (chanUser->user->con, PublicBuf, len);
+		queue_block (chanUser->user->con, block);
 	}
     }
+    block_free (block);
 }
@@ -40,6 +40,8 @@ remove_user (CONNECTION *con)
     HOTLIST *hotlist;
 
     ASSERT(ISUSER(con));
+    conlist_remove (&Local_Users, con);
+    eject_remove (con);
 
     /* remove user from global list, calls free_user() indirectly */
     ASSERT (validate_user (con->user));
@@ -60,6 +62,9 @@ remove_user (CONNECTION *con)
 
     if (con->uopt->files)
 	free_hash (con->uopt->files);
+    if (con->uopt->dirs)
+	free_hash (con->uopt->dirs);
+    arena_free (&con->uopt->arena);
 
     FREE (con->uopt);
 }
@@ -77,7 +82,7 @@ free_server_name(const char *s)
 	    tmp=*list;
 	    *list=(*list)->next;
 	    FREE(tmp->data);
-	    FREE(tmp);
+	    POOL_FREE (&List_Pool, tmp);
 	    break;
 	}
     }
@@ -90,6 +95,8 @@ remove_connection (CONNECTION * con)
 
     /* close socket */
     CLOSE (con->fd);
+    event_del (con);
+    cancel_timer (con->timer);	/* login timeout */
 
     /* if this connection had any pending searches, cancel them */
     cancel_search (con);
@@ -129,7 +136,7 @@ remove_connection (CONNECTION * con)
 	hash_foreach (Users, (hash_callback_t) server_split, con);
 
 	finalize_compress (con->sopt);
-	buffer_free (con->sopt->outbuf);
+	buffer_free (con->sopt->outq.head);
 	FREE (con->sopt);
 
 	/* free the server name cache entry */
@@ -154,10 +161,9 @@ remove_connection (CONNECTION * con)
     /* common data */
     if (con->host)
 	FREE (con->host);
-    buffer_free (con->sendbuf);
+    buffer_free (con->sendq.head);
     buffer_free (con->recvbuf);
 
-    Clients[con->id] = 0;
-    Num_Clients--;
+    remove_client (con);
     FREE (con);
 }
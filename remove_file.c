@@ -42,9 +42,10 @@ HANDLER (remove_file)
     Num_Files--;
     ASSERT (Local_Files > 0);
     Local_Files--;
-    user->shared--;
+    if (--user->shared == 0)
+	eject_add (con);	/* no longer sharing */
     user->unsharing = 1;	/* note that we are unsharing */
 
-    /* this invokes free_datum() indirectly */
-    hash_remove (con->uopt->files, info->filename);
+    /* this invokes unshare_datum() indirectly */
+    hash_remove (con->uopt->files, pkt);
 }
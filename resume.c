@@ -14,9 +14,10 @@ HANDLER (resume)
 #if RESUME
     char *av[2];
     FLIST *flist;
-    LIST *ptr;
     DATUM *d;
-    int fsize;
+    USER *user;
+    int i, fsize;
+    char hash[33];
 #endif /* RESUME */
 
     (void) tag;
@@ -42,17 +43,19 @@ HANDLER (resume)
     flist = hash_lookup (MD5, av[0]);
     if (flist)
     {
-	for (ptr = flist->list; ptr; ptr = ptr->next)
+	for (i = 0; i < flist->count; i++)
 	{
-	    d = (DATUM *) ptr->data;
+	    if (!(d = id_datum (Datums, flist->ids[i])))
+		continue;	/* removed */
 	    if (d->size == (size_t)fsize)
 	    {
-		ASSERT (validate_user (d->user));
+		user = d->dir->user;
+		ASSERT (validate_user (user));
 		send_cmd (con, MSG_SERVER_RESUME_MATCH,
-			  "%s %u %d \"%s\" %s %d %hu",
-			  d->user->nick, d->user->ip, d->user->port,
-			  d->filename, d->hash, d->size,
-			  d->user->speed);
+			  "%s %u %d \"%s%s\" %s %d %hu",
+			  user->nick, user->ip, user->port,
+			  d->dir->name, d->name, datum_hash (d, hash), d->size,
+			  user->speed);
 	    }
 	}
     }
@@ -26,16 +26,20 @@ typedef struct
     short count;		/* how many ACKS have been recieved? */
     short numServers;		/* how many servers were connected at the time
 				   this search was issued? */
-    time_t timestamp;		/* when the search request was issued */
+    TIMER *timer;		/* expires the request after Search_Timeout
+				   seconds */
 }
 DSEARCH;
 
 static LIST *Remote_Search = 0;
 
-/* parameters for searching */
+/* parameters for searching.  the file lists are looked up and the results
+   are sent from the main thread, but the lists may be scanned by one of the
+   search threads (see workers.c) */
 typedef struct
 {
-    CONNECTION *con;		/* connection for user that issued search */
+    JOB job;			/* job.con is the connection for user that
+				   issued search */
     USER *user;			/* user that issued the search */
     int minbitrate;
     int maxbitrate;
@@ -45,27 +49,40 @@ typedef struct
     int maxspeed;
     int type;			/* -1 means any type */
     char *id;			/* if doing a remote search */
+    char *nick;			/* user->nick, the user may have left by the
+				   time the search is finished */
+    int local;			/* only search files on this server */
+    int max_results;
+    LIST *tokens;		/* words to search for */
+    int nlists;
+    FLIST **lists;		/* file list for each token, fewest files
+				   first */
+    FLIST **view;		/* copies of the lists taken when the scan
+				   starts, see search_run() */
+    int *pos;
+    DATUM **hits;		/* matching files */
+    int numhits;
+    int maxhits;		/* allocated size of hits */
+    unsigned long scan_time;	/* ns taken by search_run() */
 }
 SEARCH;
 
-/* returns 0 if the match is not acceptable, nonzero if it is */
+/* returns 0 if the match is not acceptable, nonzero if it is.  this is
+   called from the search threads, so it may only look at the file and the
+   users involved, and the file might be removed while we are looking */
 static int
 search_callback (DATUM * match, SEARCH * parms)
 {
-    /* don't return matches for a user's own files */
-    if (match->user == parms->user)
-	return 0;
-    /* ignore match if both parties are firewalled */
-    if (parms->user->port == 0 && match->user->port == 0)
-	return 0;
+    /* the user's port and speed may be changed by the main thread while we
+       look at them, but the USER and the file itself are not freed until
+       we are done (see retire()).  the file itself is checked first, the
+       user is one more pointer away */
+    USER *user;
+
     if (BitRate[match->bitrate] < parms->minbitrate)
 	return 0;
     if (BitRate[match->bitrate] > parms->maxbitrate)
 	return 0;
-    if (match->user->speed < parms->minspeed)
-	return 0;
-    if (match->user->speed > parms->maxspeed)
-	return 0;
     if (SampleRate[match->frequency] < parms->minfreq)
 	return 0;
     if (SampleRate[match->frequency] > parms->maxfreq)
@@ -73,17 +90,58 @@ search_callback (DATUM * match, SEARCH * parms)
     if (parms->type != -1 && parms->type != match->type)
 	return 0;		/* wrong content type */
 
+    user = match->dir->user;
+    /* don't return matches for a user's own files */
+    if (user == parms->user)
+	return 0;
+    /* ignore match if both parties are firewalled */
+    if (parms->user->port == 0 && user->port == 0)
+	return 0;
+    if (user->speed < parms->minspeed)
+	return 0;
+    if (user->speed > parms->maxspeed)
+	return 0;
+
+    /* save the match to be sent by the main thread.  this doesn't use
+       safe_realloc() since the debug allocator is not thread safe */
+    if (parms->numhits == parms->maxhits)
+    {
+	DATUM **hits = realloc (parms->hits, sizeof (DATUM *) *
+				(parms->maxhits ? parms->maxhits * 2 : 64));
+
+	if (!hits)
+	    return 0;
+	parms->hits = hits;
+	parms->maxhits = parms->maxhits ? parms->maxhits * 2 : 64;
+    }
+    parms->hits[parms->numhits++] = match;
+
+    return 1;			/* accept match */
+}
+
+/* send a match found by search_callback() */
+static int
+send_result (DATUM * match, SEARCH * parms)
+{
+#if RESUME
+    char hash[33];
+#endif
+    USER *user = match->dir->user;
+
+    if (!ID_LIVE (Live_Ids, match->id))
+	return 0;		/* file was removed since the search */
+    ASSERT (validate_user (user));
+
     /* send the result to the server that requested it */
     if (parms->id)
     {
-	ASSERT (ISSERVER (parms->con));
-	ASSERT (validate_user (match->user));
+	ASSERT (ISSERVER (parms->job.con));
 	/* 10016 <id> <user> "<filename>" <md5> <size> <bitrate> <frequency> <duration> */
-	send_cmd (parms->con, MSG_SERVER_REMOTE_SEARCH_RESULT,
-		  "%s %s \"%s\" %s %d %d %d %d",
-		  parms->id, match->user->nick, match->filename,
+	send_cmd (parms->job.con, MSG_SERVER_REMOTE_SEARCH_RESULT,
+		  "%s %s \"%s%s\" %s %d %d %d %d",
+		  parms->id, user->nick, match->dir->name, match->name,
 #if RESUME
-		  match->hash,
+		  datum_hash (match, hash),
 #else
 		  "00000000000000000000000000000000",
 #endif
@@ -93,10 +151,11 @@ search_callback (DATUM * match, SEARCH * parms)
     /* if a local user issued the search, notify them of the match */
     else
     {
-	send_cmd (parms->con, MSG_SERVER_SEARCH_RESULT,
-		  "\"%s\" %s %d %d %d %d %s %u %d", match->filename,
+	send_cmd (parms->job.con, MSG_SERVER_SEARCH_RESULT,
+		  "\"%s%s\" %s %d %d %d %d %s %u %d", match->dir->name,
+		  match->name,
 #if RESUME
-		  match->hash,
+		  datum_hash (match, hash),
 #else
 		  "00000000000000000000000000000000",
 #endif
@@ -104,18 +163,17 @@ search_callback (DATUM * match, SEARCH * parms)
 		  BitRate[match->bitrate],
 		  SampleRate[match->frequency],
 		  match->duration,
-		  match->user->nick, match->user->ip, match->user->speed);
+		  user->nick, user->ip, user->speed);
     }
-
-    return 1;			/* accept match */
+    return 1;
 }
 
 void
 free_flist (FLIST * ptr)
 {
-    ASSERT ((ptr->count == 0) ^ (ptr->list != 0));
-    FREE (ptr->key);
-    list_free (ptr->list, (list_destroy_t) free_datum);
+    ASSERT (ptr->count <= ptr->max);
+    if (ptr->ids)
+	FREE (ptr->ids);
     FREE (ptr);
 }
 
@@ -138,12 +196,13 @@ duplicate (LIST * list, const char *s)
    sense on its own */
 #define WORD_CHAR(c) (isalnum((unsigned char)c)||c=='\'')
 
-/* return a list of word tokens from the input string */
-LIST *
-tokenize (char *s)
+/* returns the next word in `*ps', which is nul terminated in place, or 0
+   at the end of the string.  the hash code of the word is stored in
+   `sum' */
+static char *
+next_word (char **ps, hash_t * sum)
 {
-    LIST *r = 0, **cur = &r;
-    char *ptr;
+    char *s = *ps, *ptr;
 
     while (*s)
     {
@@ -161,190 +220,409 @@ tokenize (char *s)
 	   it won't match on them.  its doubtful that these would narrow
 	   searches down any even after the selection of the bin to search */
 	/* new dynamic table from config file */
-	if(is_filtered(s))
+	*sum = hash_string (s);
+	if (hash_lookup_sum (Filter, s, *sum))
 	{
 	    s=ptr;
 	    continue;
 	}
+	*ps = ptr;
+	return s;
+    }
+    *ps = s;
+    return 0;
+}
 
+/* split `s' into words like tokenize(), but without removing duplicates.
+   returns the number of words stored in `words', with their hash codes in
+   `sums', or -1 if there are more than `max' */
+int
+tokenize_words (char *s, char **words, hash_t * sums, int max)
+{
+    char *w;
+    hash_t sum;
+    int n = 0;
+
+    while ((w = next_word (&s, &sum)))
+    {
+	if (n == max)
+	    return -1;
+	sums[n] = sum;
+	words[n++] = w;
+    }
+    return n;
+}
+
+/* return a list of word tokens from the input string */
+LIST *
+tokenize (char *s)
+{
+    LIST *r = 0, **cur = &r;
+    char *w;
+    hash_t sum;
+
+    while ((w = next_word (&s, &sum)))
+    {
 	/* don't add duplicate tokens to the list.  this will cause searches
 	   on files that have the same token more than once to show up how
 	   ever many times the token appears in the filename */
-	if (duplicate (r, s))
-	{
-	    s = ptr;
+	if (duplicate (r, w))
 	    continue;
-	}
 
-	*cur = CALLOC (1, sizeof(LIST));
+	*cur = POOL_ALLOC (&List_Pool);
 	if(!*cur)
 	{
 	    OUTOFMEMORY("tokenize");
 	    return r;
 	}
-	(*cur)->data = s;
+	(*cur)->data = w;
 	cur = &(*cur)->next;
-	s = ptr;
     }
     return r;
 }
 
-void
-free_datum (DATUM * d)
-{
-    ASSERT (d->refcount > 0);
-    d->size = -1;		/* mark as invalid */
-    d->user = 0;
-    d->refcount--;
-    if (d->refcount == 0)
-    {
-	/* no more references, we can free this memory */
-	FREE (d->filename);
-#if RESUME
-	FREE (d->hash);
-#endif
-	FREE (d);
-    }
-}
-
+/* state of the garbage collection of one of the file tables.  rather than
+   sweeping the whole table at once, which stalls the server for a long
+   time when there are millions of files, fdb_collect_step() does a limited
+   amount of work each time through the main loop.  each collection makes
+   two passes over the table, the first only compacts the lists where a
+   sample of the entries shows many removed files, the second compacts any
+   list with a removed file in it */
 typedef struct
 {
-    int reaped;
     HASH *table;
+    HASHPOS pos;
+    int pass;			/* 0 when idle */
+    /* for the collection in progress, or the last one if idle */
+    int steps;			/* calls to fdb_collect_step() */
+    int lists;			/* lists compacted */
+    int reaped;			/* entries removed */
+    unsigned int collections;	/* collections finished */
 }
-GARBAGE;
+COLLECT;
+
+#if RESUME
+static COLLECT Collect[2];
+#else
+static COLLECT Collect[1];
+#endif
 
 #define THRESH 5000
+#define SAMPLE 16		/* entries checked to estimate how many of a
+				   list's files have been removed */
 
-static void
-collect_garbage (FLIST * files, GARBAGE * data)
+/* returns nonzero if at least a quarter of the sampled entries in `files'
+   are for removed files */
+static int
+is_dense (FLIST * files)
 {
-    LIST **ptr, *tmp;
-    DATUM *d;
+    int i, n = files->count < SAMPLE ? files->count : SAMPLE, dead = 0;
+
+    for (i = 0; i < n; i++)
+	if (!ID_LIVE (Live_Ids, files->ids[i * (files->count / n)]))
+	    dead++;
+    return dead * 4 >= n;
+}
+
+/* remove the entries for files which are no longer shared from `files'.
+   returns roughly the amount of work done */
+static int
+collect_garbage (COLLECT * c, FLIST * files)
+{
+    int i, j;
 
     /* print some info about large bins so we can consider adding them to
        the list of words to ignore in tokenize() */
-    if (files->count >= THRESH)
+    if (c->pass == 2 && files->count >= THRESH)
     {
 	log ("collect garbage(): bin for \"%s\" exceeds %d entries",
 	     files->key, THRESH);
     }
-    ptr = &files->list;
-    while (*ptr)
+    /* a search thread may be reading this list, leave it for next time */
+    if (files->pins)
+	return 1;
+    if (c->pass == 1 && !is_dense (files))
+	return SAMPLE;
+    /* the DATUMs for removed files may already have been freed, so only
+       their ids are looked at.  nothing needs to be moved up to the first
+       removed file */
+    for (i = 0; i < files->count && ID_LIVE (Live_Ids, files->ids[i]); i++)
+	;
+    if (i == files->count)
+	return i + 1;
+    /* compact the array in place, preserving the order of the entries */
+    for (j = i; i < files->count; i++)
     {
-	d = (*ptr)->data;
-	if (d->size == (unsigned) -1)
-	{
-	    files->count--;
-	    ++data->reaped;
-	    tmp = *ptr;
-	    *ptr = (*ptr)->next;
-	    tmp->next = 0;
-	    list_free (tmp, (list_destroy_t) free_datum);
-	    continue;
-	}
-	ptr = &(*ptr)->next;
+	if (ID_LIVE (Live_Ids, files->ids[i]))
+	    files->ids[j++] = files->ids[i];
     }
+    c->reaped += files->count - j;
+    if (c->table == File_Table)
+    {
+	ASSERT (Dead_Postings >= (unsigned int) (files->count - j));
+	File_Postings -= files->count - j;
+	Dead_Postings -= files->count - j;
+    }
+    c->lists++;
+    files->count = j;
 
     if (files->count == 0)
     {
 	/* no more files, remove this entry from the hash table */
-	hash_remove (data->table, files->key);
+	hash_remove (c->table, files->key);
     }
+    else if (files->count < files->max / 4)
+    {
+	/* give back memory from bins which have shrunk a lot */
+	if (safe_realloc ((void **) &files->ids,
+			  sizeof (int) * (files->max / 2)) == 0)
+	    files->max /= 2;
+    }
+    return i + 1;
 }
 
-/* walk the table and remove invalid entries */
+/* start removing invalid entries from `table'.  this is called from a
+   timer, the work is done by fdb_collect_step() */
 void
 fdb_garbage_collect (HASH * table)
 {
-    GARBAGE data;
+    COLLECT *c;
+    unsigned int i;
 
-    data.reaped = 0;
-    data.table = table;
+    for (i = 0; i < sizeof (Collect) / sizeof (COLLECT); i++)
+    {
+	c = &Collect[i];
+	if (c->table && c->table != table)
+	    continue;
+	if (c->pass)
+	{
+	    log ("fdb_garbage_collect(): previous collection still running");
+	    return;
+	}
+	c->table = table;
+	memset (&c->pos, 0, sizeof (c->pos));
+	c->pass = 1;
+	c->steps = 0;
+	c->lists = 0;
+	c->reaped = 0;
+	log ("fdb_garbage_collect(): collecting garbage");
+	return;
+    }
+    ASSERT (0);
+}
+
+/* do up to `Collect_Step' units of work on the collections in progress.
+   returns nonzero if there is more to do */
+int
+fdb_collect_step (void)
+{
+    COLLECT *c;
+    FLIST *files;
+    unsigned int i;
+    int work = 0, more = 0;
+
+    for (i = 0; i < sizeof (Collect) / sizeof (COLLECT); i++)
+    {
+	c = &Collect[i];
+	if (!c->pass)
+	    continue;
+	c->steps++;
+	while (c->pass && work < Collect_Step)
+	{
+	    work++;
+	    if ((files = hash_next (c->table, &c->pos)))
+		work += collect_garbage (c, files);
+	    else if (++c->pass > 2)
+	    {
+		c->pass = 0;
+		c->collections++;
+		log ("fdb_collect_step(): reaped %d dead entries from %d lists in %d steps",
+		     c->reaped, c->lists, c->steps);
+	    }
+	}
+	if (c->pass)
+	    more = 1;
+    }
+    return more;
+}
+
+/* log the progress of garbage collection */
+void
+fdb_collect_stats (void)
+{
+    COLLECT *c;
+    unsigned int i;
 
-    log ("fdb_garbage_collect(): collecting garbage");
-    hash_foreach (table, (hash_callback_t) collect_garbage, &data);
-    log ("fdb_garbage_collect(): reaped %d dead entries", data.reaped);
+    for (i = 0; i < sizeof (Collect) / sizeof (COLLECT); i++)
+    {
+	c = &Collect[i];
+	if (c->pass)
+	    log ("fdb_collect_stats(): pass %d, %d%% of %d lists, reaped %d dead entries from %d lists in %d steps",
+		 c->pass, c->pos.size ? c->pos.slot * 100 / c->pos.size : 0,
+		 c->table->dbsize, c->reaped, c->lists, c->steps);
+	else if (c->table)
+	    log ("fdb_collect_stats(): idle, %u collections, last reaped %d dead entries from %d lists in %d steps",
+		 c->collections, c->reaped, c->lists, c->steps);
+    }
 }
 
 /* check to see if all the strings in list of tokens are present in the
    filename.  returns 1 if all tokens were found, 0 otherwise */
 static int
-match (LIST * tokens, const char *file)
+match (LIST * tokens, DATUM * d)
 {
-    const char *b;
-    char c[3], *a;
-    int l;
+    int l, dlen = strlen (d->dir->name), nlen = strlen (d->name);
 
-    c[2] = 0;
     for (; tokens; tokens = tokens->next)
     {
-	a = tokens->data;
-	/* there doesn't appear to be a case-insensitive strchr() function
-	   so we fake it by using strpbrk() with a buffer that contains the
-	   upper and lower case versions of the char */
-	c[0] = tolower (*a);
-	c[1] = toupper (*a);
-	l = strlen (a);
-	b = file;
-	while (*b)
-	{
-	    b = strpbrk (b, c);
-	    if (!b)
-		return 0;
-	    /* already compared the first char, see the if the rest of the
-	       string matches */
-	    if (!strncasecmp (b + 1, a + 1, l - 1))
-		break;		/* matched, we are done with this token */
-	    b++;		/* skip the matched char to find the next occurance */
-	}
-	if (!*b)
-	    return 0;		/* hit the end of the string before matching */
+	/* tokens are already lower case, see tokenize().  they never
+	   contain a path separator, so can't span the directory and name */
+	l = strlen (tokens->data);
+	if (!l || (!Str_Contains (d->name, nlen, tokens->data, l) &&
+		   !Str_Contains (d->dir->name, dlen, tokens->data, l)))
+	    return 0;
+    }
+    return 1;
+}
+
+/* returns the index of the first entry at or after `i' whose id is not
+   less than `id'.  the list is probed at exponentially increasing distances
+   from `i' and then binary searched, so skipping over a long run costs
+   O(log n) instead of O(n) */
+static int
+flist_seek (FLIST * flist, int i, unsigned int id)
+{
+    int lo, hi, mid, step = 1;
+
+    if (i >= flist->count || !ID_LT (flist->ids[i], id))
+	return i;
+    lo = i;
+    hi = i + 1;
+    while (hi < flist->count && ID_LT (flist->ids[hi], id))
+    {
+	lo = hi;
+	step <<= 1;
+	hi = lo + step;
+    }
+    if (hi > flist->count)
+	hi = flist->count;
+    /* list[lo] < id <= list[hi] */
+    while (hi - lo > 1)
+    {
+	mid = lo + (hi - lo) / 2;
+	if (ID_LT (flist->ids[mid], id))
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    return hi;
+}
+
+/* returns nonzero if `d' is present in all of the lists after the first.
+   `pos' holds the current position in each list and is advanced to `d' */
+static int
+flist_member (FLIST ** lists, int *pos, int nlists, unsigned int id)
+{
+    int i;
+
+    for (i = 1; i < nlists; i++)
+    {
+	pos[i] = flist_seek (lists[i], pos[i], id);
+	if (pos[i] == lists[i]->count || lists[i]->ids[pos[i]] != id)
+	    return 0;
     }
     return 1;
 }
 
+/* find the files which contain all of `tokens'.  `lists' holds the file
+   list for each token, sorted so that the lists with the fewest files in
+   them come first, and `pos' is scratch space for each list.  files which
+   are not in `live' are skipped without looking at them, the rest are
+   found in `datums' */
 static int
-fdb_search (HASH * table,
+fdb_search (FLIST ** lists,
+	    int nlists,
 	    LIST * tokens,
+	    int *pos,
+	    IDMAP * live,
+	    IDTABLE * datums,
 	    int maxhits, int (*cb) (DATUM *, SEARCH *), SEARCH * cbdata)
 {
-    LIST *ptok;
-    FLIST *flist = 0, *tmp;
     DATUM *d;
-    int hits = 0;
+    IDPAGE *page = 0;
+    int i, a = 0, b = 0, k = 0, n = 0, block, whole, hits = 0;
+    int found[64];
+    unsigned int id, off;
+    unsigned int first = 0;	/* id of page->d[0] */
 
-    Search_Count++;
+    if (maxhits <= 0)
+	maxhits = INT_MAX;	/* no limit */
+    if (nlists == 0)
+	return 0;		/* no matches */
 
-    /* find the file list with the fewest files in it */
-    for (ptok = tokens; ptok; ptok = ptok->next)
+    /* every file in the smallest list is a candidate, and they are visited
+       in the order of that list.  a file which is also in every other list
+       contains all of the search tokens as whole words and needs no
+       further checking.  the rest may still contain them as parts of
+       longer words, such as "love" in "lovely", or be missing from some
+       lists because they have too many words to index them all, so those
+       are checked the slow way.
+
+       when the two smallest lists are about the same size, the files they
+       have in common are found a block at a time with Ids_Intersect().
+       otherwise each file is looked up in the other lists with
+       flist_seek(), which skips over long runs without looking at them */
+    memset (pos, 0, sizeof (int) * nlists);
+    block = nlists > 1 && lists[1]->count / 32 <= lists[0]->count;
+    for (i = 0; i < lists[0]->count && hits < maxhits; i++)
     {
-	tmp = hash_lookup (table, ptok->data);
-	if (!tmp)
+	id = lists[0]->ids[i];
+	/* the slots of `datums' for the files in a list are far apart, so
+	   the slot of a candidate a little way ahead is fetched, and the
+	   DATUM of one nearer whose slot should be in the cache by now */
+	if (page && i + 16 < lists[0]->count)
 	{
-	    /* if there is no entry for this word in the hash table, then
-	       we know there are no matches */
-	    return 0;
+	    off = lists[0]->ids[i + 16] - first;
+	    if (off < ID_PAGE)
+		PREFETCH (&page->d[off]);
+	    off = lists[0]->ids[i + 4] - first;
+	    if (off < ID_PAGE && (d = SNAPSHOT (page->d[off])))
+		PREFETCH (d);
 	}
-	if (!flist || tmp->count < flist->count)
-	    flist = tmp;
-    }
-    if (!flist)
-	return 0;		/* no matches */
-    /* find the list of files which contain all search tokens */
-    for (ptok = flist->list; ptok; ptok = ptok->next)
-    {
-	d = (DATUM *) ptok->data;
-	ASSERT (VALID_LEN (d, sizeof (DATUM)));
-	if (d->size != (unsigned) -1 && match (tokens, d->filename) &&
-	    cb (d, cbdata))
+	if (block)
+	{
+	    if (k == n && a < lists[0]->count && b < lists[1]->count)
+	    {
+		n = Ids_Intersect (lists[0]->ids, lists[0]->count, &a,
+				   lists[1]->ids, lists[1]->count, &b,
+				   found, sizeof (found) / sizeof (int));
+		k = 0;
+	    }
+	    whole = k < n && found[k] == i;
+	    if (whole)
+	    {
+		k++;
+		whole = flist_member (lists + 1, pos + 1, nlists - 1, id);
+	    }
+	}
+	else
+	    whole = flist_member (lists, pos, nlists, id);
+	if (!ID_LIVE (live, id))
+	    continue;
+	/* the candidates are in id order, so most of them are in the same
+	   page of `datums' as the one before */
+	if (!page || id - first >= ID_PAGE)
 	{
-	    /* callback accepted match */
-	    hits++;
-	    if (hits == maxhits)
-		break;		/* finished */
+	    first = id - (id - datums->base) % ID_PAGE;
+	    if (!(page = id_page (datums, id)))
+		continue;
 	}
+	if (!(d = SNAPSHOT (page->d[id - first])))
+	    continue;
+	if ((whole || match (tokens, d)) && cb (d, cbdata))
+	    hits++;		/* callback accepted match */
     }
+
     return hits;
 }
 
@@ -427,6 +705,7 @@ free_dsearch (DSEARCH * d)
 {
     if (d)
     {
+	cancel_timer (d->timer);
 	if (d->id)
 	    FREE (d->id);
 	if (d->nick)
@@ -435,6 +714,20 @@ free_dsearch (DSEARCH * d)
     }
 }
 
+/* not all of our peers replied to the request in time, give up on them */
+static void
+expire_search (DSEARCH * ds)
+{
+    log ("expire_search(): expiring request %s", ds->id);
+    if (ISUSER (ds->con))
+	send_cmd (ds->con, MSG_SERVER_SEARCH_END, "");
+    else
+	send_cmd (ds->con, MSG_SERVER_REMOTE_SEARCH_END, "%s", ds->id);
+    Remote_Search = list_delete (Remote_Search, ds);
+    ds->timer = 0;
+    free_dsearch (ds);
+}
+
 static int
 set_compare (CONNECTION * con, const char *op, int val, int *min, int *max)
 {
@@ -456,11 +749,260 @@ set_compare (CONNECTION * con, const char *op, int val, int *min, int *max)
     return 0;
 }
 
+/* called from a search thread */
+static void
+search_run (SEARCH * parms)
+{
+    FLIST *snap;
+    int i;
+    unsigned long start;
+
+    if (!SNAPSHOT (parms->job.con))
+	return;			/* cancelled */
+    start = cmdstat_clock ();
+    /* the main thread may append to the lists while we are scanning them,
+       so work from a copy of each list as it is now.  the count is read
+       first so that it is never larger than the arrays */
+    snap = (FLIST *) (parms->view + parms->nlists);
+    for (i = 0; i < parms->nlists; i++)
+    {
+	snap[i].count = SNAPSHOT (parms->lists[i]->count);
+	snap[i].ids = SNAPSHOT (parms->lists[i]->ids);
+	parms->view[i] = &snap[i];
+    }
+    memset (parms->pos, 0, sizeof (int) * parms->nlists);
+    fdb_search (parms->view, parms->nlists, parms->tokens, parms->pos,
+		SNAPSHOT (Live_Ids), SNAPSHOT (Datums), parms->max_results,
+		search_callback, parms);
+    parms->scan_time = cmdstat_clock () - start;
+}
+
+/* log a search which took longer than `slow_command' to scan or to send
+   the results for, with what was searched for and the size of the file
+   list it was driven by */
+static void
+log_slow_search (SEARCH * parms, unsigned long send_time)
+{
+    char tokens[256];
+    LIST *ptok;
+    int l = 0;
+
+    if (parms->scan_time < (unsigned long) Slow_Command * 1000000UL &&
+	send_time < (unsigned long) Slow_Command * 1000000UL)
+	return;
+
+    tokens[0] = 0;
+    for (ptok = parms->tokens; ptok && l < (int) sizeof (tokens) - 1;
+	 ptok = ptok->next)
+    {
+	snprintf (tokens + l, sizeof (tokens) - l, "%s%s", l ? " " : "",
+		  (char *) ptok->data);
+	l += strlen (tokens + l);
+    }
+    log ("search_done(): search by %s took %.1f ms (%.1f ms to send): "
+	 "tokens \"%s\", shortest list %d, %d hits", parms->nick,
+	 parms->scan_time / 1000000., send_time / 1000000., tokens,
+	 parms->nlists ? parms->view[0]->count : 0, parms->numhits);
+}
+
+static void
+free_search (SEARCH * parms)
+{
+    int i;
+
+    for (i = 0; i < parms->nlists; i++)
+    {
+	ASSERT (parms->lists[i]->pins > 0);
+	parms->lists[i]->pins--;
+    }
+    if (parms->hits)
+	free (parms->hits);	/* allocated by search_callback() */
+    list_free (parms->tokens, free_pointer);
+    if (parms->id)
+	FREE (parms->id);
+    if (parms->nick)
+	FREE (parms->nick);
+    FREE (parms);
+}
+
+/* called from the main thread when the scan has finished.  send the
+   results, and pass the search on to our peers if we didn't find enough */
+static void
+search_done (SEARCH * parms)
+{
+    CONNECTION *con = parms->job.con;
+    int i, n = 0, max_results = parms->max_results;
+    unsigned long start;
+
+    /* skip searches from connections which have been closed or whose
+       user was killed while we were searching */
+    if (!con || con->class == CLASS_UNKNOWN)
+    {
+	free_search (parms);
+	return;
+    }
+    ASSERT (validate_connection (con));
+
+    start = cmdstat_clock ();
+    for (i = 0; i < parms->numhits; i++)
+	n += send_result (parms->hits[i], parms);
+    if (Slow_Command > 0)
+	log_slow_search (parms, cmdstat_clock () - start);
+
+    if ((n < max_results) && !parms->local &&
+	((ISSERVER (con) && list_count (Servers) > 1) ||
+	 (ISUSER (con) && Servers)))
+    {
+	char *request;
+	DSEARCH *dsearch;
+	LIST *ptr;
+
+	/* generate a new request structure */
+	dsearch = CALLOC (1, sizeof (DSEARCH));
+	if (!dsearch)
+	{
+	    OUTOFMEMORY ("search_done");
+	    goto done;
+	}
+	if (parms->id)
+	{
+	    dsearch->id = parms->id;
+	    parms->id = 0;
+	}
+	else if ((dsearch->id = generate_search_id ()) == 0)
+	{
+	    FREE (dsearch);
+	    goto done;
+	}
+	dsearch->con = con;
+	dsearch->nick = parms->nick;
+	parms->nick = 0;
+	/* keep track of how many replies we expect back */
+	dsearch->numServers = list_count (Servers);
+	/* if we recieved this from a server, we expect 1 less reply since
+	   we don't send the search request back to the server that issued
+	   it */
+	if (ISSERVER (con))
+	    dsearch->numServers--;
+	ptr = POOL_ALLOC (&List_Pool);
+	if (!ptr)
+	{
+	    OUTOFMEMORY ("search_done");
+	    free_dsearch (dsearch);
+	    goto done;
+	}
+	ptr->data = dsearch;
+	Remote_Search = list_append (Remote_Search, ptr);
+	dsearch->timer = add_timer (Search_Timeout, 1,
+				    (timer_cb_t) expire_search, dsearch);
+	/* reform the search request to send to the remote servers */
+	generate_request (Buf, sizeof (Buf), max_results - n, parms->tokens,
+			  parms);
+	/* make a copy since pass_message_args() uses Buf[] */
+	request = STRDUP (Buf);
+	/* pass this message to all servers EXCEPT the one we recieved
+	   it from (if this was a remote search) */
+	pass_message_args (con, MSG_SERVER_REMOTE_SEARCH, "%s %s %s",
+			   dsearch->nick, dsearch->id, request);
+	FREE (request);
+	free_search (parms);
+	return;			/* delay sending the end-of-search message */
+    }
+
+  done:
+    if (ISUSER (con))
+	send_cmd (con, MSG_SERVER_SEARCH_END, "");
+    else
+    {
+	ASSERT (ISSERVER (con));
+	ASSERT (parms->id != 0);
+	send_cmd (con, MSG_SERVER_REMOTE_SEARCH_END, "%s", parms->id);
+    }
+    free_search (parms);
+}
+
+/* copy the search request and look up the file lists for it in the main
+   thread, then hand it off to be scanned.  returns 0 on success, in which
+   case search_done() takes care of ending the search */
+static int
+search_submit (SEARCH * request, LIST * tokens)
+{
+    SEARCH *parms;
+    FLIST *tmp;
+    LIST *ptok, **cur;
+    int i, j, nlists = list_count (tokens);
+
+    parms = CALLOC (1, sizeof (SEARCH) + nlists * (2 * sizeof (FLIST *) +
+						   sizeof (FLIST) +
+						   sizeof (int)));
+    if (!parms)
+    {
+	OUTOFMEMORY ("search_submit");
+	return -1;
+    }
+    *parms = *request;
+    parms->lists = (FLIST **) (parms + 1);
+    parms->view = parms->lists + nlists;
+    parms->pos = (int *) ((FLIST *) (parms->view + nlists) + nlists);
+    parms->id = 0;
+    parms->nick = 0;
+    parms->tokens = 0;
+    parms->nlists = 0;
+    if ((request->id && !(parms->id = STRDUP (request->id))) ||
+	!(parms->nick = STRDUP (request->user->nick)))
+    {
+	OUTOFMEMORY ("search_submit");
+	free_search (parms);
+	return -1;
+    }
+    /* the tokens point into the packet, which will be gone by the time
+       the search runs */
+    cur = &parms->tokens;
+    for (ptok = tokens; ptok; ptok = ptok->next)
+    {
+	if (!(*cur = POOL_ALLOC (&List_Pool)) ||
+	    !((*cur)->data = STRDUP (ptok->data)))
+	{
+	    OUTOFMEMORY ("search_submit");
+	    free_search (parms);
+	    return -1;
+	}
+	cur = &(*cur)->next;
+    }
+
+    /* look up the file list for each token, sorted so that the lists with
+       the fewest files in them come first */
+    for (i = 0, ptok = tokens; ptok; ptok = ptok->next, i++)
+    {
+	tmp = hash_lookup (File_Table, ptok->data);
+	if (!tmp)
+	{
+	    /* if there is no entry for this word in the hash table, then
+	       we know there are no matches */
+	    nlists = 0;
+	    break;
+	}
+	for (j = i; j > 0 && tmp->count < parms->lists[j - 1]->count; j--)
+	    parms->lists[j] = parms->lists[j - 1];
+	parms->lists[j] = tmp;
+    }
+    /* keep the lists from being compacted while they are being scanned */
+    for (i = 0; i < nlists; i++)
+	parms->lists[i]->pins++;
+    parms->nlists = nlists;
+
+    parms->job.run = (job_cb_t) search_run;
+    parms->job.done = (job_cb_t) search_done;
+    Search_Count++;
+    job_submit (&parms->job);
+    return 0;
+}
+
 /* common code for local and remote searching */
 static void
 search_internal (CONNECTION * con, USER * user, char *id, char *pkt)
 {
-    int i, n, max_results = Max_Search_Results, done = 1, local = 0;
+    int i, n, done = 1;
     int invalid = 0;
     LIST *tokens = 0;
     SEARCH parms;
@@ -470,13 +1012,14 @@ search_internal (CONNECTION * con, USER * user, char *id, char *pkt)
 
     /* set defaults */
     memset (&parms, 0, sizeof (parms));
-    parms.con = con;
+    parms.job.con = con;
     parms.user = user;
     parms.maxspeed = MAX_SPEED;
     parms.maxbitrate = MAX_BITRATE;
     parms.maxfreq = MAX_FREQUENCY;
     parms.type = CT_MP3;	/* search for audio/mp3 by default */
     parms.id = id;
+    parms.max_results = Max_Search_Results;
 
     /* prime the first argument */
     arg = next_arg (&pkt);
@@ -509,15 +1052,16 @@ search_internal (CONNECTION * con, USER * user, char *id, char *pkt)
 		invalid = 1;
 		goto done;
 	    }
-	    max_results = strtol (arg, &ptr, 10);
+	    parms.max_results = strtol (arg, &ptr, 10);
 	    if (*ptr)
 	    {
 		/* not a number */
 		invalid = 1;
 		goto done;
 	    }
-	    if (Max_Search_Results > 0 && max_results > Max_Search_Results)
-		max_results = Max_Search_Results;
+	    if (Max_Search_Results > 0 &&
+		parms.max_results > Max_Search_Results)
+		parms.max_results = Max_Search_Results;
 	}
 	else if (!strcasecmp ("type", arg))
 	{
@@ -584,7 +1128,7 @@ search_internal (CONNECTION * con, USER * user, char *id, char *pkt)
 	}
 	else if (!strcasecmp ("local", arg))
 	{
-	    local = 1;		/* only search for files from users on the same server */
+	    parms.local = 1;	/* only search for files from users on the same server */
 	}
 	else
 	{
@@ -595,72 +1139,8 @@ search_internal (CONNECTION * con, USER * user, char *id, char *pkt)
 	arg = next_arg (&pkt);	/* skip to next token */
     }
 
-    n = fdb_search (File_Table, tokens, max_results, search_callback, &parms);
-
-    if ((n < max_results) && !local &&
-	((ISSERVER (con) && list_count (Servers) > 1) ||
-	 (ISUSER (con) && Servers)))
-    {
-	char *request;
-	DSEARCH *dsearch;
-	LIST *ptr;
-
-	/* generate a new request structure */
-	dsearch = CALLOC (1, sizeof (DSEARCH));
-	if (!dsearch)
-	{
-	    OUTOFMEMORY ("search_internal");
-	    goto done;
-	}
-	dsearch->timestamp = Current_Time;
-	if (id)
-	{
-	    if ((dsearch->id = STRDUP (id)) == 0)
-	    {
-		OUTOFMEMORY ("search_internal");
-		FREE (dsearch);
-		goto done;
-	    }
-	}
-	else if ((dsearch->id = generate_search_id ()) == 0)
-	{
-	    FREE (dsearch);
-	    goto done;
-	}
-	dsearch->con = con;
-	if (!(dsearch->nick = STRDUP (user->nick)))
-	{
-	    OUTOFMEMORY ("search_internal");
-	    free_dsearch (dsearch);
-	    goto done;
-	}
-	/* keep track of how many replies we expect back */
-	dsearch->numServers = list_count (Servers);
-	/* if we recieved this from a server, we expect 1 less reply since
-	   we don't send the search request back to the server that issued
-	   it */
-	if (ISSERVER (con))
-	    dsearch->numServers--;
-	ptr = CALLOC (1, sizeof (LIST));
-	if (!ptr)
-	{
-	    OUTOFMEMORY ("search_internal");
-	    free_dsearch (dsearch);
-	    goto done;
-	}
-	ptr->data = dsearch;
-	Remote_Search = list_append (Remote_Search, ptr);
-	/* reform the search request to send to the remote servers */
-	generate_request (Buf, sizeof (Buf), max_results - n, tokens, &parms);
-	/* make a copy since pass_message_args() uses Buf[] */
-	request = STRDUP (Buf);
-	/* pass this message to all servers EXCEPT the one we recieved
-	   it from (if this was a remote search) */
-	pass_message_args (con, MSG_SERVER_REMOTE_SEARCH, "%s %s %s",
-			   dsearch->nick, dsearch->id, request);
-	FREE (request);
-	done = 0;		/* delay sending the end-of-search message */
-    }
+    if (search_submit (&parms, tokens) == 0)
+	done = 0;		/* search_done() sends the end-of-search message */
 
   done:
 
@@ -698,33 +1178,15 @@ HANDLER (search)
 static DSEARCH *
 find_search (const char *id)
 {
-    LIST **list;
-    LIST *tmp;
+    LIST *list;
     DSEARCH *ds;
 
-    list = &Remote_Search;
-    while (*list)
+    for (list = Remote_Search; list; list = list->next)
     {
-	ASSERT ((*list)->data != 0);
-	ds = (*list)->data;
+	ASSERT (list->data != 0);
+	ds = list->data;
 	if (!strcmp (ds->id, id))
 	    return ds;
-	/* expire timed-out search requests */
-	if (ds->timestamp + Search_Timeout < Current_Time)
-	{
-	    log ("find_search(): expiring request %s", ds->id);
-	    if (ISUSER (ds->con))
-		send_cmd (ds->con, MSG_SERVER_SEARCH_END, "");
-	    else
-		send_cmd (ds->con, MSG_SERVER_REMOTE_SEARCH_END, "%s",
-			  ds->id);
-	    tmp = *list;
-	    *list = (*list)->next;
-	    free_dsearch (ds);
-	    FREE (tmp);
-	    continue;
-	}
-	list = &(*list)->next;
     }
     return 0;
 }
@@ -863,6 +1325,7 @@ cancel_search (CONNECTION * con)
     int isServer = ISSERVER (con);
 
     ASSERT (validate_connection (con));
+    job_cancel (con);
     list = &Remote_Search;
     while (*list)
     {
@@ -882,10 +1345,18 @@ cancel_search (CONNECTION * con)
 	    }
 	    tmpList = *list;
 	    *list = (*list)->next;
-	    FREE (tmpList);
+	    POOL_FREE (&List_Pool, tmpList);
 	    free_dsearch (d);
 	    continue;
 	}
 	list = &(*list)->next;
     }
 }
+
+/* number of searches forwarded to our peers which are still waiting for
+   replies */
+int
+remote_search_count (void)
+{
+    return list_count (Remote_Search);
+}
@@ -52,7 +52,6 @@ try_connect (char *host, int port)
     cli->ip = ip;
     cli->port = port;
     cli->connecting = 1;
-    cli->timer = Current_Time;
     add_client (cli);
     return;
   error:
@@ -210,8 +209,10 @@ HANDLER (server_disconnect)
 	{
 	    tmpList = *list;
 	    *list = (*list)->next;
-	    FREE (tmpList);
+	    POOL_FREE (&List_Pool, tmpList);
 	    serv->destroy = 1;
+	    /* nothing is queued for it, so make sure it gets reaped */
+	    event_touch (serv);
 	    break;
 	}
     }
@@ -285,7 +285,7 @@ HANDLER (server_login_ack)
     set_tcp_buffer_len (con->fd, 16384);
 
     /* put this connection in the shortcut list to the server conections */
-    list = CALLOC (1, sizeof (LIST));
+    list = POOL_ALLOC (&List_Pool);
     if (!list)
     {
 	OUTOFMEMORY ("server_login_ack");
@@ -297,6 +297,9 @@ HANDLER (server_login_ack)
     Servers = list_append (Servers, list);
 
     con->class = CLASS_SERVER;
+    remove_clone (con->ip);	/* only users and logins are counted */
+    cancel_timer (con->timer);	/* login timeout */
+    con->timer = 0;
     con->opt.server = CALLOC (1, sizeof (SERVER));
     /* set up the compression handlers for this connection */
     init_compress (con, con->compress);
@@ -372,7 +375,7 @@ HANDLER (link_info)
     log ("link_info(): %s:%d -> %s:%d (%d hops away)",
 	 slink->peer, slink->peerport, slink->server, slink->port,
 	 slink->hops);
-    list = CALLOC (1, sizeof (LIST));
+    list = POOL_ALLOC (&List_Pool);
     if (!list)
     {
 	OUTOFMEMORY ("link_info");
@@ -482,7 +485,7 @@ remove_links (const char *host)
 	{
 	    tmpList = *list;
 	    *list = (*list)->next;
-	    FREE (tmpList);
+	    POOL_FREE (&List_Pool, tmpList);
 	    FREE (link->server);
 	    FREE (link->peer);
 	    FREE (link);
@@ -32,8 +32,11 @@ HANDLER (server_usage)
 	mem_used = MEMORY_USED;
 
 	numServers = list_count (Servers);
+	/* new fields are added at the end so as not to confuse older
+	   clients.  the last one is the number of shared files waiting to
+	   be indexed */
 	send_user (user, MSG_SERVER_USAGE_STATS,
-		  "%d %d %d %d %.0f %d %d %d %d %d %.2f %.2f %.2f %u %u",
+		  "%d %d %d %d %.0f %d %d %d %d %d %.2f %.2f %.2f %u %u %d",
 		  Num_Clients - numServers,
 		  numServers,
 		  Users->dbsize,
@@ -48,7 +51,8 @@ HANDLER (server_usage)
 		  (float) Bytes_Out / 1024. / delta,
 		  (float) Search_Count / delta,
 		  Total_Bytes_In,
-		  Total_Bytes_Out);
+		  Total_Bytes_Out,
+		  fdb_backlog ());
     }
     else
 	pass_message_args (con, tag, ":%s %s", user->nick, pkt);
@@ -86,44 +86,221 @@ send_user (USER * user, int tag, char *fmt, ...)
     queue_data (user->con, Buf, len + 4);
 }
 
+/* the connection did not complete its login within Login_Timeout seconds
+   of being set up by add_client() */
+static void
+login_timeout (CONNECTION * con)
+{
+    ASSERT (validate_connection (con));
+    ASSERT (con->class == CLASS_UNKNOWN);
+    con->timer = 0;
+    log ("login_timeout(): login timeout for %s", con->host);
+    if (con->server_login)
+	notify_mods (SERVERLOG_MODE, "Server link to %s timed out", con->host);
+    con->destroy = 1;
+    event_touch (con);		/* get it reaped */
+}
+
+/* unused positions in Clients[], the lowest on top */
+static int *Free_Ids = 0;
+static int Num_Free_Ids = 0;
+
 int
-add_client (CONNECTION * cli)
+conlist_add (CONLIST * l, CONNECTION * con)
 {
-    if (Max_Clients == Num_Clients)
+    if (l->count == l->max)
     {
-	/* no space left, allocate more */
-	if (safe_realloc
-	    ((void **) &Clients, sizeof (CONNECTION *) * (Max_Clients + 10)))
+	if (safe_realloc ((void **) &l->con, sizeof (CONNECTION *) *
+			  (l->max ? l->max * 2 : 64)))
 	{
-	    OUTOFMEMORY ("add_client");
-	    CLOSE (cli->fd);
-	    FREE (cli->host);
-	    FREE (cli);
+	    OUTOFMEMORY ("conlist_add");
 	    return -1;
 	}
-	memset (&Clients[Max_Clients + 1], 0, sizeof (CONNECTION *) * 9);
-	Max_Clients += 10;
-	Clients[Num_Clients] = cli;
-	cli->id = Num_Clients;
+	l->max = l->max ? l->max * 2 : 64;
     }
-    else
+    con->slot[l->slot] = l->count;
+    l->con[l->count++] = con;
+    return 0;
+}
+
+/* the last entry is moved into the hole, so when removing entries while
+   walking a list, walk it backwards */
+void
+conlist_remove (CONLIST * l, CONNECTION * con)
+{
+    int pos = con->slot[l->slot];
+
+    ASSERT (pos >= 0 && pos < l->count && l->con[pos] == con);
+    l->con[pos] = l->con[--l->count];
+    l->con[pos]->slot[l->slot] = pos;
+}
+
+/* local users who aren't sharing any files, in a heap ordered by the time
+   they connected so that eject_client() can find the oldest one quickly */
+static CONNECTION **Eject = 0;
+static int Eject_Count = 0;
+static int Eject_Max = 0;
+
+static void
+eject_set (int slot, CONNECTION * con)
+{
+    Eject[slot] = con;
+    con->uopt->eject = slot + 1;
+}
+
+static void
+eject_up (int slot, CONNECTION * con)
+{
+    int parent;
+
+    while (slot > 0)
+    {
+	parent = (slot - 1) / 2;
+	if (Eject[parent]->user->connected <= con->user->connected)
+	    break;
+	eject_set (slot, Eject[parent]);
+	slot = parent;
+    }
+    eject_set (slot, con);
+}
+
+static void
+eject_down (int slot, CONNECTION * con)
+{
+    int child;
+
+    while ((child = 2 * slot + 1) < Eject_Count)
     {
-	int i;
+	if (child + 1 < Eject_Count && Eject[child + 1]->user->connected <
+	    Eject[child]->user->connected)
+	    child++;
+	if (con->user->connected <= Eject[child]->user->connected)
+	    break;
+	eject_set (slot, Eject[child]);
+	slot = child;
+    }
+    eject_set (slot, con);
+}
 
-	/* find an empty spot for this connection */
-	for (i = 0; i < Max_Clients; i++)
+/* called when a local user logs in or stops sharing files */
+void
+eject_add (CONNECTION * con)
+{
+    ASSERT (ISUSER (con));
+    if (con->uopt->eject)
+	return;
+    if (Eject_Count == Eject_Max)
+    {
+	if (safe_realloc ((void **) &Eject, sizeof (CONNECTION *) *
+			  (Eject_Max ? Eject_Max * 2 : 64)))
 	{
-	    if (!Clients[i])
-	    {
-		Clients[i] = cli;
-		cli->id = i;
-		break;
-	    }
+	    OUTOFMEMORY ("eject_add");
+	    return;
+	}
+	Eject_Max = Eject_Max ? Eject_Max * 2 : 64;
+    }
+    eject_up (Eject_Count++, con);
+}
+
+/* called when a local user starts sharing files or goes away */
+void
+eject_remove (CONNECTION * con)
+{
+    CONNECTION *last;
+    int slot = con->uopt->eject - 1;
+
+    if (slot < 0)
+	return;
+    ASSERT (slot < Eject_Count && Eject[slot] == con);
+    con->uopt->eject = 0;
+    last = Eject[--Eject_Count];
+    if (last == con)
+	return;
+    if (slot > 0 &&
+	last->user->connected < Eject[(slot - 1) / 2]->user->connected)
+	eject_up (slot, last);
+    else
+	eject_down (slot, last);
+}
+
+/* returns the local user who has been connected the longest without
+   sharing any files */
+CONNECTION *
+eject_candidate (void)
+{
+    return Eject_Count ? Eject[0] : 0;
+}
+
+int
+add_client (CONNECTION * cli)
+{
+    int i, size;
+
+    if (!Num_Free_Ids)
+    {
+	/* no space left, double the size of the table */
+	size = Max_Clients ? Max_Clients * 2 : 64;
+	if (safe_realloc ((void **) &Clients, sizeof (CONNECTION *) * size)
+	    || safe_realloc ((void **) &Free_Ids, sizeof (int) * size))
+	{
+	    OUTOFMEMORY ("add_client");
+	    goto error;
 	}
+	memset (Clients + Max_Clients, 0,
+		sizeof (CONNECTION *) * (size - Max_Clients));
+	for (i = size - 1; i >= Max_Clients; i--)
+	    Free_Ids[Num_Free_Ids++] = i;
+	Max_Clients = size;
     }
+    if (conlist_add (&Live_Clients, cli))
+	goto error;
+    cli->id = Free_Ids[--Num_Free_Ids];
+    Clients[cli->id] = cli;
     Num_Clients++;
+    add_clone (cli->ip);
+    if (event_add (cli))
+    {
+	remove_client (cli);
+	goto error;
+    }
+    cli->timer = add_timer (Login_Timeout, 1, (timer_cb_t) login_timeout, cli);
     return 0;
+  error:
+    CLOSE (cli->fd);
+    FREE (cli->host);
+    FREE (cli);
+    return -1;
+}
+
+/* undo add_client() */
+void
+remove_client (CONNECTION * con)
+{
+    ASSERT (Clients[con->id] == con);
+    if (!ISSERVER (con))
+	remove_clone (con->ip);
+    Clients[con->id] = 0;
+    Free_Ids[Num_Free_Ids++] = con->id;
+    conlist_remove (&Live_Clients, con);
+    Num_Clients--;
+}
+
+#if DEBUG
+void
+free_clients (void)
+{
+    if (Clients)
+	FREE (Clients);
+    if (Free_Ids)
+	FREE (Free_Ids);
+    if (Live_Clients.con)
+	FREE (Live_Clients.con);
+    if (Local_Users.con)
+	FREE (Local_Users.con);
+    if (Eject)
+	FREE (Eject);
 }
+#endif /* DEBUG */
 
 /* no such user */
 void
@@ -192,8 +369,8 @@ validate_connection (CONNECTION * con)
     ASSERT_RETURN_IF_FAIL (con->magic == MAGIC_CONNECTION, 0);
     ASSERT_RETURN_IF_FAIL ((con->class == CLASS_USER) ^ (con->user == 0), 0);
     ASSERT_RETURN_IF_FAIL (VALID_STR (con->host), 0);
-    if (con->sendbuf)
-	ASSERT_RETURN_IF_FAIL (buffer_validate (con->sendbuf), 0);
+    if (con->sendq.head)
+	ASSERT_RETURN_IF_FAIL (buffer_validate (con->sendq.head), 0);
     if (con->recvbuf)
 	ASSERT_RETURN_IF_FAIL (buffer_validate (con->recvbuf), 0);
     if (ISUSER (con))
@@ -0,0 +1,235 @@
+/* Copyright (C) 2000 drscholl@users.sourceforge.net
+   This is free software distributed under the terms of the
+   GNU Public License.  See the file COPYING for details.
+
+   $Id$ */
+
+/* scan kernels used by the search engine.  on x86 processors with
+   SSE4.2 or AVX2 support vectorized versions are selected at runtime by
+   simd_init(), otherwise the portable versions are used. */
+
+#include <string.h>
+#include <ctype.h>
+#if HAVE_SIMD
+#include <immintrin.h>
+#endif
+#include "opennap.h"
+#include "debug.h"
+
+/* merge-based intersection of two id lists.  starting at positions *pa and
+   *pb, store the index (into `a') of up to `max' ids present in both lists
+   in `out' and return the number found.  the positions are updated so that
+   the next call continues where this one left off.  returns 0 once either
+   list is exhausted */
+static int
+intersect_scalar (const unsigned int *a, int na, int *pa,
+		  const unsigned int *b, int nb, int *pb, int *out, int max)
+{
+    int i = *pa, j = *pb, n = 0;
+
+    while (i < na && j < nb && n < max)
+    {
+	if (a[i] == b[j])
+	{
+	    out[n++] = i++;
+	    j++;
+	}
+	else if (ID_LT (a[i], b[j]))
+	    i++;
+	else
+	    j++;
+    }
+    *pa = i;
+    *pb = j;
+    return n;
+}
+
+/* returns nonzero if the lower case string `tok' appears in the first
+   `len' chars of `s', ignoring case.  there doesn't appear to be a
+   case-insensitive strchr() function so we fake it by using strpbrk() with
+   a buffer that contains the upper and lower case versions of the char */
+static int
+contains_scalar (const char *s, int len, const char *tok, int toklen)
+{
+    const char *b = s, *end = s + len - toklen;
+    char c[3];
+
+    c[0] = *tok;
+    c[1] = toupper ((unsigned char) *tok);
+    c[2] = 0;
+    while (b <= end)
+    {
+	b = strpbrk (b, c);
+	if (!b || b > end)
+	    return 0;
+	/* already compared the first char, see the if the rest of the
+	   string matches */
+	if (!strncasecmp (b + 1, tok + 1, toklen - 1))
+	    return 1;
+	b++;			/* skip the matched char to find the next occurance */
+    }
+    return 0;
+}
+
+#if HAVE_SIMD
+
+/* the vector versions compare blocks of ids from both lists against each
+   other, with all rotations of the block from `b'.  whichever block has the
+   smaller last element can't match anything further on in the other list
+   and is skipped */
+
+__attribute__ ((target ("sse4.2")))
+static int
+intersect_sse42 (const unsigned int *a, int na, int *pa,
+		 const unsigned int *b, int nb, int *pb, int *out, int max)
+{
+    int i = *pa, j = *pb, n = 0, m;
+    unsigned int amax, bmax;
+    __m128i va, vb, eq;
+
+    while (i + 4 <= na && j + 4 <= nb && n + 4 <= max)
+    {
+	va = _mm_loadu_si128 ((const __m128i *) (a + i));
+	vb = _mm_loadu_si128 ((const __m128i *) (b + j));
+	eq = _mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi32 (va, vb),
+					 _mm_cmpeq_epi32 (va,
+							  _mm_shuffle_epi32
+							  (vb, 0x39))),
+			   _mm_or_si128 (_mm_cmpeq_epi32
+					 (va, _mm_shuffle_epi32 (vb, 0x4e)),
+					 _mm_cmpeq_epi32 (va,
+							  _mm_shuffle_epi32
+							  (vb, 0x93))));
+	m = _mm_movemask_ps (_mm_castsi128_ps (eq));
+	while (m)
+	{
+	    out[n++] = i + __builtin_ctz (m);
+	    m &= m - 1;
+	}
+	amax = a[i + 3];
+	bmax = b[j + 3];
+	if (!ID_LT (bmax, amax))
+	    i += 4;
+	if (!ID_LT (amax, bmax))
+	    j += 4;
+    }
+    *pa = i;
+    *pb = j;
+    return n + intersect_scalar (a, na, pa, b, nb, pb, out + n, max - n);
+}
+
+__attribute__ ((target ("avx2")))
+static int
+intersect_avx2 (const unsigned int *a, int na, int *pa,
+		const unsigned int *b, int nb, int *pb, int *out, int max)
+{
+    int i = *pa, j = *pb, n = 0, m, r;
+    unsigned int amax, bmax;
+    __m256i va, vb, eq, rot;
+
+    rot = _mm256_setr_epi32 (1, 2, 3, 4, 5, 6, 7, 0);
+    while (i + 8 <= na && j + 8 <= nb && n + 8 <= max)
+    {
+	va = _mm256_loadu_si256 ((const __m256i *) (a + i));
+	vb = _mm256_loadu_si256 ((const __m256i *) (b + j));
+	eq = _mm256_cmpeq_epi32 (va, vb);
+	/* compare against the 7 other rotations of the block from `b' */
+	for (r = 1; r < 8; r++)
+	{
+	    vb = _mm256_permutevar8x32_epi32 (vb, rot);
+	    eq = _mm256_or_si256 (eq, _mm256_cmpeq_epi32 (va, vb));
+	}
+	m = _mm256_movemask_ps (_mm256_castsi256_ps (eq));
+	while (m)
+	{
+	    out[n++] = i + __builtin_ctz (m);
+	    m &= m - 1;
+	}
+	amax = a[i + 7];
+	bmax = b[j + 7];
+	if (!ID_LT (bmax, amax))
+	    i += 8;
+	if (!ID_LT (amax, bmax))
+	    j += 8;
+    }
+    *pa = i;
+    *pb = j;
+    return n + intersect_scalar (a, na, pa, b, nb, pb, out + n, max - n);
+}
+
+/* the vector substring search compares the first and last chars of the
+   token against every position in a block of the string at once, after
+   folding the block to lower case.  only positions where both match are
+   checked with strncasecmp() */
+
+__attribute__ ((target ("sse4.2")))
+static inline __m128i
+fold_sse42 (__m128i v)
+{
+    __m128i upper = _mm_and_si128 (_mm_cmpgt_epi8 (v, _mm_set1_epi8 ('A' - 1)),
+				   _mm_cmplt_epi8 (v, _mm_set1_epi8 ('Z' + 1)));
+
+    return _mm_or_si128 (v, _mm_and_si128 (upper, _mm_set1_epi8 (0x20)));
+}
+
+__attribute__ ((target ("sse4.2")))
+static int
+contains_sse42 (const char *s, int len, const char *tok, int toklen)
+{
+    int i = 0, m, p;
+    __m128i first = _mm_set1_epi8 (tok[0]);
+    __m128i last = _mm_set1_epi8 (tok[toklen - 1]);
+    __m128i x, y;
+
+    for (; i + toklen - 1 + 16 <= len; i += 16)
+    {
+	x = fold_sse42 (_mm_loadu_si128 ((const __m128i *) (s + i)));
+	y = fold_sse42 (_mm_loadu_si128 ((const __m128i *)
+					 (s + i + toklen - 1)));
+	m = _mm_movemask_epi8 (_mm_and_si128 (_mm_cmpeq_epi8 (x, first),
+					      _mm_cmpeq_epi8 (y, last)));
+	while (m)
+	{
+	    p = i + __builtin_ctz (m);
+	    if (toklen <= 2 || !strncasecmp (s + p + 1, tok + 1, toklen - 2))
+		return 1;
+	    m &= m - 1;
+	}
+    }
+    if (i + toklen > len)
+	return 0;
+    return contains_scalar (s + i, len - i, tok, toklen);
+}
+
+#endif /* HAVE_SIMD */
+
+int (*Ids_Intersect) (const unsigned int *, int, int *,
+		      const unsigned int *, int, int *, int *, int) =
+    intersect_scalar;
+int (*Str_Contains) (const char *, int, const char *, int) = contains_scalar;
+
+/* pick the best versions of the kernels this cpu supports */
+void
+simd_init (void)
+{
+#if HAVE_SIMD
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2"))
+    {
+	/* filenames are too short for 32 byte blocks to pay off in the
+	   substring search */
+	Ids_Intersect = intersect_avx2;
+	Str_Contains = contains_sse42;
+	log ("simd_init(): using AVX2 search kernels");
+	return;
+    }
+    if (__builtin_cpu_supports ("sse4.2"))
+    {
+	Ids_Intersect = intersect_sse42;
+	Str_Contains = contains_sse42;
+	log ("simd_init(): using SSE4.2 search kernels");
+	return;
+    }
+#endif /* HAVE_SIMD */
+    log ("simd_init(): using portable search kernels");
+}
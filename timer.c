@@ -6,123 +6,240 @@
 
    $Id$ */
 
+/* pending timers are kept in a binary heap ordered by expiry time, so
+   adding, cancelling and running a timer costs O(log n) regardless of how
+   many are pending.  this is cheap enough for every connection to have its
+   own timers (login timeout, flood throttling) rather than having the main
+   loop scan all of the clients.  times are kept in milliseconds */
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif /* WIN32 */
 #include <time.h>
 #include <stdlib.h>
 #include "opennap.h"
 #include "debug.h"
 
-typedef struct _timerstruct
+struct _timer
 {
-    struct _timerstruct *next;
     timer_cb_t func;
     void *arg;
-    time_t next_time;
-    time_t interval;
-    int events;
-    int refnum;
+    unsigned long next_time;	/* ms, see timer_now() */
+    int interval;		/* ms */
+    int events;			/* times left to run, -1 for forever */
+    int slot;			/* position in Heap, -1 while running */
+};
+
+static TIMER **Heap = 0;
+static int Heap_Count = 0;
+static int Heap_Max = 0;
+
+/* the clock wraps every 49 days, so times must only be compared by their
+   difference */
+#define BEFORE(a,b) ((long) ((a) - (b)) < 0)
+
+/* a monotonic clock is used where there is one, so that setting the
+   system time doesn't hold up or fire all of the timers */
+static unsigned long
+timer_now (void)
+{
+#if HAVE_CLOCK_GETTIME
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (unsigned long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#elif defined(WIN32)
+    return GetTickCount ();
+#else
+    struct timeval tv;
+
+    gettimeofday (&tv, 0);
+    return (unsigned long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
 }
-TIMER;
 
-static TIMER *Pending_Timers = NULL;
+static void
+heap_set (int slot, TIMER * t)
+{
+    Heap[slot] = t;
+    t->slot = slot;
+}
 
 static void
-schedule_timer (TIMER * ntimer)
+sift_up (int slot, TIMER * t)
 {
-    TIMER **slot;
+    int parent;
 
-    if (!ntimer->events)
-	return;
+    while (slot > 0)
+    {
+	parent = (slot - 1) / 2;
+	if (!BEFORE (t->next_time, Heap[parent]->next_time))
+	    break;
+	heap_set (slot, Heap[parent]);
+	slot = parent;
+    }
+    heap_set (slot, t);
+}
+
+static void
+sift_down (int slot, TIMER * t)
+{
+    int child;
 
-    /* we've created it, now put it in order */
-    for (slot = &Pending_Timers; *slot; slot = &(*slot)->next)
+    while ((child = 2 * slot + 1) < Heap_Count)
     {
-	if (ntimer->next_time < (*slot)->next_time)
+	if (child + 1 < Heap_Count &&
+	    BEFORE (Heap[child + 1]->next_time, Heap[child]->next_time))
+	    child++;
+	if (!BEFORE (Heap[child]->next_time, t->next_time))
 	    break;
+	heap_set (slot, Heap[child]);
+	slot = child;
     }
-    ntimer->next = *slot;
-    *slot = ntimer;
+    heap_set (slot, t);
 }
 
 static int
-make_refnum (void)
+schedule_timer (TIMER * t)
+{
+    if (Heap_Count == Heap_Max)
+    {
+	if (safe_realloc ((void **) &Heap, sizeof (TIMER *) *
+			  (Heap_Max ? Heap_Max * 2 : 64)))
+	{
+	    OUTOFMEMORY ("schedule_timer");
+	    return -1;
+	}
+	Heap_Max = Heap_Max ? Heap_Max * 2 : 64;
+    }
+    sift_up (Heap_Count++, t);
+    return 0;
+}
+
+/* take `t' out of the heap */
+static void
+unschedule_timer (TIMER * t)
 {
-    int count = 0;
-    TIMER *tmp;
+    TIMER *last;
+    int slot = t->slot;
 
-    for (tmp = Pending_Timers; tmp; tmp = tmp->next, count++)
-	;
-    return count + 1;
+    ASSERT (slot >= 0 && slot < Heap_Count && Heap[slot] == t);
+    last = Heap[--Heap_Count];
+    if (last != t)
+    {
+	/* move the last timer into the hole */
+	if (slot > 0 && BEFORE (last->next_time, Heap[(slot - 1) / 2]->next_time))
+	    sift_up (slot, last);
+	else
+	    sift_down (slot, last);
+    }
+    t->slot = -1;
 }
 
-void
-add_timer (int interval, int events, timer_cb_t func, void *arg)
+/* run `func' after `interval' milliseconds, `events' times or forever if
+   `events' is -1.  the returned handle may be passed to cancel_timer()
+   until the timer has run for the last time */
+TIMER *
+add_timer_ms (int interval, int events, timer_cb_t func, void *arg)
 {
     TIMER *new;
 
     if (!events)
-	return;
+	return 0;
     new = CALLOC (1, sizeof (TIMER));
     if (!new)
     {
-	OUTOFMEMORY ("add_timer");
-	return;
+	OUTOFMEMORY ("add_timer_ms");
+	return 0;
     }
-    new->next_time = Current_Time + interval;
+    new->next_time = timer_now () + interval;
     new->interval = interval;
     new->func = func;
     new->arg = arg;
     new->events = events;
-    new->refnum = make_refnum ();
-    schedule_timer (new);
+    if (schedule_timer (new))
+    {
+	FREE (new);
+	return 0;
+    }
+    return new;
 }
 
+/* same as add_timer_ms() with `interval' in seconds */
+TIMER *
+add_timer (int interval, int events, timer_cb_t func, void *arg)
+{
+    return add_timer_ms (interval * 1000, events, func, arg);
+}
+
+/* may be called from the timer's own callback */
 void
-exec_timers (time_t now)
+cancel_timer (TIMER * t)
+{
+    if (!t)
+	return;
+    if (t->slot == -1)
+    {
+	/* running now, exec_timers() frees it when the callback returns */
+	t->events = 0;
+	return;
+    }
+    unschedule_timer (t);
+    FREE (t);
+}
+
+void
+exec_timers (void)
 {
     TIMER *current;
+    unsigned long now = timer_now ();
 
-    while (Pending_Timers && Pending_Timers->next_time <= now)
+    while (Heap_Count > 0 && !BEFORE (now, Heap[0]->next_time))
     {
-	current = Pending_Timers;
-	Pending_Timers = current->next;
+	current = Heap[0];
+	unschedule_timer (current);
 	(*current->func) (current->arg);
-	switch (current->events)
-	{
-	case 0:
-	    FREE (current);
-	    break;
-	default:
+	if (current->events > 0)
 	    current->events--;
-	case -1:
-	    /* reschedule */
-	    current->next_time = Current_Time + current->interval;
-	    schedule_timer (current);
-	    break;
+	if (!current->events)
+	    FREE (current);
+	else
+	{
+	    /* reschedule.  timers which are due again right away wait for
+	       the next pass so that we don't loop here forever */
+	    current->next_time = timer_now () + current->interval;
+	    if (!BEFORE (now, current->next_time))
+		current->next_time = now + 1;
+	    if (schedule_timer (current))
+		FREE (current);
 	}
     }
 }
 
-/* returns the time offset at which the next pending event is scheduled */
-time_t next_timer (void)
+/* returns the number of milliseconds until the next pending event is
+   scheduled, or -1 if there are no timers */
+int
+next_timer (void)
 {
-    if (Pending_Timers)
-    {
-	if (Pending_Timers->next_time < Current_Time)
-	    return 0;		/* now! */
-	return (Pending_Timers->next_time - Current_Time);
-    }
-    return -1;
+    unsigned long now;
+
+    if (!Heap_Count)
+	return -1;
+    now = timer_now ();
+    if (!BEFORE (now, Heap[0]->next_time))
+	return 0;		/* now! */
+    return (int) (Heap[0]->next_time - now);
 }
 
 void
 free_timers (void)
 {
-    TIMER *ptr;
-
-    while (Pending_Timers)
-    {
-	ptr = Pending_Timers;
-	Pending_Timers = Pending_Timers->next;
-	FREE (ptr);
-    }
+    while (Heap_Count > 0)
+	FREE (Heap[--Heap_Count]);
+    if (Heap)
+	FREE (Heap);
+    Heap = 0;
+    Heap_Max = 0;
 }
@@ -23,6 +23,7 @@ HANDLER (topic)
     char *chanName, *nick, *ptr;
     LIST *list;
     CHANUSER *chanUser;
+    BLOCK *block;
 
     (void) len;
     ASSERT (validate_connection (con));
@@ -103,13 +104,16 @@ HANDLER (topic)
 
 	l = form_message (Buf, sizeof (Buf), tag, "%s %s", chan->name,
 			  chan->topic);
-	for (list = chan->users; list; list = list->next)
+	block = block_new (Buf, l);
+	for (list = chan->users; block && list; list = list->next)
 	{
 	    chanUser = list->data;
 	    ASSERT (chanUser->magic == MAGIC_CHANUSER);
 	    if (chanUser->user->local)
-		queue_data (chanUser->user->con, Buf, l);
+		queue_block (chanUser->user->con, block);
 	}
+	if (block)
+	    block_free (block);
 	notify_ops (chan, "%s set topic on %s: %s", nick,
 		    chan->name, chan->topic);
     }
@@ -18,6 +18,9 @@ HANDLER (upload_ok)
     USER *recip;
     DATUM *info = 0;
     int ac;
+#if RESUME
+    char hash[33];
+#endif
 
     (void) tag;
     (void) len;
@@ -50,7 +53,7 @@ HANDLER (upload_ok)
 		  "%s %u %d \"%s\" %s %d",
 		  recip->nick, recip->ip, recip->port, av[1],
 #if RESUME
-		  info->hash,
+		  datum_hash (info, hash),
 #else
 		  "00000000000000000000000000000000",
 #endif
@@ -62,7 +65,7 @@ HANDLER (upload_ok)
 	send_user (recip, MSG_SERVER_FILE_READY, "%s %u %d \"%s\" %s %d",
 		   con->user->nick, con->user->ip, con->user->port, av[1],
 #if RESUME
-		   info->hash,
+		   datum_hash (info, hash),
 #else
 		   "00000000000000000000000000000000",
 #endif
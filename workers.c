@@ -0,0 +1,299 @@
+/* Copyright (C) 2000 drscholl@users.sourceforge.net
+   This is free software distributed under the terms of the
+   GNU Public License.  See the file COPYING for details.
+
+   $Id$ */
+
+/* pool of threads for running searches in the background.  jobs are
+   handed to the threads with job_submit().  when a thread has finished a
+   job it writes to a pipe which the main loop waits on, and the main
+   thread then calls job_reap() to deliver the results.  everything other
+   than the job's run() callback happens in the main thread.
+
+   the threads read the File_Table lists while the main thread goes on
+   adding to them, so memory which a running job might still be looking at
+   must not be freed directly.  it is passed to retire() instead, which
+   holds on to it until every job submitted before it was retired has been
+   reaped.  lists which are in use by a job are marked with FLIST.pins so
+   that they are not compacted or removed in the meantime. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <signal.h>
+#endif /* !WIN32 */
+#if HAVE_THREADS
+#include <pthread.h>
+#endif /* HAVE_THREADS */
+#include "opennap.h"
+#include "debug.h"
+
+/* jobs which have been submitted but not yet reaped, in the order they
+   were submitted */
+static JOB *Jobs = 0;
+static unsigned int Job_Seq = 0;
+
+typedef struct
+{
+    void *ptr;
+    unsigned int seq;		/* last job submitted when this was retired */
+}
+RETIRED;
+
+static RETIRED *Retired = 0;
+static int Num_Retired = 0;
+static int Max_Retired = 0;
+
+#if HAVE_THREADS
+static JOB **Jobs_Tail = &Jobs;
+static pthread_t *Threads = 0;
+static int Num_Threads = 0;
+
+/* protects everything below as well as JOB.finished */
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Wakeup = PTHREAD_COND_INITIALIZER;
+static JOB *Queue = 0;		/* jobs waiting for a thread */
+static JOB **Queue_Tail = &Queue;
+static int Finished = 0;	/* jobs finished since the last job_reap() */
+static int Quit = 0;
+static int Pipe[2] = { -1, -1 };
+
+static void *
+worker (void *arg)
+{
+    JOB *job;
+    char c = 0;
+
+    (void) arg;
+    pthread_mutex_lock (&Lock);
+    for (;;)
+    {
+	while (!Queue && !Quit)
+	    pthread_cond_wait (&Wakeup, &Lock);
+	if (Quit)
+	    break;
+	job = Queue;
+	Queue = job->qnext;
+	if (!Queue)
+	    Queue_Tail = &Queue;
+	pthread_mutex_unlock (&Lock);
+
+	job->run (job);
+
+	pthread_mutex_lock (&Lock);
+	job->finished = 1;
+	/* the main thread only needs to be woken up once per batch */
+	if (Finished++ == 0)
+	    write (Pipe[1], &c, 1);
+    }
+    pthread_mutex_unlock (&Lock);
+    return 0;
+}
+#endif /* HAVE_THREADS */
+
+/* start the search threads.  returns the fd the main loop should wait on
+   for finished jobs, or -1 if searches are to be run in the main thread */
+int
+workers_init (void)
+{
+#if HAVE_THREADS
+    int i;
+    sigset_t all, old;
+
+    if (Search_Threads <= 0)
+	return -1;
+    if (pipe (Pipe) == -1)
+    {
+	logerr ("workers_init", "pipe");
+	return -1;
+    }
+    set_nonblocking (Pipe[0]);
+    set_nonblocking (Pipe[1]);
+    Threads = CALLOC (Search_Threads, sizeof (pthread_t));
+    if (!Threads)
+    {
+	OUTOFMEMORY ("workers_init");
+	return -1;
+    }
+    /* signals are handled by the main thread */
+    sigfillset (&all);
+    pthread_sigmask (SIG_BLOCK, &all, &old);
+    for (i = 0; i < Search_Threads; i++)
+    {
+	if (pthread_create (&Threads[i], 0, worker, 0))
+	{
+	    log ("workers_init(): unable to create search thread");
+	    break;
+	}
+    }
+    pthread_sigmask (SIG_SETMASK, &old, 0);
+    Num_Threads = i;
+    if (!Num_Threads)
+	return -1;
+    log ("workers_init(): started %d search threads", Num_Threads);
+    return Pipe[0];
+#else
+    return -1;
+#endif /* HAVE_THREADS */
+}
+
+void
+job_submit (JOB * job)
+{
+    job->seq = ++Job_Seq;
+    job->finished = 0;
+#if HAVE_THREADS
+    if (Num_Threads > 0)
+    {
+	job->next = 0;
+	*Jobs_Tail = job;
+	Jobs_Tail = &job->next;
+
+	pthread_mutex_lock (&Lock);
+	job->qnext = 0;
+	*Queue_Tail = job;
+	Queue_Tail = &job->qnext;
+	pthread_cond_signal (&Wakeup);
+	pthread_mutex_unlock (&Lock);
+	return;
+    }
+#endif /* HAVE_THREADS */
+    /* no threads, just do it now */
+    job->run (job);
+    job->done (job);
+}
+
+/* called when `con' is going away.  the jobs still run to completion, but
+   their results are thrown away */
+void
+job_cancel (CONNECTION * con)
+{
+    JOB *job;
+
+    for (job = Jobs; job; job = job->next)
+	if (job->con == con)
+	    PUBLISH (job->con, 0);
+}
+
+/* free retired memory which no outstanding job can be using */
+static void
+reclaim (void)
+{
+    int i;
+
+    for (i = 0; i < Num_Retired; i++)
+    {
+	if (Jobs && !ID_LT (Retired[i].seq, Jobs->seq))
+	    break;
+	FREE (Retired[i].ptr);
+    }
+    if (i > 0)
+    {
+	Num_Retired -= i;
+	memmove (Retired, Retired + i, sizeof (RETIRED) * Num_Retired);
+    }
+}
+
+/* called from the main loop when the job pipe is readable.  jobs for the
+   same connection are delivered in the order they were submitted, so that
+   the results of one search are not mixed up with the end of another */
+void
+job_reap (void)
+{
+#if HAVE_THREADS
+    JOB **list, *job, *done = 0, **tail = &done;
+    char buf[64];
+
+    pthread_mutex_lock (&Lock);
+    while (read (Pipe[0], buf, sizeof (buf)) > 0)
+	;
+    Finished = 0;
+    for (list = &Jobs; (job = *list);)
+    {
+	if (job->finished && !(job->con && job->con->jobwait))
+	{
+	    *list = job->next;
+	    *tail = job;
+	    tail = &job->next;
+	    continue;
+	}
+	if (job->con)
+	    job->con->jobwait = 1;
+	list = &job->next;
+    }
+    Jobs_Tail = list;
+    pthread_mutex_unlock (&Lock);
+
+    for (job = Jobs; job; job = job->next)
+	if (job->con)
+	    job->con->jobwait = 0;
+    *tail = 0;
+    while ((job = done))
+    {
+	done = job->next;
+	job->done (job);
+    }
+    reclaim ();
+#endif /* HAVE_THREADS */
+}
+
+/* free `ptr' once the search threads can no longer be looking at it */
+void
+retire (void *ptr)
+{
+    if (!Jobs)
+    {
+	FREE (ptr);
+	return;
+    }
+    if (Num_Retired == Max_Retired)
+    {
+	if (safe_realloc ((void **) &Retired,
+			  sizeof (RETIRED) * (Max_Retired + 64)))
+	{
+	    OUTOFMEMORY ("retire");
+	    return;		/* leak it rather than risk a crash */
+	}
+	Max_Retired += 64;
+    }
+    Retired[Num_Retired].ptr = ptr;
+    Retired[Num_Retired].seq = Job_Seq;
+    Num_Retired++;
+}
+
+/* stop the search threads and throw away any jobs they haven't done */
+void
+workers_close (void)
+{
+#if HAVE_THREADS
+    JOB *job;
+    int i;
+
+    if (Num_Threads > 0)
+    {
+	pthread_mutex_lock (&Lock);
+	Quit = 1;
+	pthread_cond_broadcast (&Wakeup);
+	pthread_mutex_unlock (&Lock);
+	for (i = 0; i < Num_Threads; i++)
+	    pthread_join (Threads[i], 0);
+	Num_Threads = 0;
+	while ((job = Jobs))
+	{
+	    Jobs = job->next;
+	    job->con = 0;
+	    job->done (job);
+	}
+	Jobs_Tail = &Jobs;
+	CLOSE (Pipe[0]);
+	CLOSE (Pipe[1]);
+    }
+    if (Threads)
+	FREE (Threads);
+#endif /* HAVE_THREADS */
+    reclaim ();
+    if (Retired)
+	FREE (Retired);
+}